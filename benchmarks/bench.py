@@ -0,0 +1,259 @@
+"""
+Benchmarks of TTLRU against functools.lru_cache and a pure Python OrderedDict LRU.
+
+Every workload is a trace of keys replayed as cache-aside reads: get the key
+and set it on a miss. The report has the throughput, the latency percentiles
+of a sample of the operations, the hit rate and the memory per entry.
+
+    PYTHONPATH=. python benchmarks/bench.py          # the default sizes and workloads
+    PYTHONPATH=. python benchmarks/bench.py --sizes 1e3,1e7 --workloads zipf,scan
+    python setup.py bench --args="--sizes 1e4 --json out.json"   # builds first
+
+The traces come from a seeded random generator, so two runs replay the same
+operations.
+"""
+import argparse
+import functools
+import gc
+import json
+import math
+import random
+import sys
+import time
+import tracemalloc
+from collections import OrderedDict
+
+from ttlru import TTLRU
+
+MS = 10**6
+
+
+class OrderedDictLRU(object):
+    """The usual pure Python LRU, the baseline TTLRU should beat."""
+
+    def __init__(self, size):
+        self.size = size
+        self.data = OrderedDict()
+
+    def get(self, key, default=None):
+        try:
+            value = self.data[key]
+        except KeyError:
+            return default
+        self.data.move_to_end(key)
+        return value
+
+    def __setitem__(self, key, value):
+        data = self.data
+        data[key] = value
+        data.move_to_end(key)
+        if len(data) > self.size:
+            data.popitem(last=False)
+
+    def __len__(self):
+        return len(self.data)
+
+
+def zipf_trace(rng, n, keys, s):
+    """n ranks in [0, keys) with P(rank) ~ 1 / (rank + 1) ** s, by inverting the continuous CDF."""
+    if s == 1.0:
+        log_keys = math.log(keys)
+        return [int(math.exp(rng.random() * log_keys)) - 1 for _ in range(n)]
+    a = 1.0 - s
+    top = keys ** a - 1.0
+    return [min(int((rng.random() * top + 1.0) ** (1.0 / a)) - 1, keys - 1) for _ in range(n)]
+
+
+def scan_trace(rng, n, keys, s, scan_every, scan_len):
+    """A Zipf trace with a scan of keys that are never read again every scan_every reads."""
+    trace = zipf_trace(rng, n, keys, s)
+    fresh = keys
+    for start in range(scan_every, n, scan_every + scan_len):
+        trace[start:start] = range(fresh, fresh + scan_len)
+        fresh += scan_len
+    return trace[:n]
+
+
+# name -> (description, trace factory(rng, n, size), ttl choices or None)
+WORKLOADS = OrderedDict([
+    ('zipf', ('Zipf 0.99 over 4x size keys, hit heavy',
+              lambda rng, n, size: zipf_trace(rng, n, size * 4, 0.99), None)),
+    ('zipf-flat', ('Zipf 0.7 over 10x size keys, miss and evict heavy',
+                   lambda rng, n, size: zipf_trace(rng, n, size * 10, 0.7), None)),
+    ('scan', ('Zipf 0.99 with a scan of size/2 new keys every 2x size reads',
+              lambda rng, n, size: scan_trace(rng, n, size * 4, 0.99, size * 2, max(1, size // 2)), None)),
+    ('ttl-mix', ('Zipf 0.99, sets with no ttl, 1ms, 10ms or 1s',
+                 lambda rng, n, size: zipf_trace(rng, n, size * 4, 0.99), (-1, MS, 10 * MS, 1000 * MS))),
+    ('uniform', ('uniform over 2x size keys, every other read misses',
+                 lambda rng, n, size: [rng.randrange(size * 2) for _ in range(n)], None)),
+])
+
+
+def run_ttlru(cache, trace, ttls, rng, sample):
+    """Replay trace on a TTLRU like cache, returns (seconds, hits, sampled latencies in ns)."""
+    get = cache.get
+    clock = time.perf_counter_ns
+    latencies = []
+    hits = 0
+    if ttls:
+        ttl_of = [rng.choice(ttls) for _ in range(1024)]
+        set_with_ttl = cache.set_with_ttl
+    start = time.perf_counter()
+    for i, key in enumerate(trace):
+        timed = i % sample == 0
+        if timed:
+            t0 = clock()
+        if get(key) is None:
+            if ttls:
+                set_with_ttl(key, key, ttl_of[i & 1023])
+            else:
+                cache[key] = key
+        else:
+            hits += 1
+        if timed:
+            latencies.append(clock() - t0)
+    return time.perf_counter() - start, hits, latencies
+
+
+def run_lru_cache(size, trace, sample):
+    misses = [0]
+
+    @functools.lru_cache(maxsize=size)
+    def load(key):
+        misses[0] += 1
+        return key
+
+    clock = time.perf_counter_ns
+    latencies = []
+    start = time.perf_counter()
+    for i, key in enumerate(trace):
+        if i % sample == 0:
+            t0 = clock()
+            load(key)
+            latencies.append(clock() - t0)
+        else:
+            load(key)
+    return time.perf_counter() - start, len(trace) - misses[0], latencies
+
+
+def bytes_per_entry(factory, size):
+    """Memory taken by the cache for size entries whose keys and values already exist."""
+    keys = list(range(size))
+    gc.collect()
+    tracemalloc.start()
+    before = tracemalloc.get_traced_memory()[0]
+    cache = factory(size)
+    if cache is None:
+        load = functools.lru_cache(maxsize=size)(lambda key: key)
+        for key in keys:
+            load(key)
+        cache = load
+    else:
+        for key in keys:
+            cache[key] = key
+    used = tracemalloc.get_traced_memory()[0] - before
+    tracemalloc.stop()
+    del cache
+    return used / float(size)
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p))]
+
+
+IMPLEMENTATIONS = OrderedDict([
+    ('ttlru', lambda size: TTLRU(size)),
+    ('ttlru-tinylfu', lambda size: TTLRU(size, policy='tinylfu')),
+    ('ttlru-clock', lambda size: TTLRU(size, approximate=True)),
+    ('lru_cache', lambda size: None),
+    ('ordereddict', lambda size: OrderedDictLRU(size)),
+])
+
+
+def bench(size, workload, impl, ops, sample, seed, memory):
+    description, make_trace, ttls = WORKLOADS[workload]
+    rng = random.Random(seed)
+    trace = make_trace(rng, ops, size)
+    factory = IMPLEMENTATIONS[impl]
+    if impl == 'lru_cache':
+        if ttls:
+            return None
+        seconds, hits, latencies = run_lru_cache(size, trace, sample)
+    else:
+        if ttls and impl == 'ordereddict':
+            return None
+        seconds, hits, latencies = run_ttlru(factory(size), trace, ttls, rng, sample)
+    latencies.sort()
+    result = OrderedDict([
+        ('size', size),
+        ('workload', workload),
+        ('impl', impl),
+        ('ops', len(trace)),
+        ('ops_per_s', len(trace) / seconds),
+        ('hit_rate', hits / float(len(trace))),
+        ('p50_ns', percentile(latencies, 0.50)),
+        ('p99_ns', percentile(latencies, 0.99)),
+        ('p999_ns', percentile(latencies, 0.999)),
+    ])
+    if memory:
+        result['bytes_per_entry'] = bytes_per_entry(factory, size)
+    return result
+
+
+def parse_sizes(text):
+    return [int(float(s)) for s in text.split(',') if s]
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('--sizes', default='1e3,1e5,1e6', type=parse_sizes,
+                        help='cache sizes, up to 1e7 (default: %(default)s)')
+    parser.add_argument('--workloads', default=','.join(WORKLOADS),
+                        help='comma separated, from %s' % ', '.join(WORKLOADS))
+    parser.add_argument('--impls', default=','.join(IMPLEMENTATIONS),
+                        help='comma separated, from %s' % ', '.join(IMPLEMENTATIONS))
+    parser.add_argument('--ops', type=int, default=0,
+                        help='operations per run, 0 for 4x the size, at least 200000')
+    parser.add_argument('--sample', type=int, default=64,
+                        help='time one operation out of SAMPLE for the percentiles')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--no-memory', dest='memory', action='store_false',
+                        help='skip the bytes per entry measure')
+    parser.add_argument('--json', help='also write the results to this file')
+    args = parser.parse_args(argv)
+
+    workloads = [w for w in args.workloads.split(',') if w]
+    impls = [i for i in args.impls.split(',') if i]
+    for name in workloads:
+        if name not in WORKLOADS:
+            parser.error('unknown workload %r' % name)
+    for name in impls:
+        if name not in IMPLEMENTATIONS:
+            parser.error('unknown implementation %r' % name)
+
+    print('%-9s %-10s %-14s %12s %6s %8s %8s %8s %9s' % (
+        'size', 'workload', 'impl', 'ops/s', 'hit%', 'p50 ns', 'p99 ns', 'p999 ns', 'B/entry'))
+    results = []
+    for size in args.sizes:
+        ops = args.ops or max(200000, size * 4)
+        for workload in workloads:
+            for impl in impls:
+                result = bench(size, workload, impl, ops, args.sample, args.seed, args.memory)
+                if result is None:
+                    continue
+                results.append(result)
+                print('%-9d %-10s %-14s %12.0f %6.1f %8d %8d %8d %9s' % (
+                    size, workload, impl, result['ops_per_s'], 100 * result['hit_rate'],
+                    result['p50_ns'], result['p99_ns'], result['p999_ns'],
+                    '%.1f' % result['bytes_per_entry'] if args.memory else '-'))
+                sys.stdout.flush()
+    if args.json:
+        with open(args.json, 'w') as f:
+            json.dump(results, f, indent=2)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -1,7 +1,33 @@
-from setuptools import setup, Extension
+import os
+import shlex
+import subprocess
+import sys
+from setuptools import setup, Command, Extension
 
+# shm_open of SharedTTLRU is in librt before glibc 2.34
 module1 = Extension('ttlru',
-                    sources = ['ttlru.c'])
+                    sources = ['ttlru.c'],
+                    depends = ['ttlru_capi.h'],
+                    libraries = ['rt'] if sys.platform.startswith('linux') else [])
+
+
+class BenchCommand(Command):
+    """python setup.py bench [--args="..."], build in place and run benchmarks/bench.py"""
+    description = 'run the benchmarks'
+    user_options = [('args=', None, 'arguments of benchmarks/bench.py')]
+
+    def initialize_options(self):
+        self.args = ''
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        self.reinitialize_command('build_ext', inplace=1)
+        self.run_command('build_ext')
+        env = dict(os.environ, PYTHONPATH=os.path.abspath('.'))
+        subprocess.check_call([sys.executable, 'benchmarks/bench.py'] + shlex.split(self.args), env=env)
+
 
 setup (name = 'ttlru-dict',
        version = '1.0.3',
@@ -13,6 +39,8 @@ setup (name = 'ttlru-dict',
        license='MIT',
        keywords='ttl, lru, dict, cache',
        ext_modules = [module1],
+       headers = ['ttlru_capi.h'],
+       cmdclass = {'bench': BenchCommand},
        classifiers=[
         'Development Status :: 5 - Production/Stable',
         'Intended Audience :: Developers',
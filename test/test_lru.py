@@ -1,15 +1,25 @@
 import gc
+import os
 import random
 import sys
 import unittest
+import threading
 import time
-from ttlru import TTLRU
+import ttlru
+from ttlru import TTLRU, ShardedTTLRU
 
 SIZES = [1, 2, 10, 1000]
 
 # Only available on debug python builds.
 gettotalrefcount = getattr(sys, 'gettotalrefcount', lambda: 0)
 
+# module level, so pickle finds them
+def weigh_len(key, value):
+    return len(value)
+
+def refresh_none(key, value):
+    return None
+
 class TestTTLRU(unittest.TestCase):
 
     def setUp(self):
@@ -485,6 +495,1078 @@ class TestTTLRU(unittest.TestCase):
         time.sleep(0.01)  # approximately 0.03s
         self.assertEqual(l.items(), [])
 
+    def test_insert_evicts_expired_first(self):
+        l = TTLRU(3)
+        l.set_with_ttl(0, 0, -1)
+        l.set_with_ttl(1, 1, int(10e6))
+        l.set_with_ttl(2, 2, -1)
+        time.sleep(0.02)
+        l[3] = 3
+        # 1 has expired, so it is dropped instead of the LRU item 0
+        self.assertEqual(l.keys(), [3, 2, 0])
+
+        l = TTLRU(3)
+        l.set_with_ttl(0, 0, int(80e6))
+        l.set_with_ttl(1, 1, int(80e6))
+        l.set_with_ttl(2, 2, int(10e6))
+        l.set_with_ttl(0, 0, int(10e6))   # shorter ttl on update
+        time.sleep(0.02)
+        l[3] = 3
+        l[4] = 4
+        self.assertEqual(l.keys(), [4, 3, 1])
+
+    def test_len_with_ttl(self):
+        l = TTLRU(10)
+        for i in range(5):
+            l.set_with_ttl(i, i, int(10e6))
+        for i in range(5, 8):
+            l.set_with_ttl(i, i, -1)
+        self.assertEqual(len(l), 8)
+        time.sleep(0.02)
+        self.assertEqual(len(l), 3)
+        self.assertEqual(l.keys(), [7, 6, 5])
+        del l[6]
+        self.assertEqual(len(l), 2)
+
+        # len() only counts, the callback runs when the items are removed
+        evicted = []
+        l = TTLRU(2000, callback=lambda k, v: evicted.append(k), clock='tick')
+        l.tick(0)
+        for i in range(1000):
+            l.set_with_ttl(i, i, 10 + i % 7)
+        l['forever'] = 1
+        l.tick(100)
+        self.assertEqual(len(l), 1)
+        self.assertEqual(evicted, [])
+        self.assertEqual(l.get_metrics()['expired_items'], 1000)
+        self.assertEqual(l.purge_expired(), 1000)
+        self.assertEqual((len(l), len(evicted)), (1, 1000))
+
+    def test_purge_expired(self):
+        l = TTLRU(10)
+        for i in range(6):
+            l.set_with_ttl(i, i, int(10e6))
+        l.set_with_ttl(6, 6, -1)
+        self.assertEqual(l.purge_expired(), 0)
+        time.sleep(0.02)
+        self.assertEqual(l.purge_expired(max_items=2), 2)
+        self.assertEqual(l.purge_expired(max_ns=int(1e9)), 4)
+        self.assertEqual(l.purge_expired(), 0)
+        self.assertEqual(l.items(), [(6, 6)])
+        self.assertEqual(l.get_purge_stats(), (6, 0))
+        self.assertRaises(ValueError, l.purge_expired, -1)
+
+    def test_auto_purge(self):
+        l = TTLRU(10, auto_purge=2)
+        for i in range(5):
+            l.set_with_ttl(i, str(i), int(10e6))
+        time.sleep(0.02)
+        l[5] = '5'
+        self.assertEqual(l.get_purge_stats(), (0, 2))
+        del l[5]
+        self.assertEqual(l.get_purge_stats(), (0, 4))
+        l.set_auto_purge(0)
+        l[5] = '5'
+        self.assertEqual(l.get_purge_stats(), (0, 4))
+        self.assertRaises(ValueError, TTLRU, 1, auto_purge=-1)
+
+    def test_hash_collisions(self):
+        class Key(object):
+            def __init__(self, v):
+                self.v = v
+            def __hash__(self):
+                return self.v % 3
+            def __eq__(self, other):
+                return isinstance(other, Key) and other.v == self.v
+
+        l = TTLRU(50)
+        for i in range(100):
+            l[Key(i)] = i
+        self.assertEqual(len(l), 50)
+        for i in range(50, 100):
+            self.assertEqual(l[Key(i)], i)
+        for i in range(50):
+            self.assertFalse(Key(i) in l)
+        for i in range(50, 100, 2):
+            del l[Key(i)]
+        self.assertEqual([k.v for k in l.keys()], list(range(99, 50, -2)))
+
+    def test_key_compare_mutates(self):
+        class Key(object):
+            def __init__(self, l):
+                self.l = l
+            def __hash__(self):
+                return 1
+            def __eq__(self, other):
+                self.l.clear()
+                return False
+
+        l = TTLRU(10)
+        l[Key(l)] = 1
+        l[Key(l)] = 2
+        self.assertEqual(len(l), 1)
+        self.assertEqual(l.values(), [2])
+
+    def test_expired_release_mutates(self):
+        class Value(object):
+            def __init__(self, l, key):
+                self.l = l
+                self.key = key
+            def __del__(self):
+                self.l.pop(self.key, None)
+
+        def make(tail):
+            l = TTLRU(10, clock='tick')
+            l.tick(0)
+            if tail:
+                l.set_with_ttl('a', Value(l, 'b'), 5)
+                l['b'] = 'live'
+            else:
+                l['b'] = 'live'
+                l.set_with_ttl('a', Value(l, 'b'), 5)
+            l.tick(10)
+            return l
+
+        self.assertEqual(make(False).keys(), ['b'])
+        self.assertEqual(make(False).values(), ['live'])
+        self.assertEqual(make(False).items(), [('b', 'live')])
+        self.assertEqual(make(False).peek_first_item(), ('b', 'live'))
+        self.assertEqual(make(True).peek_last_item(), ('b', 'live'))
+        self.assertEqual(make(True).popitem(), ('b', 'live'))
+        l = make(False)
+        self.assertEqual(l.popitem(least_recent=False), ('b', 'live'))
+        self.assertEqual(len(l), 0)
+        for name in ('keys', 'values', 'items', 'peek_first_item'):
+            l = make(False)
+            getattr(l, name)()
+            self.assertEqual(l.keys(), [])
+            self.assertEqual(len(l), 0)
+
+        class Key(object):
+            armed = False
+            def __init__(self, l):
+                self.l = l
+            def __hash__(self):
+                return 1
+            def __eq__(self, other):
+                if Key.armed:
+                    self.l.clear()
+                return False
+
+        l = TTLRU(10)
+        for i in range(3):
+            l[Key(l)] = i
+        Key.armed = True
+        self.assertTrue(repr(l).startswith('{'))
+        self.assertEqual(len(l), 0)
+
+    def test_pool_reuse(self):
+        l = TTLRU(10)
+        for i in range(1000):
+            l[i] = i
+        stats = l.get_pool_stats()
+        self.assertEqual(stats['capacity'], 11)
+        self.assertEqual(stats['used'], 10)
+        self.assertEqual(stats['free'], 1)
+        grows = stats['grows']
+        for i in range(1000):
+            l[i] = i
+        self.assertEqual(l.get_pool_stats()['grows'], grows)
+        self.assertTrue(l.get_pool_stats()['reused'] >= 1980)
+
+    def test_preallocate(self):
+        l = TTLRU(100, preallocate=True)
+        self.assertEqual(l.get_pool_stats()['capacity'], 101)
+        self.assertEqual(l.get_pool_stats()['grows'], 1)
+        for i in range(500):
+            l[i] = str(i)
+        l.clear()
+        for i in range(100):
+            l[i] = str(i)
+        self._check_kvi(range(99, -1, -1), l)
+        self.assertEqual(l.get_pool_stats()['grows'], 1)
+
+    def test_tick_clock(self):
+        l = TTLRU(10, ttl=100, clock='tick')
+        now = l.tick(1000)
+        self.assertEqual(now, 1000)
+        self.assertEqual(l.now(), 1000)
+        l[0] = 0
+        l.set_with_ttl(1, 1, 200)
+        time.sleep(0.01)
+        self.assertEqual(l.items(), [(1, 1), (0, 0)])
+        l.tick(1100)
+        self.assertEqual(l.items(), [(1, 1), (0, 0)])
+        l.tick(1101)
+        self.assertEqual(l.items(), [(1, 1)])
+        l.tick(1201)
+        self.assertEqual(l.items(), [])
+        self.assertTrue(l.tick() > 0)
+
+    def test_clock_options(self):
+        for clock in ('monotonic', 'coarse', 'system'):
+            l = TTLRU(2, clock=clock)
+            l.set_with_ttl(0, 0, int(20e6))
+            self.assertTrue(0 in l)
+            time.sleep(0.04)
+            self.assertFalse(0 in l)
+            self.assertRaises(TypeError, l.tick)
+        self.assertRaises(ValueError, TTLRU, 2, clock='sundial')
+
+    def test_get_many(self):
+        l = TTLRU(10)
+        for i in range(5):
+            l[i] = str(i)
+        self.assertEqual(l.get_many([0, 2, 9]), ['0', '2', None])
+        self.assertEqual(l.get_many(iter([4, 9]), default='x'), ['4', 'x'])
+        self.assertEqual(l.get_many([1, 9], as_dict=True), {1: '1'})
+        self.assertEqual(l.get_stats(), (4, 3))
+        self.assertEqual(l.keys()[:2], [1, 4])
+        self.assertRaises(TypeError, l.get_many, [[1]])
+
+    def test_set_many(self):
+        l = TTLRU(3)
+        l.set_many([(0, '0'), (1, '1', int(10e6)), (2, '2')])
+        self._check_kvi([2, 1, 0], l)
+        l.set_many({3: '3'})
+        self._check_kvi([3, 2, 1], l)
+        time.sleep(0.02)
+        self._check_kvi([3, 2], l)
+        l.set_many([(4, '4')], int(10e6))
+        time.sleep(0.02)
+        self._check_kvi([3, 2], l)
+        self.assertRaises(ValueError, l.set_many, [(1,)])
+        self.assertRaises(TypeError, l.set_many, 1)
+
+    def test_delete_many(self):
+        l = TTLRU(5)
+        for i in range(5):
+            l[i] = str(i)
+        self.assertEqual(l.delete_many([0, 2, 7]), 2)
+        self._check_kvi([4, 3, 1], l)
+
+    def test_from_items(self):
+        l = TTLRU.from_items([(i, str(i)) for i in range(4)])
+        self.assertEqual(l.get_size(), 4)
+        self._check_kvi([3, 2, 1, 0], l)
+        l = TTLRU.from_items({0: '0', 1: '1'}, 10, ttl=int(10e6))
+        self.assertEqual(l.get_size(), 10)
+        self._check_kvi([1, 0], l)
+        time.sleep(0.02)
+        self._check_kvi([], l)
+        l = TTLRU.from_items((i, str(i)) for i in range(4))
+        self._check_kvi([3, 2, 1, 0], l)
+
+    def test_iter(self):
+        l = TTLRU(10)
+        for i in range(5):
+            l[i] = str(i)
+        self.assertEqual(list(l), [4, 3, 2, 1, 0])
+        self.assertEqual(list(reversed(l)), [0, 1, 2, 3, 4])
+        self.assertEqual(list(l.itervalues()), ['4', '3', '2', '1', '0'])
+        self.assertEqual(list(l.iteritems(reverse=True))[:2], [(0, '0'), (1, '1')])
+        it = iter(l)
+        self.assertEqual(next(it), 4)
+        l[9] = '9'
+        self.assertRaises(RuntimeError, next, it)
+        it = iter(l)
+        next(it)
+        l.peek_last_item()
+        self.assertTrue(3 in l)
+        self.assertEqual(list(it), [4, 3, 2, 1, 0])
+
+    def test_iter_ttl(self):
+        l = TTLRU(10)
+        for i in range(6):
+            l.set_with_ttl(i, str(i), int(10e6) if i % 2 else -1)
+        time.sleep(0.02)
+        self.assertEqual(list(l), [4, 2, 0])
+        self.assertEqual(len(l.keys_view()), 3)
+        l.set_with_ttl(7, '7', int(10e6))
+        time.sleep(0.02)
+        self.assertEqual(list(l.iterkeys(reap=True)), [4, 2, 0])
+        self.assertEqual(l.get_pool_stats()['used'], 3)
+
+    def test_views(self):
+        l = TTLRU(10)
+        keys, values, items = l.keys_view(), l.values_view(), l.items_view()
+        for i in range(3):
+            l[i] = str(i)
+        self.assertEqual(len(keys), 3)
+        self.assertEqual(list(keys), [2, 1, 0])
+        self.assertEqual(list(reversed(values)), ['0', '1', '2'])
+        self.assertEqual(list(items), [(2, '2'), (1, '1'), (0, '0')])
+        self.assertTrue(1 in keys)
+        self.assertFalse(5 in keys)
+        self.assertTrue('1' in values)
+        self.assertTrue((1, '1') in items)
+        self.assertFalse((1, '2') in items)
+        self.assertEqual(list(keys), [2, 1, 0])
+
+    def test_sharded(self):
+        l = ShardedTTLRU(100, shards=4)
+        self.assertEqual(l.get_shard_count(), 4)
+        for i in range(1000):
+            l[i] = str(i)
+        self.assertEqual(len(l), 100)
+        self.assertEqual([n for _, _, n in l.get_shard_stats()], [25] * 4)
+        self.assertTrue(999 in l)
+        self.assertFalse(0 in l)
+        self.assertEqual(l[999], '999')
+        self.assertEqual(l.get(0, 'x'), 'x')
+        self.assertEqual(l.get_stats(), (1, 1))
+        self.assertEqual(l.pop(999), '999')
+        self.assertRaises(KeyError, l.__getitem__, 999)
+        self.assertEqual(l.setdefault('a', 1), 1)
+        self.assertEqual(l.setdefault('a', 2), 1)
+        self.assertEqual(sorted(l.keys(), key=str), sorted((k for k, _ in l.items()), key=str))
+        del l['a']
+        self.assertRaises(KeyError, l.__delitem__, 'a')
+        l.set_size(8)
+        self.assertEqual(len(l), 8)
+        self.assertEqual(l.get_size(), 8)
+        l.clear()
+        self.assertEqual(len(l), 0)
+        self.assertRaises(ValueError, ShardedTTLRU, 4, shards=5)
+        self.assertRaises(ValueError, ShardedTTLRU, 0)
+
+    def test_sharded_ttl(self):
+        l = ShardedTTLRU(10, shards=2, ttl=100, clock='tick')
+        l.tick(0)
+        for i in range(4):
+            l[i] = i
+        l.set_with_ttl('a', 1, -1)
+        l.tick(200)
+        self.assertEqual(list(l.keys()), ['a'])
+        l[1] = 1
+        l.tick(400)
+        self.assertEqual(l.purge_expired(), 1)
+
+    def test_sharded_threads(self):
+        l = ShardedTTLRU(10000, shards=8)
+
+        def work(base):
+            for i in range(2000):
+                l[base + i % 200] = i
+                l.get(base + (i * 7) % 200)
+
+        threads = [threading.Thread(target=work, args=(n * 1000,)) for n in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(len(l), 800)
+        self.assertEqual(sum(l.get_stats()), 4 * 2000)
+
+    @unittest.skipUnless(hasattr(ttlru, 'SharedTTLRU'), 'needs POSIX shared memory')
+    def test_shared(self):
+        name = 'ttlru-test-%d' % os.getpid()
+        l = ttlru.SharedTTLRU(name, 3, item_size=16)
+        self.addCleanup(l.unlink)
+        l['a'] = b'1'
+        l[b'a'] = '2'
+        l.set_with_ttl('b', 'x', 1)
+        time.sleep(0.01)
+        self.assertEqual(len(l), 3)
+        self.assertEqual(l.items(), [(b'a', '2'), ('a', b'1')])
+        self.assertEqual(l.get('b', 'gone'), 'gone')
+        self.assertEqual(len(l), 2)
+        l.set_with_ttl('b', 'x', 1)
+        time.sleep(0.01)
+        self.assertEqual(l.purge_expired(), 1)
+        self.assertEqual(len(l), 2)
+        # a full segment drops an expired item before the LRU one
+        l.set_with_ttl('c', 'x', 1)
+        time.sleep(0.01)
+        l['d'] = 'd'
+        self.assertEqual(l.keys(), ['d', b'a', 'a'])
+        for i in range(3):
+            l[str(i)] = str(i)
+        self.assertEqual(l.keys(), ['2', '1', '0'])
+        self.assertEqual(l.pop('2'), '2')
+        self.assertRaises(KeyError, l.__delitem__, '2')
+        self.assertRaises(TypeError, l.__setitem__, 1, 'a')
+        self.assertRaises(ValueError, l.__setitem__, 'a', 'x' * 16)
+        self.assertRaises(ValueError, ttlru.SharedTTLRU, name, 4, item_size=16)
+        self.assertEqual(l.get_stats(), (0, 1))
+
+    @unittest.skipUnless(hasattr(ttlru, 'SharedTTLRU') and hasattr(os, 'fork'),
+                         'needs POSIX shared memory and fork')
+    def test_shared_processes(self):
+        name = 'ttlru-test-%d' % os.getpid()
+        l = ttlru.SharedTTLRU(name, 10)
+        self.addCleanup(l.unlink)
+        l['parent'] = 'p'
+        pid = os.fork()
+        if pid == 0:
+            other = ttlru.SharedTTLRU(name, 10)
+            other['child'] = other['parent'] + 'c'
+            os._exit(0)
+        os.waitpid(pid, 0)
+        self.assertEqual(l['child'], 'pc')
+        self.assertEqual(l.get_stats(), (2, 0))
+
+    def test_policies(self):
+        for policy in ('slru', '2q', 'tinylfu'):
+            l = TTLRU(100, policy=policy)
+            hot = list(range(50))
+            cold = iter(range(1000, 10000))
+            for _ in range(10):
+                for k in hot:
+                    if l.get(k) is None:
+                        l[k] = k
+                for _ in range(30):
+                    k = next(cold)
+                    l[k] = k
+            # a scan of keys that are used once must not flush the hot keys
+            for _ in range(2000):
+                k = next(cold)
+                l[k] = k
+            self.assertEqual(len(l), 100)
+            kept = sum(1 for k in hot if k in l)
+            self.assertGreaterEqual(kept, 40, policy)
+            stats = l.get_policy_stats()
+            self.assertEqual(stats['policy'], policy)
+            self.assertEqual(sum(stats['segments'].values()), 100)
+            # the tail is the item the policy evicts next for slru and 2q
+            last = l.peek_last_item()
+            self.assertEqual(l.popitem(), last)
+            l.set_size(10)
+            self.assertEqual(len(l), 10)
+            self.assertEqual(sum(l.get_policy_stats()['segments'].values()), 10)
+        l = TTLRU(10)
+        for k in range(20):
+            l[k] = k
+        self.assertEqual(sorted(l.keys()), list(range(10, 20)))
+        self.assertRaises(ValueError, TTLRU, 10, policy='lfu')
+
+    def test_policy_ttl(self):
+        for policy in ('lru', 'slru', '2q', 'tinylfu'):
+            l = TTLRU(4, ttl=10, clock='tick', policy=policy)
+            l.tick(0)
+            for k in range(4):
+                l[k] = k
+                l[k]
+            l.set_with_ttl('x', 'x', -1)
+            self.assertEqual(len(l), 4)
+            l.tick(100)
+            self.assertEqual(l.keys(), ['x'])
+            self.assertEqual(sum(l.get_policy_stats()['segments'].values()), 1)
+
+    def test_approximate(self):
+        l = TTLRU(3, approximate=True)
+        for k in (1, 2, 3):
+            l[k] = k
+        it = iter(l)
+        self.assertEqual(l[1], 1)
+        # a read does not move the item, running iterators go on
+        self.assertEqual(list(it), [3, 2, 1])
+        l[4] = 4
+        # 1 was read since it was inserted and gets a second chance, 2 goes
+        self.assertEqual(l.keys(), [1, 4, 3])
+        l[5] = 5
+        self.assertEqual(l.keys(), [5, 1, 4])
+        self.assertTrue(l.get_policy_stats()['approximate'])
+        self.assertRaises(ValueError, TTLRU, 3, policy='slru', approximate=True)
+
+    def test_max_weight(self):
+        l = TTLRU(100, max_weight=10, weigher=lambda k, v: len(v))
+        l['a'] = 'xxxx'
+        l['b'] = 'xxxx'
+        self.assertEqual(l.get_weight(), 8)
+        l['c'] = 'xxx'
+        self.assertEqual(l.keys(), ['c', 'b'])
+        self.assertEqual(l.get_weight(), 7)
+        l['b'] = 'x'
+        self.assertEqual(l.get_weight(), 4)
+        self.assertRaises(ValueError, l.__setitem__, 'd', 'x' * 11)
+        l.set_max_weight(2)
+        self.assertEqual(l.keys(), ['b'])
+        self.assertEqual(l.get_max_weight(), 2)
+        del l['b']
+        self.assertEqual(l.get_weight(), 0)
+        self.assertRaises(ValueError, TTLRU, 10, weigher=len)
+        self.assertRaises(ValueError, TTLRU(10).set_max_weight, 5)
+
+    def test_max_weight_sizeof(self):
+        l = TTLRU(1000, max_weight=10000)
+        for i in range(1000):
+            l[i] = b'x' * 100
+        self.assertLess(len(l), 100)
+        self.assertLessEqual(l.get_weight(), 10000)
+        self.assertGreater(l.get_weight(), 10000 - 1000)
+        l.clear()
+        self.assertEqual(l.get_weight(), 0)
+
+    def test_metrics(self):
+        l = TTLRU(2, ttl=100, clock='tick')
+        l.tick(0)
+        l[1] = 1
+        l[2] = 2
+        l[3] = 3
+        l[3] = 4
+        del l[3]
+        self.assertIsNone(l.get(5))
+        l.tick(200)
+        self.assertIsNone(l.get(2))
+        l.clear()
+        m = l.get_metrics()
+        self.assertEqual((m['inserts'], m['updates'], m['deletes']), (3, 1, 1))
+        self.assertEqual((m['hits'], m['misses'], m['expired_misses']), (0, 2, 1))
+        self.assertEqual(m['evictions']['capacity'], 1)
+        self.assertEqual(m['expirations']['read'], 1)
+        self.assertIsNone(m['latency'])
+        l.reset_metrics()
+        self.assertEqual(l.get_metrics()['inserts'], 0)
+
+        # keys() and the peeks count their expired items apart
+        l = TTLRU(10, clock='tick')
+        l.tick(0)
+        for i in range(4):
+            l.set_with_ttl(i, i, 10)
+        l['live'] = 1
+        l.tick(300)
+        l.peek_first_item()
+        l.peek_last_item()
+        l.keys()
+        expirations = l.get_metrics()['expirations']
+        self.assertEqual((expirations['peek'], expirations['collect']), (4, 0))
+        l.set_with_ttl('x', 1, 10)
+        l.tick(400)
+        l.items()
+        expirations = l.get_metrics()['expirations']
+        self.assertEqual((expirations['peek'], expirations['collect']), (4, 1))
+        self.assertNotIn('snapshot', expirations)
+
+    def test_metrics_latency(self):
+        l = TTLRU(10)
+        l.set_latency_sample(1)
+        for i in range(20):
+            l[i] = i
+            l.get(i)
+        latency = l.get_metrics()['latency']
+        self.assertEqual(sum(latency['get']), 20)
+        self.assertEqual(sum(latency['set']), 20)
+        self.assertRaises(ValueError, l.set_latency_sample, -1)
+
+    def test_notify_batch(self):
+        batches = []
+        l = TTLRU(3, callback=batches.append, notify='batch')
+        l.set_many([(i, i) for i in range(6)])
+        self.assertEqual(batches, [[(0, 0, 'capacity'), (1, 1, 'capacity'), (2, 2, 'capacity')]])
+
+        def reenter(batch):
+            batches.append(batch)
+            l['x'] = 'x'
+        del batches[:]
+        l.set_callback(reenter)
+        l[6] = 6
+        self.assertEqual(batches, [[(3, 3, 'capacity')]])
+        self.assertEqual(l.get_notify_stats(), (1, 0))
+        l[7] = 7
+        self.assertEqual(batches[1], [(4, 4, 'capacity'), (5, 5, 'capacity')])
+
+    def test_notify_queue(self):
+        l = TTLRU(2, ttl=100, clock='tick', notify='queue')
+        l.tick(0)
+        for i in range(4):
+            l[i] = i
+        l.tick(200)
+        self.assertNotIn(3, l)
+        self.assertEqual(l.drain_evictions(),
+                         [(0, 0, 'capacity'), (1, 1, 'capacity'), (3, 3, 'expired')])
+        self.assertEqual(l.drain_evictions(), [])
+        l.set_notify('queue', 2)
+        for i in range(5):
+            l[i] = i
+        self.assertEqual(l.get_notify_stats(), (2, 2))
+        self.assertEqual([key for key, _, _ in l.drain_evictions()], [1, 2])
+        self.assertRaises(ValueError, l.set_notify, 'later')
+
+    def test_get_or_load(self):
+        l = TTLRU(10)
+        calls = []
+
+        def loader():
+            calls.append(1)
+            time.sleep(0.05)
+            return 'v'
+        results = []
+        threads = [threading.Thread(target=lambda: results.append(l.get_or_load('k', loader)))
+                   for _ in range(4)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(results, ['v'] * 4)
+        self.assertEqual(l['k'], 'v')
+
+        def failing():
+            calls.append(2)
+            raise KeyError('down')
+        self.assertRaises(KeyError, l.get_or_load, 'x', failing, error_ttl=10**9)
+        self.assertRaises(KeyError, l.get_or_load, 'x', failing)
+        self.assertEqual(calls.count(2), 1)
+        self.assertNotIn('x', l)
+
+        # the loader runs without the lock, another thread can use the cache meanwhile
+        written = []
+
+        def writer():
+            l['w'] = 1
+            written.append(1)
+
+        def busy():
+            t = threading.Thread(target=writer)
+            t.start()
+            deadline = time.time() + 5
+            while not written and time.time() < deadline:
+                pass
+            t.join()
+            return len(written)
+        self.assertEqual(l.get_or_load('busy', busy), 1)
+
+        # every call raises its own copy, the traceback does not grow
+        def depth(e):
+            tb, n = e.__traceback__, 0
+            while tb is not None:
+                tb, n = tb.tb_next, n + 1
+            return n
+        errors, depths = [], []
+        for _ in range(5):
+            try:
+                l.get_or_load('y', failing, error_ttl=10**12)
+            except KeyError as e:
+                errors.append(e)
+                depths.append(depth(e))
+        self.assertEqual(len(set(depths[1:])), 1)
+        self.assertEqual(depth(errors[0]), depths[0])
+        self.assertEqual(len(set(map(id, errors))), 5)
+        self.assertTrue(all(e.__cause__ is errors[0] for e in errors[1:]))
+        self.assertEqual(errors[1].args, ('down',))
+
+    def test_aget_or_load(self):
+        import asyncio
+        l = TTLRU(10)
+        calls = []
+
+        async def loader():
+            calls.append(1)
+            await asyncio.sleep(0.01)
+            return 42
+
+        async def main():
+            return await asyncio.gather(*[l.aget_or_load('k', loader) for _ in range(5)])
+        self.assertEqual(asyncio.run(main()), [42] * 5)
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(l['k'], 42)
+
+        # a hit is a future as well, already done
+        async def hit():
+            done = l.aget_or_load('k', loader)
+            self.assertIsInstance(done, asyncio.Future)
+            self.assertTrue(done.done())
+            self.assertEqual(done.result(), 42)
+            miss = l.aget_or_load('m', loader)
+            self.assertIsInstance(miss, asyncio.Future)
+            await asyncio.wait([done, miss])
+            return await done, miss.result()
+        self.assertEqual(asyncio.run(hit()), (42, 42))
+        self.assertEqual(len(calls), 2)
+
+    def test_refresher(self):
+        from concurrent.futures import Future
+        l = TTLRU(10, ttl=100, clock='tick')
+        l.tick(0)
+        futures = []
+
+        def refresher(key, value):
+            futures.append((key, value))
+            fut = Future()
+            futures.append(fut)
+            return fut
+        l.set_refresher(refresher, 50)
+        l['a'] = 'old'
+        l.tick(60)
+        self.assertEqual(l['a'], 'old')
+        self.assertEqual(l['a'], 'old')
+        self.assertEqual(futures[0], ('a', 'old'))
+        self.assertEqual(len(futures), 2)
+        futures[1].set_result('new')
+        self.assertEqual(l['a'], 'new')
+        l.tick(120)
+        self.assertEqual(l['a'], 'new')
+        futures[3].set_exception(KeyError('a'))
+        self.assertEqual(l['a'], 'new')
+        self.assertEqual(len(futures), 6)
+        l.tick(200)
+        self.assertNotIn('a', l)
+
+        # the result keeps the item's own ttl, and loses to a delete or an update
+        l = TTLRU(10, clock='tick')
+        l.tick(0)
+        del futures[:]
+        l.set_refresher(refresher, 50)
+        l.set_with_ttl('a', 1, 100)
+        l.set_with_ttl('b', 1, 100)
+        l.set_with_ttl('c', 1, 100)
+        l.tick(60)
+        self.assertEqual((l['a'], l['b'], l['c']), (1, 1, 1))
+        del l['a']
+        l.set_with_ttl('b', 2, 100)
+        for fut in futures[1::2]:
+            fut.set_result('new')
+        self.assertNotIn('a', l)
+        self.assertEqual((l['b'], l['c']), (2, 'new'))
+        self.assertEqual((l.ttl('b'), l.ttl('c')), (100, 100))
+
+    def test_dump_load(self):
+        import io
+        import pickle
+        l = TTLRU(10, ttl=10**12)
+        l['a'] = b'bytes'
+        l[1] = 'str'
+        l[2**70] = (1, 2)
+        l.set_with_ttl('gone', None, 1)
+        l.set_with_ttl('forever', -5, -1)
+        l['a']
+        time.sleep(0.001)
+        m = TTLRU(10)
+        m.loads(l.dumps())
+        self.assertEqual(m.items(), l.items())
+        self.assertNotIn('gone', m)
+        f = io.BytesIO()
+        l.dump(f)
+        f.seek(0)
+        m = TTLRU(10)
+        m.load(f)
+        self.assertEqual(m.items(), l.items())
+        m = pickle.loads(pickle.dumps(l))
+        self.assertEqual(m.items(), l.items())
+        self.assertEqual(m.get_size(), 10)
+        self.assertRaises(ValueError, m.loads, b'junk')
+
+        # callables are pickled by reference, or pickling fails
+        l = TTLRU(10, callback=weigh_len, max_weight=100, weigher=weigh_len)
+        l['a'] = 'x' * 50
+        l.set_refresher(refresh_none, 10**9)
+        m = pickle.loads(pickle.dumps(l))
+        self.assertEqual(m.items(), l.items())
+        self.assertEqual(m.get_weight(), l.get_weight())
+        m['b'] = 'y' * 60
+        self.assertEqual(m.keys(), ['b'])
+        l = TTLRU(10, callback=lambda key, value: None)
+        self.assertRaises((pickle.PicklingError, AttributeError), pickle.dumps, l)
+
+    def test_dump_load_ttl(self):
+        l = TTLRU(10, ttl=100, clock='tick')
+        l.tick(0)
+        l[1] = 1
+        l.tick(50)
+        l[2] = 2
+        m = TTLRU(10, clock='tick')
+        m.tick(1000)
+        m.loads(l.dumps())
+        self.assertEqual(m.keys(), [2, 1])
+        m.tick(1060)
+        self.assertEqual(m.keys(), [2])
+
+    def test_capi(self):
+        import ctypes
+        get_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+        get_pointer.restype = ctypes.c_void_p
+        get_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+        obj = ctypes.py_object
+
+        class API(ctypes.Structure):
+            _fields_ = [
+                ('version', ctypes.c_int),
+                ('type', ctypes.c_void_p),
+                ('get', ctypes.PYFUNCTYPE(obj, obj, obj)),
+                ('set_with_ttl', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj, obj, ctypes.c_int64)),
+                ('delete_item', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj)),
+                ('contains', ctypes.PYFUNCTYPE(ctypes.c_int, obj, obj)),
+                ('peek', ctypes.PYFUNCTYPE(obj, obj, obj)),
+                ('length', ctypes.PYFUNCTYPE(ctypes.c_ssize_t, obj)),
+            ]
+        api = API.from_address(get_pointer(ttlru._C_API, b'ttlru._C_API'))
+        self.assertEqual(api.version, 2)
+        self.assertEqual(api.type, id(TTLRU))
+        l = TTLRU(2, ttl=10**9)
+        self.assertEqual(api.set_with_ttl(l, 'a', 'x', -(2**63)), 0)
+        self.assertEqual(api.set_with_ttl(l, 'b', 'y', -1), 0)
+        self.assertEqual(api.get(l, 'a'), 'x')
+        self.assertEqual(l.keys(), ['a', 'b'])
+        # peek() returns a new reference, which ctypes releases
+        value = l['b']
+        refs = sys.getrefcount(value)
+        for _ in range(3):
+            self.assertIs(api.peek(l, 'b'), value)
+        self.assertEqual(sys.getrefcount(value), refs)
+        peek_ptr = ctypes.PYFUNCTYPE(ctypes.c_void_p, obj, obj)(
+            ctypes.cast(api.peek, ctypes.c_void_p).value)
+        self.assertIsNone(peek_ptr(l, 'c'))
+        self.assertEqual((api.contains(l, 'a'), api.contains(l, 'c')), (1, 0))
+        self.assertEqual(api.length(l), 2)
+        self.assertEqual((api.delete_item(l, 'a'), api.delete_item(l, 'a')), (1, 0))
+        self.assertEqual(l.keys(), ['b'])
+
+    def test_fastcall_args(self):
+        l = TTLRU(2)
+        l.set_with_ttl(1, 'a', 10**9)
+        self.assertEqual(l.get(1), 'a')
+        self.assertEqual(l.get(2, 'b'), 'b')
+        self.assertEqual(l.setdefault(3), None)
+        self.assertEqual(l.pop(3), None)
+        self.assertEqual(l.pop(3, 'c'), 'c')
+        self.assertTrue(l.has_key(1))
+        self.assertRaises(TypeError, l.get)
+        self.assertRaises(TypeError, l.get, 1, 2, 3)
+        self.assertRaises(TypeError, l.set_with_ttl, 1, 2)
+        self.assertRaises(TypeError, l.set_with_ttl, 1, 2, 'x')
+        self.assertRaises(TypeError, l.pop)
+        self.assertRaises(TypeError, l.has_key)
+
+    def test_cached(self):
+        calls = []
+
+        @ttlru.cached(2, typed=True)
+        def f(x, y=0):
+            "doc"
+            calls.append((x, y))
+            return x + y
+
+        self.assertEqual((f(1), f(1), f(1.0), f(1, y=2), f(1, y=2)), (1, 1, 1.0, 3, 3))
+        self.assertEqual(calls, [(1, 0), (1.0, 0), (1, 2)])
+        self.assertEqual(f.cache_info(), (2, 3, 2, 2))
+        self.assertEqual(f.cache_info().hits, 2)
+        self.assertEqual((f.__name__, f.__doc__), ('f', 'doc'))
+        self.assertRaises(TypeError, f, [])
+        f.cache_clear()
+        self.assertEqual(f.cache_info(), (0, 0, 2, 0))
+        self.assertEqual(len(f.cache), 0)
+
+        @ttlru.cached(10, ttl=10 * 10**6)
+        def g(x):
+            calls.append(x)
+            return x
+
+        del calls[:]
+        g('a')
+        g('a')
+        time.sleep(0.02)
+        g('a')
+        self.assertEqual(calls, ['a', 'a'])
+
+    def test_cached_coroutine(self):
+        import asyncio
+        calls = []
+
+        @ttlru.cached(10)
+        async def f(x):
+            calls.append(x)
+            await asyncio.sleep(0)
+            return x * 2
+
+        async def main():
+            return [await f(1), await f(1), await asyncio.ensure_future(f(2)), await f(2)]
+
+        self.assertEqual(asyncio.run(main()), [2, 2, 4, 4])
+        self.assertEqual(asyncio.run(f(1)), 2)
+        self.assertEqual(calls, [1, 2])
+        self.assertEqual(f.cache_info(), (3, 2, 10, 2))
+
+    def test_set_missing(self):
+        l = TTLRU(4, max_missing=2)
+        l['a'] = 1
+        l.set_missing('a')
+        self.assertIs(l.lookup('a'), ttlru.MISSING)
+        self.assertIsNone(l.get('a'))
+        self.assertEqual(l.lookup('b', 'default'), 'default')
+        self.assertEqual((len(l), list(l.items())), (0, []))
+        l['a'] = 2
+        self.assertEqual(l.lookup('a'), 2)
+        for key in 'bcd':
+            l.set_missing(key)
+        self.assertEqual(sum(l.lookup(key) is ttlru.MISSING for key in 'bcd'), 2)
+        self.assertEqual(l.get_missing_stats(), (2, 3, 1, 0))
+        l.set_missing('e', 10**6)
+        time.sleep(0.01)
+        self.assertIsNone(l.lookup('e'))
+        self.assertEqual(l.get_missing_stats()[3], 1)
+        l.clear()
+        self.assertEqual(l.get_missing_stats()[0], 0)
+
+        l = TTLRU(4, max_missing=0)
+        l.set_missing('a')
+        self.assertIsNone(l.lookup('a'))
+
+        # __eq__ swaps the table for a smaller one during the lookup
+        class Key(object):
+            armed = False
+            def __hash__(self):
+                return 8
+            def __eq__(self, other):
+                if Key.armed:
+                    Key.armed = False
+                    l.clear()
+                    l.set_missing('z')
+                return False
+
+        l = TTLRU(100)
+        for i in range(8):
+            l.set_missing(i)
+        l.set_missing(Key())
+        Key.armed = True
+        self.assertEqual(l.lookup(Key(), 'default'), 'default')
+        self.assertIs(l.lookup('z'), ttlru.MISSING)
+        self.assertEqual(l.get_missing_stats()[0], 1)
+
+    def test_expire_after_access(self):
+        l = TTLRU(10, ttl=100, clock='tick', expire_after_access=100)
+        l.tick(1000)
+        l['a'] = 1
+        l['b'] = 2
+        l.set_with_ttl('c', 3, -1)
+        for now in range(1050, 1500, 50):
+            l.tick(now)
+            self.assertEqual(l['a'], 1)
+        self.assertEqual(l.ttl('a'), 100)
+        self.assertNotIn('b', l)
+        self.assertEqual(l.get('c'), 3)
+        self.assertEqual(l.ttl('c'), -1)
+        l.set_with_ttl('d', 4, 1000)
+        self.assertEqual(l.get('d'), 4)
+        self.assertEqual(l.ttl('d'), 1000)
+
+    def test_touch_ttl(self):
+        l = TTLRU(10, ttl=100, clock='tick')
+        l.tick(1000)
+        l['a'] = 1
+        l.set_with_ttl('b', 2, -1)
+        self.assertEqual((l.ttl('a'), l.ttl('b'), l.ttl('c')), (100, -1, None))
+        self.assertTrue(l.touch('a', 500))
+        self.assertTrue(l.touch('b'))
+        self.assertFalse(l.touch('c'))
+        self.assertEqual((l.ttl('a'), l.ttl('b')), (500, 100))
+        self.assertTrue(l.expire_at('b', 1020))
+        self.assertTrue(l.touch('a', -1))
+        self.assertEqual(list(l.keys()), ['b', 'a'])
+        self.assertEqual(l.get_stats(), (0, 0))
+        l.tick(1021)
+        self.assertEqual((l.ttl('a'), l.ttl('b')), (-1, None))
+        self.assertFalse(l.expire_at('b', 2000))
+        self.assertRaises(ValueError, l.expire_at, 'a', -2)
+
+    def test_gc_cycles(self):
+        import tracemalloc
+        import weakref
+
+        class Owner(object):
+            def __init__(self):
+                self.cache = TTLRU(10, callback=self.evicted)
+                self.cache['self'] = self
+                self.cache['keys'] = self.cache.keys()
+                self.cache['iter'] = iter(self.cache)
+                for i in range(20):
+                    self.cache[i] = [self, i]
+
+            def evicted(self, key, value):
+                pass
+
+        owner = weakref.ref(Owner())
+        gc.collect()
+        self.assertIsNone(owner())
+
+        holder = Owner()
+        holder.cache = ShardedTTLRU(8, shards=2)
+        holder.cache['holder'] = holder
+        holder = weakref.ref(holder)
+        gc.collect()
+        self.assertIsNone(holder())
+
+        def churn():
+            for i in range(200):
+                Owner()
+            gc.collect()
+
+        churn()
+        tracemalloc.start()
+        try:
+            before = tracemalloc.get_traced_memory()[0]
+            for i in range(5):
+                churn()
+            growth = tracemalloc.get_traced_memory()[0] - before
+        finally:
+            tracemalloc.stop()
+        self.assertLess(growth, 64 * 1024)
+
+    def test_tags(self):
+        evicted = []
+        l = TTLRU(4, callback=lambda k, v: evicted.append(k), clock='tick')
+        l.tick(1000)
+        l.set_with_ttl('a', 1, -1, 'user:1')
+        l.set_with_ttl('b', 2, -1, 'user:1')
+        l.set_with_ttl('c', 3, 10, 'user:2')
+        l.set_with_ttl('d', 4, -1)
+        self.assertEqual(l.invalidate_tag('user:1'), 2)
+        self.assertEqual(list(l.keys()), ['d', 'c'])
+        self.assertEqual(l.invalidate_tag('user:1'), 0)
+        self.assertEqual(l.invalidate_tag('nobody'), 0)
+        self.assertEqual(evicted, [])
+
+        # eviction and expiry leave the group, a set without a tag keeps it
+        for k in 'efg':
+            l.set_with_ttl(k, 0, -1, 'user:3')
+        l['g'] = 1
+        self.assertEqual(evicted, ['c'])
+        self.assertEqual(l.invalidate_tag('user:2'), 0)
+        l.set_with_ttl('d', 4, 10, 'user:3')
+        l.tick(1011)
+        self.assertNotIn('d', l)
+        self.assertEqual(l.invalidate_tag('user:3'), 3)
+        self.assertEqual(len(l), 0)
+
+        # set_tag moves, adds and removes tags in place
+        l['x'] = 1
+        l.set_with_ttl('y', 2, -1, 'old')
+        self.assertTrue(l.set_tag('x', 'new'))
+        self.assertTrue(l.set_tag('y', 'new'))
+        self.assertTrue(l.set_tag('x', None))
+        self.assertFalse(l.set_tag('z', 'new'))
+        self.assertEqual(l.invalidate_tag('old'), 0)
+        self.assertEqual(l.invalidate_tag('new'), 1)
+        self.assertEqual(list(l.keys()), ['x'])
+        self.assertRaises(TypeError, l.set_with_ttl, 'z', 1, -1, [])
+
+        # many short lived tags, the empty ones are swept
+        for i in range(1000):
+            l.set_with_ttl(i, i, -1, ('t', i))
+        self.assertEqual(sum(l.invalidate_tag(('t', i)) for i in range(1000)), 4)
+        l.set_with_ttl('a', 1, -1, 'a')
+        l.clear()
+        self.assertEqual(l.invalidate_tag('a'), 0)
+
+        # an expired member is an expiration, not a delete
+        del evicted[:]
+        l.set_with_ttl('live', 1, -1, 'mixed')
+        l.set_with_ttl('old', 2, 5, 'mixed')
+        l.tick(l.now() + 10)
+        deletes = l.get_metrics()['deletes']
+        self.assertEqual(l.invalidate_tag('mixed'), 1)
+        self.assertEqual(l.get_metrics()['deletes'], deletes + 1)
+        self.assertEqual(l.get_metrics()['expirations']['tag'], 1)
+        self.assertEqual(evicted, ['old'])
+
+        s = ShardedTTLRU(100, shards=4)
+        for i in range(20):
+            s.set_with_ttl(i, i, -1, i % 2)
+        self.assertTrue(s.set_tag(2, 'two'))
+        self.assertEqual(s.invalidate_tag(0), 9)
+        self.assertEqual(s.invalidate_tag('two'), 1)
+        self.assertEqual(sorted(s.keys()), list(range(1, 20, 2)))
+
     def test_ref_count(self):
         l = TTLRU(2,ttl=int(20e6))
         x = {1:2}
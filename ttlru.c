@@ -1,16 +1,26 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TTLRU_MODULE
+#include "ttlru_capi.h"
 
 /*
  * This is a project forked from https://github.com/amitdev/lru-dict and I added ttl feature for it.
- * 
- * This is a simple implementation of LRU Dict that uses a Python dict and an associated doubly linked
+ *
+ * This is a simple implementation of LRU Dict that uses a hash table and an associated doubly linked
  * list to keep track of recently inserted/accessed items. It also supports TTL feature to expire items
  * which makes it more suitable to be a cache
  *
- * Dict will store: key -> Node mapping, where Node is a linked list node.
- * The Node itself will contain the value, the key, as well as the expire time.
+ * The nodes are not Python objects. They live in one array, self->nodes, and refer to each other
+ * by their 32 bit index in it. A node holds the key, the cached hash of the key, the value, the
+ * expire time and the prev/next links of the list. self->table is an open addressing hash table
+ * that only stores node indices, the probing is the same as the one of CPython's dict.
+ * Free nodes are chained through their next link, so a freed node is reused by the next insert.
  * TTL is in nanoseconds, we can save some conversion time because Python C-API use ns to represent time.
- * 
+ *
  * For eg, two items with default 60s ttl and one item with specified 10s ttl:
  *
  * >>> l = TTLRU(2, 60*1000000000)
@@ -21,28 +31,53 @@
  * can be visualised as:
  *
  *             ---+--(hash(0)--+--hash(1)--+
- * self->dict  ...|            |           |
+ * self->table ...|     #1     |     #0    |
  *             ---+-----|------+---------|-+
  *                      |                |
  *                +-----v------+   +-----v------+
  * self->first--->|<'foo'>, <0>|-->|<'bar'>, <1>|<---self->last
- *             +--|            |<--|            |--+
+ *             +--|     #1     |<--|     #0     |--+
  *             |  +------------+   +------------+  |
  *             v                                   v
- *           NULL                                 NULL
+ *            NIL                                 NIL
  *
- *  The invariant is to maintain the list to reflect the LRU order of items in the dict.
+ *  The invariant is to maintain the list to reflect the LRU order of items in the table.
  *  self->first will point to the MRU item and self-last to LRU item. Size of list will not
  *  grow beyond size of TTLRU dict.
  *
+ *  Every node that has a ttl is also kept in self->heap, a binary min-heap ordered by
+ *  expire time. The heap lets an insert reclaim an already expired node instead of the
+ *  live LRU tail, and lets len() drop the expired nodes without walking the list.
+ *
+ *  Comparing keys and releasing keys or values may run arbitrary Python code, which may
+ *  change the cache. Lookups restart when the slot they compared against has changed,
+ *  and nodes are always unlinked before their references are released.
+ *
  */
 
 #ifndef Py_TYPE
  #define Py_TYPE(ob) (((PyObject*)(ob))->ob_type)
 #endif
 
-#define GET_NODE(d, key) (Node *) Py_TYPE(d)->tp_as_mapping->mp_subscript((d), (key))
-#define PUT_NODE(d, key, node) Py_TYPE(d)->tp_as_mapping->mp_ass_subscript((d), (key), ((PyObject *)node))
+/* End of a list, or a node that is not in the heap */
+#define NIL ((uint32_t)-1)
+/* Markers in self->table, real slots hold node indices */
+#define SLOT_EMPTY ((uint32_t)-1)
+#define SLOT_DUMMY ((uint32_t)-2)
+#define MAX_NODES ((Py_ssize_t)0xFFFFFFF0)
+#define TABLE_MINSIZE 8
+#define PERTURB_SHIFT 5
+
+#define NODE(self, i) (&(self)->nodes[i])
+
+#if PY_VERSION_HEX < 0x030D0000
+typedef _PyTime_t PyTime_t;
+#endif
+
+#ifndef Py_BEGIN_CRITICAL_SECTION
+ #define Py_BEGIN_CRITICAL_SECTION(op) {
+ #define Py_END_CRITICAL_SECTION() }
+#endif
 
 #define IS_EXPIRED(t_now, node) (t_now > node->expire && node->expire != -1)
 
@@ -61,84 +96,362 @@
   } while(0)
 #endif
 
-typedef struct _Node {
-    PyObject_HEAD
+typedef struct {
+    PyObject * key;     /* NULL for a free node */
     PyObject * value;
-    PyObject * key;
-    _PyTime_t expire;
-    struct _Node * prev;
-    struct _Node * next;
+    Py_hash_t hash;
+    PyTime_t expire;
+    PyTime_t refresh;   /* soft expire, a read after it refreshes the item, -1 is never,
+                           below -1 the token of the refresh in flight */
+    uint32_t prev;
+    uint32_t next;
+    uint32_t heap_pos;
+    uint8_t seg;        /* segment of the eviction policy */
+    uint8_t ref;        /* approximate mode: read since the hand last passed */
 } Node;
 
-static void
-node_dealloc(Node* self)
-{
-    Py_DECREF(self->key);
-    Py_DECREF(self->value);
-    assert(self->prev == NULL);
-    assert(self->next == NULL);
-    PyObject_Del((PyObject*)self);
-}
+/* Why a node was removed, see remove_reason_names */
+enum {
+    EVICTED_CAPACITY,
+    EVICTED_WEIGHT,
+    EXPIRED_READ,
+    EXPIRED_EVICT,
+    EXPIRED_PURGE,
+    EXPIRED_AUTO_PURGE,
+    EXPIRED_ITER,
+    EXPIRED_COLLECT,
+    EXPIRED_PEEK,
+    EXPIRED_TAG,
+    REMOVE_REASONS
+};
 
-static PyObject*
-node_repr(Node* self)
-{
-    return PyObject_Repr(self->value);
-}
+/* The reason given to eviction notifications */
+static const char * const remove_reason_names[] = {
+    "capacity", "weight", "expired", "expired", "expired", "expired", "expired", "expired", "expired",
+    "expired",
+};
 
-static PyTypeObject NodeType = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    "ttlru.Node",              /* tp_name */
-    sizeof(Node),            /* tp_basicsize */
-    0,                       /* tp_itemsize */
-    (destructor)node_dealloc,/* tp_dealloc */
-    0,                       /* tp_print */
-    0,                       /* tp_getattr */
-    0,                       /* tp_setattr */
-    0,                       /* tp_compare */
-    (reprfunc)node_repr,     /* tp_repr */
-    0,                       /* tp_as_number */
-    0,                       /* tp_as_sequence */
-    0,                       /* tp_as_mapping */
-    0,                       /* tp_hash */
-    0,                       /* tp_call */
-    0,                       /* tp_str */
-    0,                       /* tp_getattro */
-    0,                       /* tp_setattro */
-    0,                       /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT,      /* tp_flags */
-    "Linked List Node",      /* tp_doc */
-    0,                       /* tp_traverse */
-    0,                       /* tp_clear */
-    0,                       /* tp_richcompare */
-    0,                       /* tp_weaklistoffset */
-    0,                       /* tp_iter */
-    0,                       /* tp_iternext */
-    0,                       /* tp_methods */
-    0,                       /* tp_members */
-    0,                       /* tp_getset */
-    0,                       /* tp_base */
-    0,                       /* tp_dict */
-    0,                       /* tp_descr_get */
-    0,                       /* tp_descr_set */
-    0,                       /* tp_dictoffset */
-    0,                       /* tp_init */
-    0,                       /* tp_alloc */
-    0,                       /* tp_new */
+/*
+ * How evictions are notified: NOTIFY_CALL calls the callback with (key, value)
+ * from inside the eviction, NOTIFY_BATCH queues the evictions and calls the
+ * callback once with the list of them when the call that evicted returns, and
+ * NOTIFY_QUEUE keeps them until drain_evictions().
+ */
+enum {
+    NOTIFY_CALL,
+    NOTIFY_BATCH,
+    NOTIFY_QUEUE,
+};
+
+static const char * const notify_names[] = {"call", "batch", "queue", NULL};
+
+typedef struct {
+    PyObject *key;
+    PyObject *value;
+    int reason;
+} Eviction;
+
+/*
+ * A negative entry of set_missing(), a key known to be absent. It is only the
+ * key, its hash and its expire time, in a table of its own.
+ */
+typedef struct {
+    PyObject *key;      /* NULL for an empty slot */
+    Py_hash_t hash;
+    PyTime_t expire;
+} Missing;
+
+/* Negative entries looked at to pick the one to evict */
+#define MISSING_SAMPLE 8
+
+/* Tag of a node, in an array next to the nodes that exists once an item is tagged */
+typedef struct {
+    uint32_t tag;       /* index in self->tags, NIL for no tag */
+    uint32_t prev;      /* list of the nodes of the tag */
+    uint32_t next;
+} TagLink;
+
+typedef struct {
+    PyObject *tag;      /* NULL for a free entry */
+    uint32_t first;     /* first node, or the next free entry */
+    Py_ssize_t count;
+} TagList;
+
+enum {
+    LATENCY_GET,
+    LATENCY_SET,
+    LATENCY_OPS
 };
 
+#define LATENCY_BUCKETS 32
+
+/*
+ * Counters of get_metrics(). They are plain increments on paths that already
+ * write the node or the list, and only reset_metrics() resets them.
+ */
+typedef struct {
+    Py_ssize_t hits;
+    Py_ssize_t misses;
+    Py_ssize_t expired_misses;  /* misses where the key was there but expired */
+    Py_ssize_t inserts;
+    Py_ssize_t updates;
+    Py_ssize_t deletes;
+    Py_ssize_t removed[REMOVE_REASONS];
+    Py_ssize_t latency[LATENCY_OPS][LATENCY_BUCKETS];
+} LRUMetrics;
+
 typedef struct {
     PyObject_HEAD
-    PyObject * dict;
-    Node * first;
-    Node * last;
+    Node * nodes;
+    Py_ssize_t nodes_cap;
+    Py_ssize_t nodes_top;   /* nodes above this index have never been used */
+    uint32_t free;
+    uint32_t * table;
+    size_t mask;
+    Py_ssize_t used;
+    Py_ssize_t fill;        /* used + dummy slots */
+    uint32_t first;
+    uint32_t last;
     Py_ssize_t size;
     Py_ssize_t hits;
     Py_ssize_t misses;
     PyObject *callback;
-    _PyTime_t default_ttl;
+    PyTime_t default_ttl;
+    uint32_t * heap;
+    Py_ssize_t heap_len;
+    Py_ssize_t heap_cap;
+    Py_ssize_t auto_purge;
+    Py_ssize_t auto_purged;
+    Py_ssize_t purged;
+    int preallocate;
+    Py_ssize_t pool_grows;
+    Py_ssize_t pool_reused;
+    int clock;
+    PyTime_t clock_now;     /* the time of the tick clock */
+    size_t version;         /* changes whenever the list is relinked */
+    Py_ssize_t iterators;   /* iterators that have not finished yet */
+    int policy;
+    int approximate;
+    uint32_t seg_first[3];
+    uint32_t seg_last[3];
+    Py_ssize_t seg_count[3];
+    Py_ssize_t seg_cap[3];
+    uint64_t * ghost;       /* 2q: pairs of hash and eviction sequence number */
+    size_t ghost_mask;
+    uint64_t ghost_seq;
+    Py_ssize_t ghost_cap;
+    uint64_t * sketch;      /* tinylfu: 16 counters of 4 bits per word */
+    size_t sketch_mask;
+    uint64_t * door;
+    size_t door_mask;
+    Py_ssize_t sketch_adds;
+    Py_ssize_t sketch_sample;
+    Py_ssize_t policy_admitted;
+    Py_ssize_t policy_rejected;
+    PyObject *weigher;
+    Py_ssize_t max_weight;  /* 0 when only the number of items is limited */
+    Py_ssize_t total_weight;
+    Py_ssize_t * weights;   /* weight of every node, only with max_weight */
+    LRUMetrics metrics;
+    Py_ssize_t latency_sample;  /* time one get or set out of latency_sample, 0 is off */
+    Py_ssize_t latency_tick;
+    PyObject *flights;      /* key -> Flight capsule of get_or_load() */
+    PyObject *aflights;     /* key -> task of aget_or_load() */
+    PyObject *failures;     /* key -> (exception, expire) of the loads with error_ttl */
+    PyObject *refresher;
+    PyTime_t soft_ttl;      /* -1 when there is no refresher */
+    PyObject *refresh_key;  /* key read after its soft expire, refreshed when the read is done */
+    PyTime_t refresh_token; /* the node->refresh of the refresh of refresh_key */
+    PyTime_t refresh_seq;
+    PyTime_t * ttls;        /* ttl every node was set with, once a refresher was set */
+    int notify;
+    int notify_hold;        /* > 0 while a batch call or the callback runs */
+    Eviction * ring;        /* queued evictions, a ring buffer of ring_cap entries */
+    Py_ssize_t ring_cap;
+    Py_ssize_t ring_head;
+    Py_ssize_t ring_len;
+    Py_ssize_t ring_max;    /* 0 is unbounded, else the oldest are dropped */
+    Py_ssize_t ring_dropped;
+    Missing * missing;      /* linear probing, at most half full */
+    size_t missing_mask;
+    Py_ssize_t missing_used;
+    Py_ssize_t max_missing; /* -1 follows size */
+    size_t missing_hand;    /* where the next eviction starts to look */
+    Py_ssize_t missing_hits;
+    Py_ssize_t missing_evicted;
+    Py_ssize_t missing_expired;
+    PyTime_t expire_after_access;   /* 0 is off */
+    TagLink * tag_links;    /* nodes_cap entries once an item is tagged */
+    TagList * tags;
+    Py_ssize_t tags_cap;
+    Py_ssize_t tags_used;   /* entries with a tag, some may have no node left */
+    Py_ssize_t tags_live;   /* entries with nodes */
+    uint32_t tags_free;
+    PyObject *tag_ids;      /* tag -> index in tags */
 } LRU;
 
+static PyTypeObject LRUType;
+
+/*
+ * Free-threaded builds (Py_GIL_DISABLED) have no GIL to serialise the access to
+ * a TTLRU, so every entry point holds the per-object lock of the TTLRU through a
+ * critical section. On the other builds LOCKED(func) is func itself.
+ */
+#ifdef Py_GIL_DISABLED
+#define LOCKED(func) func##_locked
+#define LOCKED_CALL(self, type, call) \
+    type res; \
+    Py_BEGIN_CRITICAL_SECTION(self); \
+    res = call; \
+    Py_END_CRITICAL_SECTION(); \
+    return res;
+#define LOCKED_NOARGS(func) \
+static PyObject * func##_locked(LRU *self, PyObject *unused) \
+{ LOCKED_CALL(self, PyObject *, func(self)) }
+#define LOCKED_O(func) \
+static PyObject * func##_locked(LRU *self, PyObject *arg) \
+{ LOCKED_CALL(self, PyObject *, func(self, arg)) }
+#define LOCKED_VARARGS(func) \
+static PyObject * func##_locked(LRU *self, PyObject *args) \
+{ LOCKED_CALL(self, PyObject *, func(self, args)) }
+#define LOCKED_KEYWORDS(func) \
+static PyObject * func##_locked(LRU *self, PyObject *args, PyObject *kwds) \
+{ LOCKED_CALL(self, PyObject *, func(self, args, kwds)) }
+#define LOCKED_FASTCALL(func) \
+static PyObject * func##_locked(LRU *self, PyObject *const *args, Py_ssize_t nargs) \
+{ LOCKED_CALL(self, PyObject *, func(self, args, nargs)) }
+#define LOCKED_LEN(func) \
+static Py_ssize_t func##_locked(LRU *self) \
+{ LOCKED_CALL(self, Py_ssize_t, func(self)) }
+#define LOCKED_CONTAINS(func) \
+static int func##_locked(LRU *self, PyObject *key) \
+{ LOCKED_CALL(self, int, func(self, key)) }
+#define LOCKED_ASS(func) \
+static int func##_locked(LRU *self, PyObject *key, PyObject *value) \
+{ LOCKED_CALL(self, int, func(self, key, value)) }
+#else
+#define LOCKED(func) func
+#define LOCKED_NOARGS(func)
+#define LOCKED_O(func)
+#define LOCKED_VARARGS(func)
+#define LOCKED_KEYWORDS(func)
+#define LOCKED_FASTCALL(func)
+#define LOCKED_LEN(func)
+#define LOCKED_CONTAINS(func)
+#define LOCKED_ASS(func)
+#endif
+
+/*
+ * Clock sources. Expire times are in nanoseconds of the clock picked by the
+ * clock= option of the TTLRU:
+ *   "monotonic" - CLOCK_MONOTONIC, not affected by changes of the system time
+ *   "coarse"    - CLOCK_MONOTONIC_COARSE where available, cheaper to read but only
+ *                 as precise as the kernel tick
+ *   "tick"      - a time kept in the TTLRU that only moves on L.tick(), for callers
+ *                 that read the clock once per batch of requests
+ *   "system"    - the wall clock, moves with NTP steps and changes of the system time
+ */
+enum {
+    LRU_CLOCK_MONOTONIC,
+    LRU_CLOCK_COARSE,
+    LRU_CLOCK_TICK,
+    LRU_CLOCK_SYSTEM,
+};
+
+static const char * const clock_names[] = {"monotonic", "coarse", "tick", "system", NULL};
+
+#if defined(CLOCK_MONOTONIC)
+static PyTime_t
+clock_read(clockid_t clock_id)
+{
+    struct timespec ts;
+
+    clock_gettime(clock_id, &ts);
+    return (PyTime_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+static PyTime_t
+clock_monotonic(void)
+{
+#if defined(CLOCK_MONOTONIC)
+    return clock_read(CLOCK_MONOTONIC);
+#elif PY_VERSION_HEX >= 0x030D0000
+    PyTime_t t;
+    PyTime_MonotonicRaw(&t);
+    return t;
+#else
+    return _PyTime_GetMonotonicClock();
+#endif
+}
+
+static PyTime_t
+clock_coarse(void)
+{
+#if defined(CLOCK_MONOTONIC_COARSE)
+    return clock_read(CLOCK_MONOTONIC_COARSE);
+#else
+    return clock_monotonic();
+#endif
+}
+
+static PyTime_t
+clock_system(void)
+{
+#if defined(CLOCK_REALTIME)
+    return clock_read(CLOCK_REALTIME);
+#elif PY_VERSION_HEX >= 0x030D0000
+    PyTime_t t;
+    PyTime_TimeRaw(&t);
+    return t;
+#else
+    return _PyTime_GetSystemClock();
+#endif
+}
+
+static PyTime_t
+lru_now(LRU *self)
+{
+    switch (self->clock) {
+    case LRU_CLOCK_COARSE:
+        return clock_coarse();
+    case LRU_CLOCK_TICK:
+        return self->clock_now;
+    case LRU_CLOCK_SYSTEM:
+        return clock_system();
+    default:
+        return clock_monotonic();
+    }
+}
+
+/*
+ * Batch calls read the clock at most once: they keep the time in a local that
+ * starts as TIME_UNSET and is filled by the first read.
+ */
+#define TIME_UNSET INT64_MIN
+
+static PyTime_t
+lru_now_cached(LRU *self, PyTime_t *t_now)
+{
+    if (*t_now == TIME_UNSET)
+        *t_now = lru_now(self);
+    return *t_now;
+}
+
+static int
+clock_from_name(const char *name)
+{
+    int i;
+
+    for (i = 0; clock_names[i]; i++) {
+        if (strcmp(name, clock_names[i]) == 0)
+            return i;
+    }
+    PyErr_Format(PyExc_ValueError,
+                 "clock should be 'monotonic', 'coarse', 'tick' or 'system', not '%s'", name);
+    return -1;
+}
+
 
 static PyObject *
 set_callback(LRU *self, PyObject *args)
@@ -163,595 +476,7637 @@ set_callback(LRU *self, PyObject *args)
     return result;
 }
 
-static void
-lru_remove_node(LRU *self, Node* node)
+/*
+ * Hash table. Returns the index of the node holding key, -1 if there is none
+ * and -2 with an exception set if a comparison failed.
+ */
+static Py_ssize_t
+lru_lookup(LRU *self, PyObject *key, Py_hash_t hash)
 {
-    if (self->first == node) {
-        self->first = node->next;
-    }
-    if (self->last == node) {
-        self->last = node->prev;
-    }
-    if (node->prev) {
-        node->prev->next = node->next;
-    }
-    if (node->next) {
-        node->next->prev = node->prev;
-    }
-    node->next = node->prev = NULL;
-}
+    size_t mask, i, perturb;
+    uint32_t ix;
+    Node *node;
+    PyObject *startkey;
+    int cmp;
 
-static void
-lru_add_node_at_head(LRU *self, Node* node)
-{
-    node->prev = NULL;
-    if (!self->first) {
-        self->first = self->last = node;
-        node->next = NULL;
-    } else {
-        node->next = self->first;
-        if (node->next) {
-            node->next->prev = node;
+restart:
+    mask = self->mask;
+    perturb = (size_t)hash;
+    i = (size_t)hash & mask;
+    for (;;) {
+        ix = self->table[i];
+        if (ix == SLOT_EMPTY)
+            return -1;
+        if (ix != SLOT_DUMMY) {
+            node = NODE(self, ix);
+            if (node->key == key)
+                return ix;
+            if (node->hash == hash) {
+                startkey = node->key;
+                Py_INCREF(startkey);
+                cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
+                Py_DECREF(startkey);
+                if (cmp < 0)
+                    return -2;
+                if (self->mask != mask || self->table[i] != ix ||
+                    NODE(self, ix)->key != startkey)
+                    goto restart;  /* the comparison changed the table */
+                if (cmp > 0)
+                    return ix;
+            }
         }
-        self->first = node;
+        perturb >>= PERTURB_SHIFT;
+        i = (i * 5 + perturb + 1) & mask;
     }
 }
 
+/* Put ix in the first free slot of its probe sequence, the key must not be in the table. */
 static void
-lru_delete_last(LRU *self)
+table_insert(LRU *self, Py_hash_t hash, uint32_t ix)
 {
-    PyObject *arglist;
-    PyObject *result;
-    Node* n = self->last;
+    size_t mask = self->mask;
+    size_t perturb = (size_t)hash;
+    size_t i = (size_t)hash & mask;
 
-    if (!self->last)
-        return;
-
-    if (self->callback) {
-        
-        arglist = Py_BuildValue("OO", n->key, n->value);
-        result = PyObject_CallObject(self->callback, arglist);
-        Py_XDECREF(result);
-        Py_DECREF(arglist);
+    while (self->table[i] != SLOT_EMPTY && self->table[i] != SLOT_DUMMY) {
+        perturb >>= PERTURB_SHIFT;
+        i = (i * 5 + perturb + 1) & mask;
     }
-
-    lru_remove_node(self, n);
-    PUT_NODE(self->dict, n->key, NULL);
+    if (self->table[i] == SLOT_EMPTY)
+        self->fill++;
+    self->table[i] = ix;
+    self->used++;
 }
 
-
-
 static void
-lru_delete_expire(LRU *self, Node* n)
+table_delete(LRU *self, Py_hash_t hash, uint32_t ix)
 {
-    PyObject *arglist;
-    PyObject *result;
+    size_t mask = self->mask;
+    size_t perturb = (size_t)hash;
+    size_t i = (size_t)hash & mask;
 
-
-    if (self->callback) {
-        
-        arglist = Py_BuildValue("OO", n->key, n->value);
-        result = PyObject_CallObject(self->callback, arglist);
-        Py_XDECREF(result);
-        Py_DECREF(arglist);
+    while (self->table[i] != ix) {
+        assert(self->table[i] != SLOT_EMPTY);
+        perturb >>= PERTURB_SHIFT;
+        i = (i * 5 + perturb + 1) & mask;
     }
-
-    lru_remove_node(self, n);
-    PUT_NODE(self->dict, n->key, NULL);
-}
-
-
-
-static Py_ssize_t
-lru_length(LRU *self)
-{
-    return PyDict_Size(self->dict);
+    self->table[i] = SLOT_DUMMY;
+    self->used--;
 }
 
-
+/* Rebuild the table with room for at least minused nodes at a load below 1/2. */
 static int
-LRU_contains_check_with_ttl(LRU *self, PyObject *key)
+table_resize(LRU *self, Py_ssize_t minused)
 {
-    _PyTime_t t_now;
-
-    Node *node = GET_NODE(self->dict, key);
-    PyErr_Clear();  /* GET_NODE sets an exception on miss. Shut it up. */
-    if (!node) {
-        return 0;
-    }
-    
-    assert(PyObject_TypeCheck(node, &NodeType));
+    size_t newsize = TABLE_MINSIZE;
+    size_t oldsize = self->mask + 1;
+    uint32_t *oldtable = self->table;
+    uint32_t *newtable;
+    size_t i;
 
-    t_now = _PyTime_GetSystemClock();
-    if (IS_EXPIRED(t_now, node)){
-        lru_delete_expire(self, node);
-        Py_DECREF(node);
-        return 0;
+    while (newsize <= (size_t)minused * 2)
+        newsize <<= 1;
+    newtable = PyMem_New(uint32_t, newsize);
+    if (!newtable) {
+        PyErr_NoMemory();
+        return -1;
     }
-    return 1;
-}
+    memset(newtable, 0xff, newsize * sizeof(uint32_t));
 
-static PyObject *
-LRU_contains_key(LRU *self, PyObject *key)
-{
-    if (LRU_contains_check_with_ttl(self, key)) {
-        Py_RETURN_TRUE;
-    } else {
-        Py_RETURN_FALSE;
+    self->table = newtable;
+    self->mask = newsize - 1;
+    self->used = self->fill = 0;
+    for (i = 0; i < oldsize; i++) {
+        if (oldtable[i] != SLOT_EMPTY && oldtable[i] != SLOT_DUMMY)
+            table_insert(self, NODE(self, oldtable[i])->hash, oldtable[i]);
     }
+    PyMem_Free(oldtable);
+    return 0;
 }
 
-static PyObject *
-LRU_contains(LRU *self, PyObject *args)
+/* Make sure one more node can be put in the table, keeping the load under 2/3. */
+static int
+table_reserve(LRU *self, Py_ssize_t extra)
 {
-    PyObject *key;
-    if (!PyArg_ParseTuple(args, "O", &key))
-        return NULL;
-    return LRU_contains_key(self, key);
+    if ((size_t)(self->fill + extra) * 3 >= (self->mask + 1) * 2)
+        return table_resize(self, self->used + extra);
+    return 0;
 }
 
+/* Grow the node array to hold new_cap nodes. */
 static int
-LRU_seq_contains(LRU *self, PyObject *key)
+node_reserve(LRU *self, Py_ssize_t new_cap)
 {
-    return LRU_contains_check_with_ttl(self, key);
-}
+    Node *new_nodes;
 
-static PyObject *
-lru_subscript(LRU *self, register PyObject *key)
-{
-    _PyTime_t t_now;
+    if (new_cap > MAX_NODES)
+        new_cap = MAX_NODES;
+    if (new_cap <= self->nodes_cap) {
+        PyErr_SetString(PyExc_OverflowError, "too many items in TTLRU");
+        return -1;
+    }
+    if (self->max_weight) {
+        Py_ssize_t *new_weights = PyMem_Resize(self->weights, Py_ssize_t, new_cap);
 
-    Node *node = GET_NODE(self->dict, key);
-    if (!node) {
-        self->misses++;
-        return NULL;
+        if (!new_weights) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->weights = new_weights;
     }
+    if (self->ttls || self->soft_ttl != -1) {
+        PyTime_t *new_ttls = PyMem_Resize(self->ttls, PyTime_t, new_cap);
 
-    assert(PyObject_TypeCheck(node, &NodeType));
+        if (!new_ttls) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->ttls = new_ttls;
+    }
+    if (self->tag_links) {
+        TagLink *new_links = PyMem_Resize(self->tag_links, TagLink, new_cap);
 
-    t_now = _PyTime_GetSystemClock();
-    if (IS_EXPIRED(t_now, node)){
-        lru_delete_expire(self, node);
-        Py_DECREF(node); 
-        self->misses++;
-        GET_NODE(self->dict, key);
-        return NULL;
+        if (!new_links) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->tag_links = new_links;
+    }
+    new_nodes = PyMem_Resize(self->nodes, Node, new_cap);
+    if (!new_nodes) {
+        PyErr_NoMemory();
+        return -1;
     }
+    self->nodes = new_nodes;
+    self->nodes_cap = new_cap;
+    self->pool_grows++;
+    return 0;
+}
+
+/*
+ * Node pool. Returns the index of an unused node, or -1 with an exception set.
+ * A node freed by an eviction or a delete is taken from the free list first, so
+ * once the array reached size + 1 nodes inserts do not call the allocator.
+ */
+static Py_ssize_t
+node_alloc(LRU *self)
+{
+    uint32_t ix;
 
-    /* We don't need to move the node when it's already self->first. */
-    if (node != self->first) {
-        lru_remove_node(self, node);
-        lru_add_node_at_head(self, node);
+    if (self->free != NIL) {
+        ix = self->free;
+        self->free = NODE(self, ix)->next;
+        self->pool_reused++;
+        return ix;
     }
+    if (self->nodes_top == self->nodes_cap) {
+        Py_ssize_t new_cap = self->nodes_cap ? self->nodes_cap * 2 : 8;
 
-    self->hits++;
-    Py_INCREF(node->value);
-    Py_DECREF(node);
-    return node->value;
+        /* the list may hold size + 1 nodes until the insert evicts one */
+        if (new_cap > self->size + 1)
+            new_cap = self->size + 1;
+        if (node_reserve(self, new_cap) != 0)
+            return -1;
+    }
+    if (self->tag_links)
+        self->tag_links[self->nodes_top].tag = NIL;
+    return self->nodes_top++;
 }
 
-static PyObject *
-LRU_get(LRU *self, PyObject *args)
+/* Take the node out of the list of its tag. */
+static void
+tag_unlink(LRU *self, uint32_t ix)
 {
-    PyObject *key;
-    PyObject *default_obj = NULL;
-    PyObject *result;
-
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_obj))
-        return NULL;
+    TagLink *link = &self->tag_links[ix];
+    TagList *list = &self->tags[link->tag];
 
-    result = lru_subscript(self, key);
-    PyErr_Clear();  /* GET_NODE sets an exception on miss. Shut it up. */
-    if (result)
-        return result;
+    if (link->prev == NIL)
+        list->first = link->next;
+    else
+        self->tag_links[link->prev].next = link->next;
+    if (link->next != NIL)
+        self->tag_links[link->next].prev = link->prev;
+    if (--list->count == 0)
+        self->tags_live--;
+    link->tag = NIL;
+}
 
-    if (!default_obj) {
-        Py_RETURN_NONE;
-    }
+static void
+node_free(LRU *self, uint32_t ix)
+{
+    Node *node = NODE(self, ix);
 
-    Py_INCREF(default_obj);
-    return default_obj;
+    /* every removal ends here, so the tag lists never hold a free node */
+    if (self->tag_links && self->tag_links[ix].tag != NIL)
+        tag_unlink(self, ix);
+    node->key = node->value = NULL;
+    node->next = self->free;
+    self->free = ix;
 }
 
+/* Make room for n more items at once, so a batch insert grows the storage only once. */
 static int
-LRU_ass_sub_ttl(LRU *self, PyObject *key, PyObject *value, _PyTime_t ttl)
+lru_reserve(LRU *self, Py_ssize_t n)
 {
-    int res = 0;
-    _PyTime_t t_now;
-    Node *node = GET_NODE(self->dict, key);
-    PyErr_Clear();  /* GET_NODE sets an exception on miss. Shut it up. */
+    Py_ssize_t want;
 
-    if (value) {
-        if (node) {
-            Py_INCREF(value);
-            Py_DECREF(node->value);
-            node->value = value;
+    if (n > self->size)
+        n = self->size;
+    want = self->used + n;
+    if (want > self->size + 1)
+        want = self->size + 1;
+    if (want > self->nodes_cap && node_reserve(self, want) != 0)
+        return -1;
+    return table_reserve(self, want - self->used);
+}
 
-            lru_remove_node(self, node);
-            lru_add_node_at_head(self, node);
+/*
+ * Eviction policies. The list is cut into up to three segments that follow each
+ * other from the head to the tail, node->seg is the segment of a node and every
+ * segment keeps its own first, last and count:
+ *
+ *   lru      one segment.
+ *   slru     protected, probation. New items go to probation, a hit moves an item
+ *            to protected and the overflow of protected goes back to probation.
+ *   2q       Am, A1in. New items go to the A1in FIFO, which is evicted first while
+ *            it holds more than a quarter of the items. The hashes of the keys it
+ *            evicts stay in a ghost table, such a key goes to Am when it comes back.
+ *   tinylfu  window, protected, probation. New items go to a 1% LRU window, the
+ *            overflow of the window competes with the tail of probation and the one
+ *            with the lower estimated frequency is evicted. The frequencies come
+ *            from a count-min sketch of 4 bit counters behind a doorkeeper bloom
+ *            filter, halved every 10 * size accesses.
+ *
+ * The tail of the list is always in the coldest segment.
+ *
+ * With approximate, lru is replaced by CLOCK: a hit only sets node->ref and the
+ * list stays in insertion order. To evict, the hand takes the tail, a node whose
+ * ref is set gets a second chance and goes back to the head with ref cleared.
+ * Reads then write one byte at most instead of relinking three nodes.
+ */
+enum {
+    POLICY_LRU,
+    POLICY_SLRU,
+    POLICY_2Q,
+    POLICY_TINYLFU,
+};
 
-            res = 0;
-        } else {
-            node = PyObject_NEW(Node, &NodeType);
-            node->key = key;
-            node->value = value;
-            node->next = node->prev = NULL;
+static const char *policy_names[] = {"lru", "slru", "2q", "tinylfu", NULL};
 
-            Py_INCREF(key);
-            Py_INCREF(value);
+/* The segments of each policy, in list order. */
+#define SEG_MAIN 0
+#define SEG_SLRU_PROTECTED 0
+#define SEG_SLRU_PROBATION 1
+#define SEG_2Q_AM 0
+#define SEG_2Q_A1IN 1
+#define SEG_TLFU_WINDOW 0
+#define SEG_TLFU_PROTECTED 1
+#define SEG_TLFU_PROBATION 2
 
-            res = PUT_NODE(self->dict, key, node);
-            if (res == 0) {
-                if (lru_length(self) > self->size) {
-                    lru_delete_last(self);
-                }
+#define GHOST_PROBES 8
+#define SKETCH_MAX_WORDS ((size_t)1 << 24)
 
-                lru_add_node_at_head(self, node);
-            }
-        }
-        if (ttl == -1)
-            node->expire = -1;
-        else{
-            t_now = _PyTime_GetSystemClock();
-            node->expire = t_now + ttl;
-        }
-    } else {
-        res = PUT_NODE(self->dict, key, NULL);
-        if (res == 0) {
-            assert(node && PyObject_TypeCheck(node, &NodeType));
-            lru_remove_node(self, node);
-        }
-    }
+static int
+policy_from_name(const char *name)
+{
+    int i;
 
-    Py_XDECREF(node);
+    for (i = 0; policy_names[i]; i++) {
+        if (strcmp(name, policy_names[i]) == 0)
+            return i;
+    }
+    PyErr_Format(PyExc_ValueError,
+                 "policy should be 'lru', 'slru', '2q' or 'tinylfu', not '%s'", name);
+    return -1;
+}
+
+static uint64_t
+mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return x;
+}
+
+static void
+lru_remove_node(LRU *self, uint32_t ix)
+{
+    Node *node = NODE(self, ix);
+    int seg = node->seg;
+
+    if (self->seg_first[seg] == ix && self->seg_last[seg] == ix) {
+        self->seg_first[seg] = self->seg_last[seg] = NIL;
+    } else if (self->seg_first[seg] == ix) {
+        self->seg_first[seg] = node->next;
+    } else if (self->seg_last[seg] == ix) {
+        self->seg_last[seg] = node->prev;
+    }
+    self->seg_count[seg]--;
+    if (self->first == ix) {
+        self->first = node->next;
+    }
+    if (self->last == ix) {
+        self->last = node->prev;
+    }
+    if (node->prev != NIL) {
+        NODE(self, node->prev)->next = node->next;
+    }
+    if (node->next != NIL) {
+        NODE(self, node->next)->prev = node->prev;
+    }
+    node->next = node->prev = NIL;
+    self->version++;
+}
+
+/* Link the node at the head of segment seg, after the tail of the segments before it. */
+static void
+lru_add_node_to_seg(LRU *self, uint32_t ix, int seg)
+{
+    Node *node = NODE(self, ix);
+    uint32_t prev = NIL;
+    int s;
+
+    self->version++;
+    node->seg = (uint8_t)seg;
+    for (s = seg - 1; s >= 0 && prev == NIL; s--)
+        prev = self->seg_last[s];
+    node->prev = prev;
+    node->next = prev == NIL ? self->first : NODE(self, prev)->next;
+    if (prev == NIL)
+        self->first = ix;
+    else
+        NODE(self, prev)->next = ix;
+    if (node->next == NIL)
+        self->last = ix;
+    else
+        NODE(self, node->next)->prev = ix;
+
+    self->seg_first[seg] = ix;
+    if (self->seg_last[seg] == NIL)
+        self->seg_last[seg] = ix;
+    self->seg_count[seg]++;
+}
+
+static void
+lru_move_to_seg(LRU *self, uint32_t ix, int seg)
+{
+    lru_remove_node(self, ix);
+    lru_add_node_to_seg(self, ix, seg);
+}
+
+/* 2Q ghost table: hashes with the sequence number of their eviction. */
+static uint64_t *
+ghost_slot(LRU *self, Py_hash_t hash, int probe)
+{
+    size_t i = (mix64((uint64_t)hash) + (size_t)probe) & self->ghost_mask;
+
+    return &self->ghost[i * 2];
+}
+
+#define GHOST_LIVE(self, g) ((g)[1] != 0 && (self)->ghost_seq - (g)[1] < (uint64_t)(self)->ghost_cap)
+
+static void
+ghost_add(LRU *self, Py_hash_t hash)
+{
+    uint64_t *g, *oldest = NULL;
+    int i;
+
+    self->ghost_seq++;
+    for (i = 0; i < GHOST_PROBES; i++) {
+        g = ghost_slot(self, hash, i);
+        if (!GHOST_LIVE(self, g) || g[0] == (uint64_t)hash) {
+            oldest = g;
+            break;
+        }
+        if (oldest == NULL || g[1] < oldest[1])
+            oldest = g;
+    }
+    oldest[0] = (uint64_t)hash;
+    oldest[1] = self->ghost_seq;
+}
+
+/* Remove hash from the ghost table, returns whether it was there. */
+static int
+ghost_take(LRU *self, Py_hash_t hash)
+{
+    uint64_t *g;
+    int i;
+
+    for (i = 0; i < GHOST_PROBES; i++) {
+        g = ghost_slot(self, hash, i);
+        if (g[0] == (uint64_t)hash && GHOST_LIVE(self, g)) {
+            g[1] = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* TinyLFU frequency sketch, four counters per key picked by double hashing. */
+static int
+sketch_seen(LRU *self, uint64_t h, int set)
+{
+    size_t bits = (self->door_mask + 1) * 64;
+    uint64_t b1 = h % bits, b2 = (h >> 32) % bits;
+    int seen = (self->door[b1 / 64] >> (b1 % 64) & 1) && (self->door[b2 / 64] >> (b2 % 64) & 1);
+
+    if (set) {
+        self->door[b1 / 64] |= UINT64_C(1) << (b1 % 64);
+        self->door[b2 / 64] |= UINT64_C(1) << (b2 % 64);
+    }
+    return seen;
+}
+
+static void
+sketch_age(LRU *self)
+{
+    size_t i;
+
+    for (i = 0; i <= self->sketch_mask; i++)
+        self->sketch[i] = (self->sketch[i] >> 1) & UINT64_C(0x7777777777777777);
+    memset(self->door, 0, (self->door_mask + 1) * sizeof(uint64_t));
+    self->sketch_adds /= 2;
+}
+
+static void
+sketch_increment(LRU *self, Py_hash_t hash)
+{
+    uint64_t h = mix64((uint64_t)hash), step = (h >> 32) | 1, idx;
+    int i, shift;
+
+    if (sketch_seen(self, h, 1)) {
+        for (i = 0; i < 4; i++) {
+            idx = h + i * step;
+            shift = (int)(idx & 15) * 4;
+            idx = (idx >> 4) & self->sketch_mask;
+            if ((self->sketch[idx] >> shift & 15) != 15)
+                self->sketch[idx] += UINT64_C(1) << shift;
+        }
+    }
+    if (++self->sketch_adds >= self->sketch_sample)
+        sketch_age(self);
+}
+
+static int
+sketch_frequency(LRU *self, Py_hash_t hash)
+{
+    uint64_t h = mix64((uint64_t)hash), step = (h >> 32) | 1, idx;
+    int i, shift, count, freq = 15;
+
+    for (i = 0; i < 4; i++) {
+        idx = h + i * step;
+        shift = (int)(idx & 15) * 4;
+        idx = (idx >> 4) & self->sketch_mask;
+        count = (int)(self->sketch[idx] >> shift & 15);
+        if (count < freq)
+            freq = count;
+    }
+    return freq + sketch_seen(self, h, 0);
+}
+
+/*
+ * Size the segments and the policy tables for self->size items. The tables are
+ * only reallocated when their size changes, their content is kept otherwise.
+ * Returns -1 with an exception set on error.
+ */
+static int
+policy_resize(LRU *self)
+{
+    Py_ssize_t size = self->size, main;
+    size_t words;
+
+    self->seg_cap[0] = self->seg_cap[1] = self->seg_cap[2] = 0;
+    switch (self->policy) {
+    case POLICY_SLRU:
+        /* probation keeps at least one slot, or a new item would evict itself */
+        self->seg_cap[SEG_SLRU_PROTECTED] = size - (size / 5 > 0 ? size / 5 : 1);
+        break;
+    case POLICY_2Q:
+        self->seg_cap[SEG_2Q_A1IN] = size / 4 > 0 ? size / 4 : 1;
+        self->ghost_cap = size / 2 > 0 ? size / 2 : 1;
+        words = 8;
+        while (words < (size_t)self->ghost_cap * 2 && words < SKETCH_MAX_WORDS)
+            words *= 2;
+        if (self->ghost == NULL || self->ghost_mask != words - 1) {
+            PyMem_Free(self->ghost);
+            self->ghost = PyMem_Calloc(words * 2, sizeof(uint64_t));
+            if (self->ghost == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->ghost_mask = words - 1;
+        }
+        break;
+    case POLICY_TINYLFU:
+        self->seg_cap[SEG_TLFU_WINDOW] = size / 100 > 0 ? size / 100 : 1;
+        main = size - self->seg_cap[SEG_TLFU_WINDOW];
+        self->seg_cap[SEG_TLFU_PROTECTED] = main > 1 ? main - (main / 5 > 0 ? main / 5 : 1) : 0;
+        self->sketch_sample = 10 * size;
+        words = 8;
+        while (words < (size_t)size && words < SKETCH_MAX_WORDS)
+            words *= 2;
+        if (self->sketch == NULL || self->sketch_mask != words - 1) {
+            PyMem_Free(self->sketch);
+            PyMem_Free(self->door);
+            self->sketch = PyMem_Calloc(words, sizeof(uint64_t));
+            self->door = PyMem_Calloc(words / 4, sizeof(uint64_t));
+            if (self->sketch == NULL || self->door == NULL) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            self->sketch_mask = words - 1;
+            self->door_mask = words / 4 - 1;
+            self->sketch_adds = 0;
+        }
+        break;
+    }
+    /* a smaller protected segment gives its oldest items back to probation */
+    if (self->policy == POLICY_SLRU) {
+        while (self->seg_count[SEG_SLRU_PROTECTED] > self->seg_cap[SEG_SLRU_PROTECTED])
+            lru_move_to_seg(self, self->seg_last[SEG_SLRU_PROTECTED], SEG_SLRU_PROBATION);
+    } else if (self->policy == POLICY_TINYLFU) {
+        while (self->seg_count[SEG_TLFU_PROTECTED] > self->seg_cap[SEG_TLFU_PROTECTED])
+            lru_move_to_seg(self, self->seg_last[SEG_TLFU_PROTECTED], SEG_TLFU_PROBATION);
+    }
+    return 0;
+}
+
+static void
+policy_clear(LRU *self)
+{
+    int s;
+
+    for (s = 0; s < 3; s++) {
+        self->seg_first[s] = self->seg_last[s] = NIL;
+        self->seg_count[s] = 0;
+    }
+    if (self->ghost)
+        memset(self->ghost, 0, (self->ghost_mask + 1) * 2 * sizeof(uint64_t));
+    if (self->sketch) {
+        memset(self->sketch, 0, (self->sketch_mask + 1) * sizeof(uint64_t));
+        memset(self->door, 0, (self->door_mask + 1) * sizeof(uint64_t));
+        self->sketch_adds = 0;
+    }
+}
+
+/* Count an access to key for the frequency estimate. */
+static inline void
+policy_record(LRU *self, Py_hash_t hash)
+{
+    if (self->policy == POLICY_TINYLFU)
+        sketch_increment(self, hash);
+}
+
+/* Move a node into a protected segment, its oldest item goes back to probation. */
+static void
+policy_protect(LRU *self, uint32_t ix, int protected, int probation)
+{
+    lru_move_to_seg(self, ix, protected);
+    if (self->seg_count[protected] > self->seg_cap[protected])
+        lru_move_to_seg(self, self->seg_last[protected], probation);
+}
+
+/* The node was read or updated. */
+static void
+policy_touch(LRU *self, uint32_t ix)
+{
+    int seg = NODE(self, ix)->seg;
+
+    switch (self->policy) {
+    case POLICY_SLRU:
+        policy_protect(self, ix, SEG_SLRU_PROTECTED, SEG_SLRU_PROBATION);
+        break;
+    case POLICY_2Q:
+        /* A1in is a FIFO, a hit does not move the item */
+        if (seg == SEG_2Q_AM)
+            lru_move_to_seg(self, ix, SEG_2Q_AM);
+        break;
+    case POLICY_TINYLFU:
+        if (seg == SEG_TLFU_WINDOW)
+            lru_move_to_seg(self, ix, SEG_TLFU_WINDOW);
+        else
+            policy_protect(self, ix, SEG_TLFU_PROTECTED, SEG_TLFU_PROBATION);
+        break;
+    default:
+        if (self->approximate) {
+            /* only write when the bit changes, repeated hits keep the line clean */
+            if (!NODE(self, ix)->ref)
+                NODE(self, ix)->ref = 1;
+            break;
+        }
+        /* We don't need to move the node when it's already self->first. */
+        if (ix != self->first)
+            lru_move_to_seg(self, ix, SEG_MAIN);
+    }
+}
+
+/* Link a new node into the segment the policy starts it in. */
+static void
+policy_admit(LRU *self, uint32_t ix)
+{
+    switch (self->policy) {
+    case POLICY_SLRU:
+        lru_add_node_to_seg(self, ix, SEG_SLRU_PROBATION);
+        break;
+    case POLICY_2Q:
+        lru_add_node_to_seg(self, ix, ghost_take(self, NODE(self, ix)->hash) ?
+                                      SEG_2Q_AM : SEG_2Q_A1IN);
+        break;
+    case POLICY_TINYLFU:
+        lru_add_node_to_seg(self, ix, SEG_TLFU_WINDOW);
+        /* while there is room the overflow of the window goes to probation for free */
+        if (self->seg_count[SEG_TLFU_WINDOW] > self->seg_cap[SEG_TLFU_WINDOW] &&
+            self->used <= self->size)
+            lru_move_to_seg(self, self->seg_last[SEG_TLFU_WINDOW], SEG_TLFU_PROBATION);
+        break;
+    default:
+        NODE(self, ix)->ref = 0;
+        lru_add_node_to_seg(self, ix, SEG_MAIN);
+    }
+}
+
+/* Pick the node to evict when the cache is over size, NIL if it is empty. */
+static uint32_t
+policy_victim(LRU *self)
+{
+    uint32_t candidate, victim;
+
+    switch (self->policy) {
+    case POLICY_2Q:
+        if (self->seg_count[SEG_2Q_A1IN] > self->seg_cap[SEG_2Q_A1IN] ||
+            self->seg_count[SEG_2Q_AM] == 0) {
+            victim = self->seg_last[SEG_2Q_A1IN];
+            if (victim != NIL)
+                ghost_add(self, NODE(self, victim)->hash);
+            return victim;
+        }
+        return self->seg_last[SEG_2Q_AM];
+    case POLICY_TINYLFU:
+        victim = self->seg_last[SEG_TLFU_PROBATION];
+        if (victim == NIL)
+            victim = self->seg_last[SEG_TLFU_PROTECTED];
+        if (self->seg_count[SEG_TLFU_WINDOW] <= self->seg_cap[SEG_TLFU_WINDOW])
+            return victim != NIL ? victim : self->last;
+        candidate = self->seg_last[SEG_TLFU_WINDOW];
+        if (victim == NIL)
+            return candidate;
+        if (sketch_frequency(self, NODE(self, candidate)->hash) <=
+            sketch_frequency(self, NODE(self, victim)->hash)) {
+            self->policy_rejected++;
+            return candidate;
+        }
+        self->policy_admitted++;
+        lru_move_to_seg(self, candidate, SEG_TLFU_PROBATION);
+        return victim;
+    default:
+        while (self->approximate && self->last != NIL && NODE(self, self->last)->ref) {
+            NODE(self, self->last)->ref = 0;
+            lru_move_to_seg(self, self->last, SEG_MAIN);
+        }
+        return self->last;
+    }
+}
+
+/*
+ * Expiry heap. self->heap holds the indices of the nodes that have a ttl,
+ * node->heap_pos is the slot of the node in the heap or NIL if it never expires.
+ */
+#define HEAP_EXPIRE(self, pos) (NODE(self, (self)->heap[pos])->expire)
+
+static void
+heap_set(LRU *self, Py_ssize_t pos, uint32_t ix)
+{
+    self->heap[pos] = ix;
+    NODE(self, ix)->heap_pos = (uint32_t)pos;
+}
+
+static void
+heap_sift_up(LRU *self, Py_ssize_t pos)
+{
+    uint32_t ix = self->heap[pos];
+    PyTime_t expire = NODE(self, ix)->expire;
+    Py_ssize_t parent;
+
+    while (pos > 0) {
+        parent = (pos - 1) >> 1;
+        if (HEAP_EXPIRE(self, parent) <= expire)
+            break;
+        heap_set(self, pos, self->heap[parent]);
+        pos = parent;
+    }
+    heap_set(self, pos, ix);
+}
+
+static void
+heap_sift_down(LRU *self, Py_ssize_t pos)
+{
+    uint32_t ix = self->heap[pos];
+    PyTime_t expire = NODE(self, ix)->expire;
+    Py_ssize_t child;
+
+    while ((child = 2 * pos + 1) < self->heap_len) {
+        if (child + 1 < self->heap_len &&
+            HEAP_EXPIRE(self, child + 1) < HEAP_EXPIRE(self, child))
+            child++;
+        if (expire <= HEAP_EXPIRE(self, child))
+            break;
+        heap_set(self, pos, self->heap[child]);
+        pos = child;
+    }
+    heap_set(self, pos, ix);
+}
+
+static int
+heap_push(LRU *self, uint32_t ix)
+{
+    if (self->heap_len == self->heap_cap) {
+        Py_ssize_t new_cap = self->heap_cap ? self->heap_cap * 2 : 8;
+        uint32_t *new_heap = PyMem_Resize(self->heap, uint32_t, new_cap);
+        if (!new_heap) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->heap = new_heap;
+        self->heap_cap = new_cap;
+    }
+    heap_set(self, self->heap_len++, ix);
+    heap_sift_up(self, self->heap_len - 1);
+    return 0;
+}
+
+static void
+heap_remove(LRU *self, uint32_t ix)
+{
+    Node *node = NODE(self, ix);
+    Py_ssize_t pos = node->heap_pos;
+    uint32_t moved;
+
+    if (node->heap_pos == NIL)
+        return;
+    node->heap_pos = NIL;
+    moved = self->heap[--self->heap_len];
+    if (moved == ix)
+        return;
+    heap_set(self, pos, moved);
+    heap_sift_up(self, pos);
+    heap_sift_down(self, NODE(self, moved)->heap_pos);
+}
+
+/* Put the node at the right place in the heap after its expire time changed. */
+static int
+heap_update(LRU *self, uint32_t ix)
+{
+    Node *node = NODE(self, ix);
+
+    if (node->expire == -1) {
+        heap_remove(self, ix);
+        return 0;
+    }
+    if (node->heap_pos == NIL)
+        return heap_push(self, ix);
+    heap_sift_up(self, node->heap_pos);
+    heap_sift_down(self, NODE(self, ix)->heap_pos);
+    return 0;
+}
+
+/*
+ * Unlink the node from the list, the heap and the table and free it. The caller
+ * gets the references to the key and the value and has to release them.
+ */
+static void
+lru_unlink_node(LRU *self, uint32_t ix, PyObject **key, PyObject **value)
+{
+    Node *node = NODE(self, ix);
+
+    *key = node->key;
+    *value = node->value;
+    if (self->weights)
+        self->total_weight -= self->weights[ix];
+    lru_remove_node(self, ix);
+    heap_remove(self, ix);
+    table_delete(self, node->hash, ix);
+    node_free(self, ix);
+}
+
+/* Unlink the node and release its key and value, without calling the callback. */
+static void
+lru_drop_node(LRU *self, uint32_t ix)
+{
+    PyObject *key, *value;
+
+    lru_unlink_node(self, ix, &key, &value);
+    Py_DECREF(key);
+    Py_DECREF(value);
+}
+
+/*
+ * Unlink up to count expired nodes met from the head (or the tail), then
+ * release their keys and values, so a __del__ run by the release finds the
+ * cache consistent and no walk is left on a freed node. Without memory for
+ * the references the nodes stay, the next walk drops them.
+ */
+static void
+lru_drop_expired(LRU *self, int from_tail, Py_ssize_t count, PyTime_t t_now, int reason)
+{
+    PyObject **refs;
+    Py_ssize_t i, n = 0;
+    uint32_t curr, next;
+
+    if (count == 0)
+        return;
+    refs = PyMem_New(PyObject *, 2 * count);
+    if (refs == NULL)
+        return;
+    curr = from_tail ? self->last : self->first;
+    while (curr != NIL && n < count) {
+        next = from_tail ? NODE(self, curr)->prev : NODE(self, curr)->next;
+        if (IS_EXPIRED(t_now, NODE(self, curr))) {
+            lru_unlink_node(self, curr, &refs[2 * n], &refs[2 * n + 1]);
+            self->metrics.removed[reason]++;
+            n++;
+        }
+        curr = next;
+    }
+    for (i = 0; i < 2 * n; i++)
+        Py_DECREF(refs[i]);
+    PyMem_Free(refs);
+}
+
+static int
+notify_from_name(const char *name)
+{
+    int i;
+
+    for (i = 0; notify_names[i]; i++) {
+        if (strcmp(name, notify_names[i]) == 0)
+            return i;
+    }
+    PyErr_Format(PyExc_ValueError,
+                 "notify should be 'call', 'batch' or 'queue', not '%s'", name);
+    return -1;
+}
+
+/*
+ * Queue an eviction, stealing the references to key and value. Evictions
+ * cannot fail, so when the ring cannot grow the record is dropped and counted.
+ */
+static void
+ring_push(LRU *self, PyObject *key, PyObject *value, int reason)
+{
+    Eviction *ev;
+
+    if (self->ring_max && self->ring_len >= self->ring_max) {
+        ev = &self->ring[self->ring_head];
+        Py_DECREF(ev->key);
+        Py_DECREF(ev->value);
+        self->ring_head = (self->ring_head + 1) & (self->ring_cap - 1);
+        self->ring_len--;
+        self->ring_dropped++;
+    }
+    if (self->ring_len == self->ring_cap) {
+        Py_ssize_t newcap = self->ring_cap ? self->ring_cap * 2 : 16;
+        Eviction *ring = PyMem_New(Eviction, newcap);
+        Py_ssize_t i;
+
+        if (ring == NULL) {
+            Py_DECREF(key);
+            Py_DECREF(value);
+            self->ring_dropped++;
+            return;
+        }
+        for (i = 0; i < self->ring_len; i++)
+            ring[i] = self->ring[(self->ring_head + i) & (self->ring_cap - 1)];
+        PyMem_Free(self->ring);
+        self->ring = ring;
+        self->ring_cap = newcap;
+        self->ring_head = 0;
+    }
+    ev = &self->ring[(self->ring_head + self->ring_len) & (self->ring_cap - 1)];
+    ev->key = key;
+    ev->value = value;
+    ev->reason = reason;
+    self->ring_len++;
+}
+
+/* Move the queued evictions into a new list of (key, value, reason) tuples. */
+static PyObject *
+ring_take(LRU *self)
+{
+    PyObject *list = PyList_New(self->ring_len);
+    PyObject *record;
+    Eviction *ev;
+    Py_ssize_t i;
+
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < self->ring_len; i++) {
+        ev = &self->ring[(self->ring_head + i) & (self->ring_cap - 1)];
+        record = Py_BuildValue("OOs", ev->key, ev->value, remove_reason_names[ev->reason]);
+        if (record == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, record);
+    }
+    /* The references move to the list only once it is complete */
+    for (i = 0; i < self->ring_len; i++) {
+        ev = &self->ring[(self->ring_head + i) & (self->ring_cap - 1)];
+        Py_DECREF(ev->key);
+        Py_DECREF(ev->value);
+    }
+    self->ring_head = self->ring_len = 0;
+    return list;
+}
+
+static void
+ring_free(LRU *self)
+{
+    Eviction *ev;
+
+    while (self->ring_len) {
+        ev = &self->ring[self->ring_head];
+        Py_DECREF(ev->key);
+        Py_DECREF(ev->value);
+        self->ring_head = (self->ring_head + 1) & (self->ring_cap - 1);
+        self->ring_len--;
+    }
+    PyMem_Free(self->ring);
+    self->ring = NULL;
+    self->ring_cap = self->ring_head = 0;
+}
+
+/*
+ * Hand the queued evictions to the callback. It runs once the call that evicted
+ * them is done with the storage, so it may use the cache. Evictions it causes
+ * wait for the next call. An exception of the callback is reported with
+ * PyErr_WriteUnraisable(), the exception of the call is kept.
+ */
+static void
+lru_notify_flush(LRU *self)
+{
+    PyObject *exc_type, *exc_value, *exc_tb;
+    PyObject *callback, *batch, *result;
+
+    if (self->callback == NULL)
+        return;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    callback = self->callback;
+    Py_INCREF(callback);
+    batch = ring_take(self);
+    if (batch == NULL) {
+        PyErr_WriteUnraisable(callback);
+    } else {
+        self->notify_hold++;
+        result = PyObject_CallFunctionObjArgs(callback, batch, NULL);
+        self->notify_hold--;
+        if (result == NULL)
+            PyErr_WriteUnraisable(callback);
+        Py_XDECREF(result);
+        Py_DECREF(batch);
+    }
+    Py_DECREF(callback);
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/* The safe point of the batch mode, called when a call that can evict is done. */
+static inline void
+lru_notify(LRU *self)
+{
+    if (self->ring_len && self->notify == NOTIFY_BATCH && !self->notify_hold)
+        lru_notify_flush(self);
+}
+
+/*
+ * Count the removal of an unlinked node, then pass its key and value to the
+ * callback if one is set, or queue them for a batch or drain_evictions().
+ * Takes the references to key and value.
+ */
+static void
+lru_evicted(LRU *self, PyObject *key, PyObject *value, int reason)
+{
+    PyObject *result;
+
+    self->metrics.removed[reason]++;
+
+    if (self->notify == NOTIFY_QUEUE || (self->notify == NOTIFY_BATCH && self->callback)) {
+        ring_push(self, key, value, reason);
+        return;
+    }
+    if (self->callback) {
+        result = PyObject_CallFunctionObjArgs(self->callback, key, value, NULL);
+        if (result == NULL)
+            PyErr_WriteUnraisable(self->callback);
+        Py_XDECREF(result);
+    }
+
+    Py_DECREF(key);
+    Py_DECREF(value);
+}
+
+/* Unlink the node and notify its removal. */
+static void
+lru_evict_node(LRU *self, uint32_t ix, int reason)
+{
+    PyObject *key, *value;
+
+    lru_unlink_node(self, ix, &key, &value);
+    lru_evicted(self, key, value, reason);
+}
+
+static void
+lru_delete_last(LRU *self, int reason)
+{
+    uint32_t victim = policy_victim(self);
+
+    if (victim == NIL)
+        return;
+
+    lru_evict_node(self, victim, reason);
+}
+
+static void
+lru_delete_expire(LRU *self, uint32_t ix, int reason)
+{
+    lru_evict_node(self, ix, reason);
+}
+
+/*
+ * Make room for one more item, preferring an expired node over the LRU tail.
+ * reason is counted when a live item has to go.
+ */
+static void
+lru_evict_one(LRU *self, PyTime_t *t_now, int reason)
+{
+    if (self->heap_len && IS_EXPIRED(lru_now_cached(self, t_now), NODE(self, self->heap[0])))
+        lru_delete_expire(self, self->heap[0], EXPIRED_EVICT);
+    else
+        lru_delete_last(self, reason);
+}
+
+/*
+ * Drop expired nodes, earliest first, until none is left or the budget is used up.
+ * max_items < 0 and max_ns < 0 mean no limit. The time budget is only checked every
+ * PURGE_CLOCK_STRIDE nodes to keep the clock reads off the loop.
+ * Returns the number of dropped nodes.
+ */
+#define PURGE_CLOCK_STRIDE 8
+
+static Py_ssize_t
+lru_purge(LRU *self, PyTime_t t_now, Py_ssize_t max_items, PyTime_t max_ns, int reason)
+{
+    Py_ssize_t count = 0;
+    PyTime_t deadline = 0;
+
+    if (max_ns >= 0)
+        deadline = clock_monotonic() + max_ns;
+
+    while (self->heap_len && IS_EXPIRED(t_now, NODE(self, self->heap[0]))) {
+        if (count == max_items)
+            break;
+        if (max_ns >= 0 && count % PURGE_CLOCK_STRIDE == PURGE_CLOCK_STRIDE - 1 &&
+            clock_monotonic() >= deadline)
+            break;
+        lru_delete_expire(self, self->heap[0], reason);
+        count++;
+    }
+    return count;
+}
+
+/* A small slice of expiry work, done on every mutating call when auto_purge is set. */
+static void
+lru_auto_purge(LRU *self, PyTime_t *t_now)
+{
+    if (self->auto_purge > 0 && self->heap_len)
+        self->auto_purged += lru_purge(self, lru_now_cached(self, t_now), self->auto_purge, -1,
+                                       EXPIRED_AUTO_PURGE);
+}
+
+/* Shallow size of an object, close to sys.getsizeof() for the common types. */
+static Py_ssize_t
+object_size(PyObject *obj)
+{
+    PyTypeObject *tp = Py_TYPE(obj);
+
+    if (PyUnicode_Check(obj))
+        return tp->tp_basicsize + (PyUnicode_GET_LENGTH(obj) + 1) * PyUnicode_KIND(obj);
+    if (PyLong_Check(obj))
+        return tp->tp_basicsize + sizeof(digit);
+    if (PyByteArray_Check(obj))
+        return tp->tp_basicsize + PyByteArray_GET_SIZE(obj);
+    if (PyList_Check(obj))
+        return tp->tp_basicsize + PyList_GET_SIZE(obj) * sizeof(PyObject *);
+    if (tp->tp_itemsize)
+        return tp->tp_basicsize + Py_ABS(Py_SIZE(obj)) * tp->tp_itemsize;
+    return tp->tp_basicsize;
+}
+
+/*
+ * Weight of an item, from the weigher or else the estimated bytes of the node,
+ * the key and the value. Returns -1 with an exception set on error.
+ */
+static Py_ssize_t
+lru_weigh(LRU *self, PyObject *key, PyObject *value)
+{
+    PyObject *res;
+    Py_ssize_t weight;
+
+    if (self->weigher == NULL)
+        return sizeof(Node) + sizeof(Py_ssize_t) + object_size(key) + object_size(value);
+
+    res = PyObject_CallFunctionObjArgs(self->weigher, key, value, NULL);
+    if (res == NULL)
+        return -1;
+    weight = PyLong_AsSsize_t(res);
+    Py_DECREF(res);
+    if (weight == -1 && PyErr_Occurred())
+        return -1;
+    if (weight < 0) {
+        PyErr_SetString(PyExc_ValueError, "weigher should return a non negative int");
+        return -1;
+    }
+    return weight;
+}
+
+/* Evict until the total weight fits in max_weight. */
+static void
+lru_fit_weight(LRU *self, PyTime_t *t_now)
+{
+    while (self->max_weight && self->total_weight > self->max_weight && self->used)
+        lru_evict_one(self, t_now, EVICTED_WEIGHT);
+}
+
+/*
+ * Put a new node at the head of the list, the key must not be in the table.
+ * Returns the index of the node, or -1 with an exception set.
+ */
+static Py_ssize_t
+lru_insert(LRU *self, PyObject *key, Py_hash_t hash, PyObject *value, PyTime_t expire,
+           Py_ssize_t weight)
+{
+    Py_ssize_t ix;
+    Node *node;
+
+    if (table_reserve(self, 1) != 0)
+        return -1;
+    ix = node_alloc(self);
+    if (ix < 0)
+        return -1;
+
+    node = NODE(self, ix);
+    Py_INCREF(key);
+    Py_INCREF(value);
+    node->key = key;
+    node->value = value;
+    node->hash = hash;
+    node->expire = expire;
+    node->refresh = -1;
+    node->heap_pos = NIL;
+    if (self->weights) {
+        self->weights[ix] = weight;
+        self->total_weight += weight;
+    }
+
+    table_insert(self, hash, (uint32_t)ix);
+    policy_admit(self, (uint32_t)ix);
+    if (expire != -1 && heap_push(self, (uint32_t)ix) != 0) {
+        lru_drop_node(self, (uint32_t)ix);
+        return -1;
+    }
+    return ix;
+}
+
+static Py_ssize_t
+lru_length(LRU *self)
+{
+    return self->used;
+}
+
+/*
+ * Number of expired nodes, walking only the expired top of the heap. The
+ * expired nodes are a subtree at the root, a depth first walk keeps at most
+ * one pending sibling per level on the stack.
+ */
+static Py_ssize_t
+heap_count_expired(LRU *self, PyTime_t t_now)
+{
+    Py_ssize_t stack[64];
+    Py_ssize_t pos, count = 0;
+    int depth = 0;
+
+    if (self->heap_len)
+        stack[depth++] = 0;
+    while (depth) {
+        pos = stack[--depth];
+        if (!IS_EXPIRED(t_now, NODE(self, self->heap[pos])))
+            continue;
+        count++;
+        if (2 * pos + 2 < self->heap_len)
+            stack[depth++] = 2 * pos + 2;
+        if (2 * pos + 1 < self->heap_len)
+            stack[depth++] = 2 * pos + 1;
+    }
+    return count;
+}
+
+/*
+ * Number of live items. The expired nodes are counted from the top of the
+ * heap and left in place, len() changes nothing and calls no callback.
+ */
+static Py_ssize_t
+LRU_length(LRU *self)
+{
+    if (!self->heap_len)
+        return lru_length(self);
+    return lru_length(self) - heap_count_expired(self, lru_now(self));
+}
+
+/*
+ * The negative entries of set_missing() have their own table, without nodes,
+ * so they do not show in the items and never evict a value. It holds at most
+ * max_missing entries, a new one evicts the expired entry or the one closest
+ * to expire in a sample of MISSING_SAMPLE entries.
+ */
+static Py_ssize_t
+missing_cap(LRU *self)
+{
+    return self->max_missing >= 0 ? self->max_missing : self->size;
+}
+
+/* Slot of key, -1 when it is not there, -2 with an exception set on error. */
+static Py_ssize_t
+missing_find(LRU *self, PyObject *key, Py_hash_t hash)
+{
+    size_t i, mask;
+    Missing *table;
+    PyObject *startkey;
+    int cmp;
+
+restart:
+    table = self->missing;
+    mask = self->missing_mask;
+    if (table == NULL)
+        return -1;
+    for (i = (size_t)hash & mask; table[i].key; i = (i + 1) & mask) {
+        startkey = table[i].key;
+        if (startkey == key)
+            return (Py_ssize_t)i;
+        if (table[i].hash != hash)
+            continue;
+        Py_INCREF(startkey);
+        cmp = PyObject_RichCompareBool(startkey, key, Py_EQ);
+        Py_DECREF(startkey);
+        if (cmp < 0)
+            return -2;
+        /* __eq__ may have changed the table, or replaced it */
+        if (self->missing != table || self->missing_mask != mask || table[i].key != startkey)
+            goto restart;
+        if (cmp > 0)
+            return (Py_ssize_t)i;
+    }
+    return -1;
+}
+
+/* Empty slot i and move up the entries after it. Returns the reference to its key. */
+static PyObject *
+missing_remove(LRU *self, size_t i)
+{
+    Missing *table = self->missing;
+    PyObject *key = table[i].key;
+    size_t j = i, home;
+
+    for (;;) {
+        j = (j + 1) & self->missing_mask;
+        if (table[j].key == NULL)
+            break;
+        home = (size_t)table[j].hash & self->missing_mask;
+        /* the entry at j may move to i if i is between its home slot and j */
+        if (((j - home) & self->missing_mask) >= ((j - i) & self->missing_mask)) {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+    table[i].key = NULL;
+    self->missing_used--;
+    return key;
+}
+
+static int
+missing_resize(LRU *self, size_t slots)
+{
+    Missing *old = self->missing;
+    size_t old_slots = old ? self->missing_mask + 1 : 0;
+    Missing *table = PyMem_New(Missing, slots);
+    size_t i, j;
+
+    if (table == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (i = 0; i < slots; i++)
+        table[i].key = NULL;
+    for (i = 0; i < old_slots; i++) {
+        if (old[i].key == NULL)
+            continue;
+        for (j = (size_t)old[i].hash & (slots - 1); table[j].key; j = (j + 1) & (slots - 1))
+            ;
+        table[j] = old[i];
+    }
+    PyMem_Free(old);
+    self->missing = table;
+    self->missing_mask = slots - 1;
+    return 0;
+}
+
+static void
+missing_evict(LRU *self, PyTime_t t_now)
+{
+    Missing *table = self->missing;
+    size_t i = self->missing_hand, best = 0;
+    int seen = 0, expired = 0;
+
+    while (seen < MISSING_SAMPLE && !expired) {
+        i = (i + 1) & self->missing_mask;
+        if (table[i].key == NULL)
+            continue;
+        expired = IS_EXPIRED(t_now, (&table[i]));
+        if (!seen++ || expired ||
+            (table[i].expire != -1 && (table[best].expire == -1 || table[i].expire < table[best].expire)))
+            best = i;
+    }
+    self->missing_hand = i;
+    if (expired)
+        self->missing_expired++;
+    else
+        self->missing_evicted++;
+    Py_DECREF(missing_remove(self, best));
+}
+
+/* Add or renew the negative entry of key. */
+static int
+missing_set(LRU *self, PyObject *key, Py_hash_t hash, PyTime_t expire, PyTime_t t_now)
+{
+    Py_ssize_t ix;
+    size_t i;
+
+    if (missing_cap(self) <= 0)
+        return 0;
+    ix = missing_find(self, key, hash);
+    if (ix == -2)
+        return -1;
+    if (ix >= 0) {
+        self->missing[ix].expire = expire;
+        return 0;
+    }
+    while (self->missing_used && self->missing_used >= missing_cap(self))
+        missing_evict(self, t_now);
+    if (self->missing == NULL || (size_t)(self->missing_used + 1) * 2 > self->missing_mask + 1) {
+        if (missing_resize(self, self->missing ? (self->missing_mask + 1) * 2 : TABLE_MINSIZE) != 0)
+            return -1;
+    }
+    for (i = (size_t)hash & self->missing_mask; self->missing[i].key; i = (i + 1) & self->missing_mask)
+        ;
+    Py_INCREF(key);
+    self->missing[i].key = key;
+    self->missing[i].hash = hash;
+    self->missing[i].expire = expire;
+    self->missing_used++;
+    return 0;
+}
+
+/* Drop the negative entry of key, when a value is set. */
+static int
+missing_discard(LRU *self, PyObject *key, Py_hash_t hash)
+{
+    Py_ssize_t ix = missing_find(self, key, hash);
+
+    if (ix == -2)
+        return -1;
+    if (ix >= 0)
+        Py_DECREF(missing_remove(self, (size_t)ix));
+    return 0;
+}
+
+/* 1 if key is known to be absent, 0 if not, -1 on error. An expired entry is dropped. */
+static int
+missing_check(LRU *self, PyObject *key, Py_hash_t hash, PyTime_t *t_now)
+{
+    Py_ssize_t ix = missing_find(self, key, hash);
+    Missing *entry;
+
+    if (ix < 0)
+        return ix == -1 ? 0 : -1;
+    entry = &self->missing[ix];
+    if (entry->expire != -1 && IS_EXPIRED(lru_now_cached(self, t_now), entry)) {
+        self->missing_expired++;
+        Py_DECREF(missing_remove(self, (size_t)ix));
+        return 0;
+    }
+    self->missing_hits++;
+    return 1;
+}
+
+static void
+missing_purge(LRU *self, PyTime_t t_now)
+{
+    size_t i;
+
+    for (i = 0; self->missing_used && i <= self->missing_mask; i++) {
+        /* the entry that moves up to i is checked too */
+        while (self->missing[i].key && IS_EXPIRED(t_now, (&self->missing[i]))) {
+            self->missing_expired++;
+            Py_DECREF(missing_remove(self, i));
+        }
+    }
+}
+
+static void
+missing_clear(LRU *self)
+{
+    Missing *table = self->missing;
+    size_t i, slots = table ? self->missing_mask + 1 : 0;
+
+    self->missing = NULL;
+    self->missing_used = 0;
+    for (i = 0; i < slots; i++)
+        Py_XDECREF(table[i].key);
+    PyMem_Free(table);
+}
+
+/*
+ * Look the key up, drop it if it expired and move it to the head of the list
+ * on a hit. Returns a new reference to the value, NULL on a miss and NULL with
+ * an exception set on error.
+ */
+static PyObject *
+lru_get_item_untimed(LRU *self, PyObject *key, Py_hash_t hash, PyTime_t *t_now)
+{
+    Py_ssize_t ix;
+    Node *node;
+
+    ix = lru_lookup(self, key, hash);
+    if (ix == -2)
+        return NULL;
+    policy_record(self, hash);
+    if (ix == -1) {
+        self->misses++;
+        self->metrics.misses++;
+        return NULL;
+    }
+
+    node = NODE(self, ix);
+    if (node->expire != -1 && IS_EXPIRED(lru_now_cached(self, t_now), node)) {
+        lru_delete_expire(self, (uint32_t)ix, EXPIRED_READ);
+        self->misses++;
+        self->metrics.misses++;
+        self->metrics.expired_misses++;
+        return NULL;
+    }
+
+    policy_touch(self, (uint32_t)ix);
+    if (node->refresh >= 0 && node->refresh <= lru_now_cached(self, t_now) &&
+        self->refresh_key == NULL) {
+        /*
+         * one refresh per soft expire, the next insert or update sets it again.
+         * The token tells the refresh result whether the item changed meanwhile.
+         */
+        node->refresh = -2 - self->refresh_seq++;
+        self->refresh_token = node->refresh;
+        Py_INCREF(node->key);
+        self->refresh_key = node->key;
+    }
+    if (self->expire_after_access && node->expire != -1 &&
+        lru_now_cached(self, t_now) + self->expire_after_access > node->expire) {
+        /* sliding expiration, the node is in the heap already and only moves down */
+        node->expire = lru_now_cached(self, t_now) + self->expire_after_access;
+        heap_update(self, (uint32_t)ix);
+    }
+
+    self->hits++;
+    self->metrics.hits++;
+    Py_INCREF(node->value);
+    return node->value;
+}
+
+/*
+ * Set the value of key, or delete key if value is NULL.
+ * Returns 0 on success, -1 with an exception set on error.
+ */
+static int
+lru_set_item_untimed(LRU *self, PyObject *key, Py_hash_t hash, PyObject *value, PyTime_t ttl,
+                     PyTime_t *t_now)
+{
+    PyTime_t expire = -1;
+    PyTime_t refresh = -1;
+    Py_ssize_t ix;
+    Py_ssize_t weight = 0;
+    Node *node;
+    PyObject *old_value;
+    int res;
+
+    /* the weigher may run Python code, it is called before the lookup */
+    if (self->max_weight && value) {
+        weight = lru_weigh(self, key, value);
+        if (weight < 0)
+            return -1;
+        if (weight > self->max_weight) {
+            PyErr_Format(PyExc_ValueError, "item weight %zd is more than max_weight %zd",
+                         weight, self->max_weight);
+            return -1;
+        }
+    }
+
+    lru_auto_purge(self, t_now);
+
+    /* a value replaces the negative entry, before the lookup since it may run __eq__ */
+    if (value && self->missing_used && missing_discard(self, key, hash) != 0)
+        return -1;
+
+    ix = lru_lookup(self, key, hash);
+    if (ix == -2)
+        return -1;
+
+    if (!value) {
+        if (ix == -1) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return -1;
+        }
+        lru_drop_node(self, (uint32_t)ix);
+        self->metrics.deletes++;
+        return 0;
+    }
+
+    if (ttl != -1)
+        expire = lru_now_cached(self, t_now) + ttl;
+    if (self->soft_ttl != -1)
+        refresh = lru_now_cached(self, t_now) + self->soft_ttl;
+
+    policy_record(self, hash);
+    if (ix >= 0) {
+        node = NODE(self, ix);
+        old_value = node->value;
+        Py_INCREF(value);
+        node->value = value;
+
+        policy_touch(self, (uint32_t)ix);
+        if (self->weights) {
+            self->total_weight += weight - self->weights[ix];
+            self->weights[ix] = weight;
+        }
+
+        node->expire = expire;
+        node->refresh = refresh;
+        if (self->ttls)
+            self->ttls[ix] = ttl;
+        res = heap_update(self, (uint32_t)ix);
+        self->metrics.updates++;
+        Py_DECREF(old_value);
+        lru_fit_weight(self, t_now);
+        return res;
+    }
+
+    ix = lru_insert(self, key, hash, value, expire, weight);
+    if (ix < 0)
+        return -1;
+    NODE(self, ix)->refresh = refresh;
+    if (self->ttls)
+        self->ttls[ix] = ttl;
+    self->metrics.inserts++;
+    if (lru_length(self) > self->size || lru_length(self) >= MAX_NODES) {
+        lru_evict_one(self, t_now, EVICTED_CAPACITY);
+    }
+    lru_fit_weight(self, t_now);
+    return 0;
+}
+
+/*
+ * Latency sampling: one call out of latency_sample is timed and counted in a
+ * power of two histogram, bucket i holds the calls that took [2**(i-1), 2**i) ns.
+ */
+static int
+latency_due(LRU *self)
+{
+    if (!self->latency_sample || ++self->latency_tick < self->latency_sample)
+        return 0;
+    self->latency_tick = 0;
+    return 1;
+}
+
+static void
+latency_record(LRU *self, int op, PyTime_t start)
+{
+    PyTime_t ns = clock_monotonic() - start;
+    int bucket = 0;
+
+    while (ns > 0 && bucket < LATENCY_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    self->metrics.latency[op][bucket]++;
+}
+
+static int lru_set_item(LRU *self, PyObject *key, Py_hash_t hash, PyObject *value,
+                        PyTime_t ttl, PyTime_t *t_now);
+
+/*
+ * Done callback of the future returned by the refresher. Its self is the tuple
+ * (lru, key, token). The result replaces the stale value with the ttl the item
+ * was set with, on an error or a cancel the next read of the key tries again.
+ * Both only apply while the node still has the token: a delete, an update or
+ * an expiry since the refresh started wins over it.
+ */
+static PyObject *
+lru_refresh_done(PyObject *state, PyObject *fut)
+{
+    LRU *self = (LRU *)PyTuple_GET_ITEM(state, 0);
+    PyObject *key = PyTuple_GET_ITEM(state, 1);
+    PyTime_t token, ttl;
+    PyTime_t t_now = TIME_UNSET;
+    PyObject *cancelled, *exc = NULL, *result = NULL;
+    Py_hash_t hash;
+    Py_ssize_t ix;
+    int res = -1;
+
+    token = PyLong_AsLongLong(PyTuple_GET_ITEM(state, 2));
+    if (token == -1 && PyErr_Occurred())
+        return NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    cancelled = PyObject_CallMethod(fut, "cancelled", NULL);
+    if (cancelled == NULL)
+        goto done;
+    if (cancelled != Py_True) {
+        exc = PyObject_CallMethod(fut, "exception", NULL);
+        if (exc == NULL)
+            goto done;
+    }
+    if (exc == Py_None) {
+        result = PyObject_CallMethod(fut, "result", NULL);
+        if (result == NULL)
+            goto done;
+    }
+    /* the calls above may have run code, the node is looked up after them */
+    ix = lru_lookup(self, key, hash);
+    if (ix == -2)
+        goto done;
+    res = 0;
+    if (ix == -1 || NODE(self, ix)->refresh != token ||
+        (NODE(self, ix)->expire != -1 && IS_EXPIRED(lru_now_cached(self, &t_now), NODE(self, ix))))
+        goto done;
+    if (result) {
+        ttl = self->ttls ? self->ttls[ix] : self->default_ttl;
+        res = lru_set_item(self, key, hash, result, ttl, &t_now);
+    } else {
+        NODE(self, ix)->refresh = lru_now_cached(self, &t_now);
+    }
+done:
+    Py_XDECREF(cancelled);
+    Py_XDECREF(exc);
+    Py_XDECREF(result);
+    Py_END_CRITICAL_SECTION();
+    if (res != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef lru_refresh_done_def = {
+    "_refresh_done", (PyCFunction)lru_refresh_done, METH_O, NULL
+};
+
+/*
+ * Call the refresher with the key read after its soft expire and its stale
+ * value. When it returns a future, of concurrent.futures or of asyncio, its
+ * result is inserted once it is done, otherwise the refresher inserts it.
+ */
+static void
+lru_refresh(LRU *self, PyObject *value)
+{
+    PyObject *key = self->refresh_key;
+    PyObject *refresher = self->refresher;
+    PyObject *fut, *state, *callback, *res = NULL;
+
+    self->refresh_key = NULL;
+    if (refresher == NULL) {
+        Py_DECREF(key);
+        return;
+    }
+    Py_INCREF(refresher);
+    fut = PyObject_CallFunctionObjArgs(refresher, key, value, NULL);
+    if (fut && fut != Py_None && PyObject_HasAttrString(fut, "add_done_callback")) {
+        state = Py_BuildValue("(OOL)", (PyObject *)self, key, self->refresh_token);
+        callback = state ? PyCFunction_New(&lru_refresh_done_def, state) : NULL;
+        Py_XDECREF(state);
+        if (callback) {
+            res = PyObject_CallMethod(fut, "add_done_callback", "O", callback);
+            Py_DECREF(callback);
+        }
+        if (res == NULL)
+            Py_CLEAR(fut);
+        Py_XDECREF(res);
+    }
+    if (fut == NULL)
+        PyErr_WriteUnraisable(refresher);
+    Py_XDECREF(fut);
+    Py_DECREF(refresher);
+    Py_DECREF(key);
+}
+
+/* lru_get_item_untimed() with latency sampling, refresh and eviction notification */
+static PyObject *
+lru_get_item(LRU *self, PyObject *key, Py_hash_t hash, PyTime_t *t_now)
+{
+    PyTime_t start;
+    PyObject *result;
+
+    if (!latency_due(self)) {
+        result = lru_get_item_untimed(self, key, hash, t_now);
+    } else {
+        start = clock_monotonic();
+        result = lru_get_item_untimed(self, key, hash, t_now);
+        latency_record(self, LATENCY_GET, start);
+    }
+    if (self->refresh_key)
+        lru_refresh(self, result);
+    lru_notify(self);
+    return result;
+}
+
+/* lru_set_item_untimed() with latency sampling and eviction notification */
+static int
+lru_set_item(LRU *self, PyObject *key, Py_hash_t hash, PyObject *value, PyTime_t ttl,
+             PyTime_t *t_now)
+{
+    PyTime_t start;
+    int res;
+
+    if (!latency_due(self)) {
+        res = lru_set_item_untimed(self, key, hash, value, ttl, t_now);
+    } else {
+        start = clock_monotonic();
+        res = lru_set_item_untimed(self, key, hash, value, ttl, t_now);
+        latency_record(self, LATENCY_SET, start);
+    }
+    lru_notify(self);
+    return res;
+}
+
+/*
+ * Index of the node of key when it is there and not expired, without moving
+ * it. -1 when it is not, -2 with an exception set on error.
+ */
+static Py_ssize_t
+lru_find_live(LRU *self, PyObject *key, Py_hash_t hash)
+{
+    Py_ssize_t ix;
+    Node *node;
+
+    ix = lru_lookup(self, key, hash);
+    if (ix < 0)
+        return ix;
+
+    node = NODE(self, ix);
+    if (node->expire != -1 && IS_EXPIRED(lru_now(self), node)){
+        lru_delete_expire(self, (uint32_t)ix, EXPIRED_READ);
+        lru_notify(self);
+        return -1;
+    }
+    return ix;
+}
+
+/* Check that key is there and not expired, without moving it. */
+static int
+lru_contains(LRU *self, PyObject *key, Py_hash_t hash)
+{
+    Py_ssize_t ix = lru_find_live(self, key, hash);
+
+    return ix == -2 ? -1 : ix >= 0;
+}
+
+/*
+ * Tags group items for invalidate_tag(). A tag has a list of its nodes,
+ * linked through self->tag_links, and an entry in self->tags found with the
+ * self->tag_ids dict. An entry stays when its last node goes, so removals never
+ * touch the dict, and the empty entries are swept once they are the most.
+ */
+static void
+tag_reset(LRU *self)
+{
+    TagList *tags = self->tags;
+    Py_ssize_t i, cap = self->tags_cap;
+    PyObject *tag_ids = self->tag_ids;
+
+    PyMem_Free(self->tag_links);
+    self->tag_links = NULL;
+    self->tags = NULL;
+    self->tags_cap = self->tags_used = self->tags_live = 0;
+    self->tags_free = NIL;
+    self->tag_ids = NULL;
+    for (i = 0; i < cap; i++)
+        Py_XDECREF(tags[i].tag);
+    PyMem_Free(tags);
+    Py_XDECREF(tag_ids);
+}
+
+static int
+tag_sweep(LRU *self)
+{
+    Py_ssize_t i;
+    PyObject *tag;
+
+    for (i = 0; i < self->tags_cap; i++) {
+        tag = self->tags[i].tag;
+        if (tag == NULL || self->tags[i].count)
+            continue;
+        self->tags[i].tag = NULL;
+        self->tags[i].first = self->tags_free;
+        self->tags_free = (uint32_t)i;
+        self->tags_used--;
+        if (PyDict_DelItem(self->tag_ids, tag) != 0) {
+            Py_DECREF(tag);
+            return -1;
+        }
+        Py_DECREF(tag);
+    }
+    return 0;
+}
+
+/* Index of the entry of tag, added if needed. -1 with an exception set on error. */
+static Py_ssize_t
+tag_entry(LRU *self, PyObject *tag)
+{
+    PyObject *id_obj;
+    Py_ssize_t id, i;
+    int err;
+
+    if (self->tags_used - self->tags_live > self->tags_live + 8 && tag_sweep(self) != 0)
+        return -1;
+    if (self->tag_ids == NULL && (self->tag_ids = PyDict_New()) == NULL)
+        return -1;
+    id_obj = PyDict_GetItemWithError(self->tag_ids, tag);
+    if (id_obj)
+        return PyLong_AsSsize_t(id_obj);
+    if (PyErr_Occurred())
+        return -1;
+    if (self->tags_free == NIL) {
+        Py_ssize_t cap = self->tags_cap ? self->tags_cap * 2 : 8;
+        TagList *tags = PyMem_Resize(self->tags, TagList, cap);
+
+        if (tags == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->tags = tags;
+        for (i = cap - 1; i >= self->tags_cap; i--) {
+            tags[i].tag = NULL;
+            tags[i].first = self->tags_free;
+            self->tags_free = (uint32_t)i;
+        }
+        self->tags_cap = cap;
+    }
+    /* take the entry first, the dict may run code that adds tags */
+    id = self->tags_free;
+    self->tags_free = self->tags[id].first;
+    Py_INCREF(tag);
+    self->tags[id].tag = tag;
+    self->tags[id].first = NIL;
+    self->tags[id].count = 0;
+    self->tags_used++;
+    id_obj = PyLong_FromSsize_t(id);
+    err = id_obj == NULL || self->tag_ids == NULL || PyDict_SetItem(self->tag_ids, tag, id_obj) != 0;
+    Py_XDECREF(id_obj);
+    if (id >= self->tags_cap || self->tags[id].tag != tag) {
+        if (!err)
+            PyErr_SetString(PyExc_RuntimeError, "TTLRU changed while tagging");
+        return -1;
+    }
+    if (err) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_RuntimeError, "TTLRU changed while tagging");
+        self->tags[id].tag = NULL;
+        self->tags[id].first = self->tags_free;
+        self->tags_free = (uint32_t)id;
+        self->tags_used--;
+        Py_DECREF(tag);
+        return -1;
+    }
+    return id;
+}
+
+/*
+ * Tag the item of key, or untag it with None. Returns 1, 0 when key is not
+ * there, -1 with an exception set on error.
+ */
+static int
+lru_tag(LRU *self, PyObject *key, Py_hash_t hash, PyObject *tag)
+{
+    Py_ssize_t id = -1, ix, i;
+    PyObject *entry = NULL;
+    TagLink *link;
+    TagList *list;
+
+    /* the dict and the key lookup may run Python code, the links are set after both */
+    if (tag != Py_None) {
+        if ((id = tag_entry(self, tag)) < 0)
+            return -1;
+        entry = self->tags[id].tag;
+    }
+    ix = lru_find_live(self, key, hash);
+    if (ix < 0)
+        return ix == -1 ? 0 : -1;
+    if (id >= 0 && (id >= self->tags_cap || self->tags[id].tag != entry)) {
+        PyErr_SetString(PyExc_RuntimeError, "TTLRU changed while tagging");
+        return -1;
+    }
+    if (self->tag_links == NULL) {
+        if (id < 0)
+            return 1;
+        self->tag_links = PyMem_New(TagLink, self->nodes_cap);
+        if (self->tag_links == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < self->nodes_cap; i++)
+            self->tag_links[i].tag = NIL;
+    }
+    link = &self->tag_links[ix];
+    if (link->tag == (uint32_t)id)
+        return 1;
+    if (link->tag != NIL)
+        tag_unlink(self, (uint32_t)ix);
+    if (id < 0)
+        return 1;
+    list = &self->tags[id];
+    link->tag = (uint32_t)id;
+    link->prev = NIL;
+    link->next = list->first;
+    if (list->first != NIL)
+        self->tag_links[list->first].prev = (uint32_t)ix;
+    list->first = (uint32_t)ix;
+    if (list->count++ == 0)
+        self->tags_live++;
+    return 1;
+}
+
+static int
+LRU_contains_check_with_ttl(LRU *self, PyObject *key)
+{
+    Py_hash_t hash = PyObject_Hash(key);
+
+    if (hash == -1)
+        return -1;
+    return lru_contains(self, key, hash);
+}
+
+static PyObject *
+LRU_contains_key(LRU *self, PyObject *key)
+{
+    int res = LRU_contains_check_with_ttl(self, key);
+
+    if (res < 0)
+        return NULL;
+    if (res) {
+        Py_RETURN_TRUE;
+    } else {
+        Py_RETURN_FALSE;
+    }
+}
+
+static int
+LRU_seq_contains(LRU *self, PyObject *key)
+{
+    return LRU_contains_check_with_ttl(self, key);
+}
+
+static PyObject *
+lru_subscript(LRU *self, register PyObject *key)
+{
+    PyObject *result;
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash = PyObject_Hash(key);
+
+    if (hash == -1)
+        return NULL;
+    result = lru_get_item(self, key, hash, &t_now);
+    if (!result && !PyErr_Occurred())
+        PyErr_SetObject(PyExc_KeyError, key);
+    return result;
+}
+
+/*
+ * The methods called the most are METH_FASTCALL, they get the arguments as an
+ * array instead of a tuple. This checks their number like PyArg_ParseTuple.
+ */
+static int
+check_nargs(const char *name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max)
+{
+    if (nargs >= min && nargs <= max)
+        return 1;
+    PyErr_Format(PyExc_TypeError, "%s() takes %s %zd argument%s (%zd given)", name,
+                 min == max ? "exactly" : nargs < min ? "at least" : "at most",
+                 nargs < min ? min : max, (nargs < min ? min : max) == 1 ? "" : "s", nargs);
+    return 0;
+}
+
+static PyObject *
+LRU_get(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key;
+    PyObject *default_obj;
+    PyObject *result;
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash;
+
+    if (!check_nargs("get", nargs, 1, 2))
+        return NULL;
+    key = args[0];
+    default_obj = nargs > 1 ? args[1] : NULL;
+
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    result = lru_get_item(self, key, hash, &t_now);
+    if (result || PyErr_Occurred())
+        return result;
+
+    if (!default_obj) {
+        Py_RETURN_NONE;
+    }
+
+    Py_INCREF(default_obj);
+    return default_obj;
+}
+
+static int
+LRU_ass_sub_ttl(LRU *self, PyObject *key, PyObject *value, PyTime_t ttl)
+{
+    Py_hash_t hash = PyObject_Hash(key);
+
+    PyTime_t t_now = TIME_UNSET;
+
+    if (hash == -1)
+        return -1;
+    return lru_set_item(self, key, hash, value, ttl, &t_now);
+}
+
+static int
+lru_ass_sub(LRU *self, PyObject *key, PyObject *value)
+{
+    return LRU_ass_sub_ttl(self, key, value, self->default_ttl);
+}
+
+/* set_with_ttl() of a TTLRU or a shard, tag is NULL when not given */
+static int
+lru_set_tagged(LRU *self, PyObject *key, Py_hash_t hash, PyObject *value, PyTime_t ttl,
+               PyObject *tag)
+{
+    PyTime_t t_now = TIME_UNSET;
+
+    if (lru_set_item(self, key, hash, value, ttl, &t_now) != 0)
+        return -1;
+    if (tag && lru_tag(self, key, hash, tag) < 0)
+        return -1;
+    return 0;
+}
+
+static PyObject *
+LRU_set_with_ttl(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyTime_t ttl;
+    Py_hash_t hash;
+
+    if (!check_nargs("set_with_ttl", nargs, 3, 4))
+        return NULL;
+    ttl = PyLong_AsLongLong(args[2]);
+    if (ttl == -1 && PyErr_Occurred())
+        return NULL;
+    hash = PyObject_Hash(args[0]);
+    if (hash == -1)
+        return NULL;
+    if (lru_set_tagged(self, args[0], hash, args[1], ttl, nargs > 3 ? args[3] : NULL) != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+
+
+static PyObject *
+get_item(Node *node)
+{
+    PyObject *tuple = PyTuple_New(2);
+    if (tuple == NULL)
+        return NULL;
+    Py_INCREF(node->key);
+    PyTuple_SET_ITEM(tuple, 0, node->key);
+    Py_INCREF(node->value);
+    PyTuple_SET_ITEM(tuple, 1, node->value);
+    return tuple;
+}
+
+/*
+ * The live items in a list. Nothing is released while the walk runs, the
+ * expired nodes are dropped after it, see lru_drop_expired(). A getterfunc
+ * that allocates may run the GC, so changes are checked.
+ */
+static PyObject *
+collect(LRU *self, PyObject * (*getterfunc)(Node *))
+{
+    register PyObject *v;
+    PyObject *item;
+    uint32_t curr;
+    Py_ssize_t i, expired;
+    PyTime_t t_now;
+    size_t version = self->version;
+
+    t_now = lru_now(self);
+    expired = self->heap_len ? heap_count_expired(self, t_now) : 0;
+    v = PyList_New(lru_length(self) - expired);
+    if (v == NULL)
+        return NULL;
+    curr = self->first;
+    i = 0;
+
+    while (curr != NIL && i < PyList_GET_SIZE(v)) {
+        if (!IS_EXPIRED(t_now, NODE(self, curr))) {
+            item = getterfunc(NODE(self, curr));
+            if (item == NULL) {
+                Py_DECREF(v);
+                return NULL;
+            }
+            PyList_SET_ITEM(v, i++, item);
+            if (self->version != version) {
+                Py_DECREF(v);
+                PyErr_SetString(PyExc_RuntimeError, "TTLRU changed during iteration");
+                return NULL;
+            }
+        }
+        curr = NODE(self, curr)->next;
+    }
+    lru_drop_expired(self, 0, expired, t_now, EXPIRED_COLLECT);
+    return v;
+}
+
+static PyObject *
+get_key(Node *node)
+{
+    Py_INCREF(node->key);
+    return node->key;
+}
+
+static int
+lru_update(LRU *self, PyObject *args, PyObject *kwargs)
+{
+	PyObject *key, *value;
+	PyObject *arg = NULL;
+	Py_ssize_t pos = 0;
+
+	if ((PyArg_ParseTuple(args, "|O", &arg))) {
+		if (arg && PyDict_Check(arg)) {
+			if (lru_reserve(self, PyDict_GET_SIZE(arg)) != 0)
+				return -1;
+			while (PyDict_Next(arg, &pos, &key, &value))
+				if (lru_ass_sub(self, key, value) != 0)
+					return -1;
+		}
+	}
+
+	pos = 0;
+	if (kwargs != NULL && PyDict_Check(kwargs)) {
+		if (lru_reserve(self, PyDict_GET_SIZE(kwargs)) != 0)
+			return -1;
+		while (PyDict_Next(kwargs, &pos, &key, &value))
+			if (lru_ass_sub(self, key, value) != 0)
+				return -1;
+	}
+
+	return 0;
+}
+
+static PyObject *
+LRU_update(LRU *self, PyObject *args, PyObject *kwargs)
+{
+	int res;
+
+	self->notify_hold++;
+	res = lru_update(self, args, kwargs);
+	self->notify_hold--;
+	lru_notify(self);
+	if (res != 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+/*
+ * Batch calls. They read the clock once for the whole batch and grow the
+ * storage once before inserting.
+ */
+static PyObject *
+LRU_get_many(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"keys", "default", "as_dict", NULL};
+    PyObject *keys, *fast, *key, *value, *result;
+    PyObject *default_obj = Py_None;
+    int as_dict = 0;
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash;
+    Py_ssize_t i, n;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|Op:get_many", kwlist,
+                                     &keys, &default_obj, &as_dict))
+        return NULL;
+    fast = PySequence_Fast(keys, "get_many() keys should be iterable");
+    if (fast == NULL)
+        return NULL;
+    n = PySequence_Fast_GET_SIZE(fast);
+    result = as_dict ? PyDict_New() : PyList_New(n);
+    if (result == NULL)
+        goto error;
+    self->notify_hold++;
+
+    for (i = 0; i < n; i++) {
+        key = PySequence_Fast_GET_ITEM(fast, i);
+        hash = PyObject_Hash(key);
+        if (hash == -1)
+            goto error;
+        value = lru_get_item(self, key, hash, &t_now);
+        if (value == NULL) {
+            if (PyErr_Occurred())
+                goto error;
+            if (as_dict)
+                continue;
+            Py_INCREF(default_obj);
+            value = default_obj;
+        }
+        if (as_dict) {
+            int res = PyDict_SetItem(result, key, value);
+            Py_DECREF(value);
+            if (res != 0)
+                goto error;
+        } else {
+            PyList_SET_ITEM(result, i, value);
+        }
+    }
+    self->notify_hold--;
+    lru_notify(self);
+    Py_DECREF(fast);
+    return result;
+
+error:
+    if (result) {
+        self->notify_hold--;
+        lru_notify(self);
+    }
+    Py_DECREF(fast);
+    Py_XDECREF(result);
+    return NULL;
+}
+
+/* Set one (key, value) or (key, value, ttl) item of set_many(). */
+static int
+lru_set_pair(LRU *self, PyObject *item, PyTime_t ttl, PyTime_t *t_now)
+{
+    PyObject *fast;
+    PyObject *key;
+    Py_hash_t hash;
+    int res = -1;
+
+    fast = PySequence_Fast(item, "set_many() items should be (key, value) or (key, value, ttl)");
+    if (fast == NULL)
+        return -1;
+    if (PySequence_Fast_GET_SIZE(fast) == 3) {
+        ttl = PyLong_AsLongLong(PySequence_Fast_GET_ITEM(fast, 2));
+        if (ttl == -1 && PyErr_Occurred())
+            goto done;
+    } else if (PySequence_Fast_GET_SIZE(fast) != 2) {
+        PyErr_SetString(PyExc_ValueError,
+                        "set_many() items should be (key, value) or (key, value, ttl)");
+        goto done;
+    }
+    key = PySequence_Fast_GET_ITEM(fast, 0);
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        goto done;
+    res = lru_set_item(self, key, hash, PySequence_Fast_GET_ITEM(fast, 1), ttl, t_now);
+done:
+    Py_DECREF(fast);
+    return res;
+}
+
+/* Insert all items of a dict or of an iterable of pairs, used by set_many and from_items. */
+static int
+lru_set_many_items(LRU *self, PyObject *items, PyTime_t ttl)
+{
+    PyObject *fast, *key, *value;
+    PyTime_t t_now = TIME_UNSET;
+    Py_ssize_t pos = 0, i;
+    Py_hash_t hash;
+
+    if (PyDict_Check(items)) {
+        if (lru_reserve(self, PyDict_GET_SIZE(items)) != 0)
+            return -1;
+        while (PyDict_Next(items, &pos, &key, &value)) {
+            hash = PyObject_Hash(key);
+            if (hash == -1 || lru_set_item(self, key, hash, value, ttl, &t_now) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    fast = PySequence_Fast(items, "set_many() items should be a dict or an iterable of pairs");
+    if (fast == NULL)
+        return -1;
+    if (lru_reserve(self, PySequence_Fast_GET_SIZE(fast)) != 0)
+        goto error;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+        if (lru_set_pair(self, PySequence_Fast_GET_ITEM(fast, i), ttl, &t_now) != 0)
+            goto error;
+    }
+    Py_DECREF(fast);
+    return 0;
+
+error:
+    Py_DECREF(fast);
+    return -1;
+}
+
+/* Same, with the evictions of the whole batch notified at once. */
+static int
+lru_set_many(LRU *self, PyObject *items, PyTime_t ttl)
+{
+    int res;
+
+    self->notify_hold++;
+    res = lru_set_many_items(self, items, ttl);
+    self->notify_hold--;
+    lru_notify(self);
+    return res;
+}
+
+static PyObject *
+LRU_set_many(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"items", "ttl", NULL};
+    PyObject *items;
+    PyTime_t ttl = self->default_ttl;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|L:set_many", kwlist, &items, &ttl))
+        return NULL;
+    if (lru_set_many(self, items, ttl) != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_delete_many(LRU *self, PyObject *keys)
+{
+    PyObject *fast, *key;
+    Py_ssize_t i, ix, count = 0;
+    Py_hash_t hash;
+
+    fast = PySequence_Fast(keys, "delete_many() keys should be iterable");
+    if (fast == NULL)
+        return NULL;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+        key = PySequence_Fast_GET_ITEM(fast, i);
+        hash = PyObject_Hash(key);
+        if (hash == -1)
+            goto error;
+        ix = lru_lookup(self, key, hash);
+        if (ix == -2)
+            goto error;
+        if (ix >= 0) {
+            lru_drop_node(self, (uint32_t)ix);
+            self->metrics.deletes++;
+            count++;
+        }
+    }
+    Py_DECREF(fast);
+    return PyLong_FromSsize_t(count);
+
+error:
+    Py_DECREF(fast);
+    return NULL;
+}
+
+static PyObject *
+LRU_from_items(PyObject *cls, PyObject *args, PyObject *kwds)
+{
+    PyObject *items, *rest, *lru;
+    PyObject *fast = NULL;
+    PyTime_t ttl;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "from_items() missing required argument 'items'");
+        return NULL;
+    }
+    items = PyTuple_GET_ITEM(args, 0);
+    rest = PyTuple_GetSlice(args, 1, PyTuple_GET_SIZE(args));
+    if (rest == NULL)
+        return NULL;
+
+    /* the size defaults to the number of items */
+    if (PyTuple_GET_SIZE(rest) == 0 && !(kwds && PyDict_GetItemString(kwds, "size"))) {
+        PyObject *size;
+        Py_ssize_t n;
+
+        if (!PyDict_Check(items)) {
+            fast = PySequence_Fast(items, "from_items() items should be a dict or an iterable of pairs");
+            if (fast == NULL) {
+                Py_DECREF(rest);
+                return NULL;
+            }
+            items = fast;
+        }
+        n = PyObject_Size(items);
+        size = PyLong_FromSsize_t(n > 0 ? n : 1);
+        Py_DECREF(rest);
+        rest = size ? PyTuple_Pack(1, size) : NULL;
+        Py_XDECREF(size);
+        if (rest == NULL) {
+            Py_XDECREF(fast);
+            return NULL;
+        }
+    }
+
+    lru = PyObject_Call(cls, rest, kwds);
+    Py_DECREF(rest);
+    if (lru == NULL || !PyObject_TypeCheck(lru, &LRUType)) {
+        Py_XDECREF(fast);
+        return lru;
+    }
+    ttl = ((LRU *)lru)->default_ttl;
+    if (lru_set_many((LRU *)lru, items, ttl) != 0) {
+        Py_CLEAR(lru);
+    }
+    Py_XDECREF(fast);
+    return lru;
+}
+
+/*
+ * Snapshots. dumps() writes the items from the LRU to the MRU end, so loads()
+ * inserts them back in the same order:
+ *
+ *   "TTLRU\x01", i64 system time of the dump in ns, then per item
+ *   key, value, i64 remaining ttl in ns (-1 for none)
+ *
+ * An object is a tag byte and, for an int, an i64 or, for the others, a u32
+ * length and the bytes of a bytes, the UTF-8 of a str or a pickle of any other
+ * type. Integers are little endian. Expired items are not written and a load
+ * takes off the time since the dump, so nothing expired comes back.
+ */
+#define SNAPSHOT_MAGIC "TTLRU\x01"
+#define SNAPSHOT_MAGIC_LEN 6
+#define SNAPSHOT_CHUNK (1 << 20)
+
+enum {
+    SNAP_NONE,
+    SNAP_INT,
+    SNAP_BYTES,
+    SNAP_STR,
+    SNAP_PICKLE,
+};
+
+typedef struct {
+    char *data;
+    Py_ssize_t len;
+    Py_ssize_t cap;
+    PyObject *file;     /* write() target of dump(), full chunks go there */
+    PyObject *pickle;
+} SnapWriter;
+
+static int
+snap_flush(SnapWriter *w)
+{
+    PyObject *res;
+
+    if (w->file == NULL || w->len == 0)
+        return 0;
+    res = PyObject_CallMethod(w->file, "write", "y#", w->data, w->len);
+    if (res == NULL)
+        return -1;
+    Py_DECREF(res);
+    w->len = 0;
+    return 0;
+}
+
+static int
+snap_put(SnapWriter *w, const void *data, Py_ssize_t n)
+{
+    if (w->len + n > w->cap) {
+        Py_ssize_t cap = w->cap ? w->cap : 4096;
+        char *buf;
+
+        if (w->file && w->len && w->len + n > SNAPSHOT_CHUNK) {
+            if (snap_flush(w) != 0)
+                return -1;
+            if (n <= w->cap)
+                goto copy;
+        }
+        while (cap < w->len + n)
+            cap *= 2;
+        buf = PyMem_Realloc(w->data, cap);
+        if (buf == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        w->data = buf;
+        w->cap = cap;
+    }
+copy:
+    memcpy(w->data + w->len, data, n);
+    w->len += n;
+    return 0;
+}
+
+static int
+snap_put_i64(SnapWriter *w, int64_t v)
+{
+    unsigned char b[8];
+    uint64_t u = (uint64_t)v;
+    int i;
+
+    for (i = 0; i < 8; i++)
+        b[i] = (unsigned char)(u >> (8 * i));
+    return snap_put(w, b, 8);
+}
+
+static int
+snap_put_blob(SnapWriter *w, unsigned char tag, const char *data, Py_ssize_t n)
+{
+    unsigned char b[5];
+    int i;
+
+    if ((uint64_t)n > UINT32_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "object too large for a snapshot");
+        return -1;
+    }
+    b[0] = tag;
+    for (i = 0; i < 4; i++)
+        b[1 + i] = (unsigned char)((uint64_t)n >> (8 * i));
+    if (snap_put(w, b, 5) != 0)
+        return -1;
+    return snap_put(w, data, n);
+}
+
+static int
+snap_put_object(SnapWriter *w, PyObject *obj)
+{
+    unsigned char tag;
+    const char *data;
+    Py_ssize_t n;
+    PyObject *pickled;
+    int overflow, res;
+
+    if (obj == Py_None) {
+        tag = SNAP_NONE;
+        return snap_put(w, &tag, 1);
+    }
+    if (PyLong_CheckExact(obj)) {
+        long long v = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (!overflow) {
+            tag = SNAP_INT;
+            if (snap_put(w, &tag, 1) != 0)
+                return -1;
+            return snap_put_i64(w, v);
+        }
+    } else if (PyBytes_CheckExact(obj)) {
+        return snap_put_blob(w, SNAP_BYTES, PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+    } else if (PyUnicode_CheckExact(obj)) {
+        data = PyUnicode_AsUTF8AndSize(obj, &n);
+        if (data == NULL)
+            return -1;
+        return snap_put_blob(w, SNAP_STR, data, n);
+    }
+    if (w->pickle == NULL && (w->pickle = PyImport_ImportModule("pickle")) == NULL)
+        return -1;
+    pickled = PyObject_CallMethod(w->pickle, "dumps", "Oi", obj, 4);
+    if (pickled == NULL)
+        return -1;
+    res = snap_put_blob(w, SNAP_PICKLE, PyBytes_AS_STRING(pickled), PyBytes_GET_SIZE(pickled));
+    Py_DECREF(pickled);
+    return res;
+}
+
+/* Write the snapshot to w, a pickled object may run code so changes are checked. */
+static int
+lru_snapshot(LRU *self, SnapWriter *w)
+{
+    PyTime_t t_now = lru_now(self);
+    size_t version = self->version;
+    uint32_t ix = self->last;
+    PyObject *key, *value;
+    PyTime_t expire;
+    Node *node;
+    int res;
+
+    if (snap_put(w, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ||
+        snap_put_i64(w, clock_system()) != 0)
+        return -1;
+    while (ix != NIL) {
+        node = NODE(self, ix);
+        ix = node->prev;
+        if (node->expire != -1 && IS_EXPIRED(t_now, node))
+            continue;
+        key = node->key;
+        value = node->value;
+        expire = node->expire;
+        Py_INCREF(key);
+        Py_INCREF(value);
+        res = snap_put_object(w, key) != 0 || snap_put_object(w, value) != 0 ||
+              snap_put_i64(w, expire == -1 ? -1 : expire - t_now) != 0;
+        Py_DECREF(key);
+        Py_DECREF(value);
+        if (res)
+            return -1;
+        if (self->version != version) {
+            PyErr_SetString(PyExc_RuntimeError, "TTLRU changed during dump");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static PyObject *
+LRU_dumps(LRU *self)
+{
+    SnapWriter w = {NULL, 0, 0, NULL, NULL};
+    PyObject *result = NULL;
+
+    if (lru_snapshot(self, &w) == 0)
+        result = PyBytes_FromStringAndSize(w.data, w.len);
+    PyMem_Free(w.data);
+    Py_XDECREF(w.pickle);
+    return result;
+}
+
+/* Returns a new reference to file, or to file opened with mode when it is a path. */
+static PyObject *
+snap_open(PyObject *file, const char *method, const char *mode, int *opened)
+{
+    PyObject *io, *f;
+
+    *opened = 0;
+    if (PyObject_HasAttrString(file, method)) {
+        Py_INCREF(file);
+        return file;
+    }
+    io = PyImport_ImportModule("io");
+    if (io == NULL)
+        return NULL;
+    f = PyObject_CallMethod(io, "open", "Os", file, mode);
+    Py_DECREF(io);
+    *opened = f != NULL;
+    return f;
+}
+
+static int
+snap_close(PyObject *f, int opened)
+{
+    PyObject *res;
+
+    if (!opened)
+        return 0;
+    res = PyObject_CallMethod(f, "close", NULL);
+    Py_XDECREF(res);
+    return res ? 0 : -1;
+}
+
+static PyObject *
+LRU_dump(LRU *self, PyObject *file)
+{
+    SnapWriter w = {NULL, 0, 0, NULL, NULL};
+    int opened, res;
+
+    w.file = snap_open(file, "write", "wb", &opened);
+    if (w.file == NULL)
+        return NULL;
+    res = lru_snapshot(self, &w);
+    if (res == 0)
+        res = snap_flush(&w);
+    if (snap_close(w.file, opened) != 0)
+        res = -1;
+    PyMem_Free(w.data);
+    Py_XDECREF(w.pickle);
+    Py_DECREF(w.file);
+    if (res != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+typedef struct {
+    const unsigned char *p;
+    const unsigned char *end;
+    PyObject *pickle;
+} SnapReader;
+
+static int
+snap_truncated(void)
+{
+    PyErr_SetString(PyExc_ValueError, "truncated TTLRU snapshot");
+    return -1;
+}
+
+static int
+snap_get_i64(SnapReader *r, int64_t *v)
+{
+    uint64_t u = 0;
+    int i;
+
+    if (r->end - r->p < 8)
+        return snap_truncated();
+    for (i = 0; i < 8; i++)
+        u |= (uint64_t)r->p[i] << (8 * i);
+    r->p += 8;
+    *v = (int64_t)u;
+    return 0;
+}
+
+static PyObject *
+snap_get_object(SnapReader *r)
+{
+    unsigned char tag;
+    uint32_t n = 0;
+    int64_t v;
+    const char *data;
+    int i;
+
+    if (r->p >= r->end) {
+        snap_truncated();
+        return NULL;
+    }
+    tag = *r->p++;
+    if (tag == SNAP_NONE)
+        Py_RETURN_NONE;
+    if (tag == SNAP_INT)
+        return snap_get_i64(r, &v) == 0 ? PyLong_FromLongLong(v) : NULL;
+    if (r->end - r->p < 4) {
+        snap_truncated();
+        return NULL;
+    }
+    for (i = 0; i < 4; i++)
+        n |= (uint32_t)r->p[i] << (8 * i);
+    r->p += 4;
+    if ((uint64_t)(r->end - r->p) < n) {
+        snap_truncated();
+        return NULL;
+    }
+    data = (const char *)r->p;
+    r->p += n;
+    switch (tag) {
+    case SNAP_BYTES:
+        return PyBytes_FromStringAndSize(data, n);
+    case SNAP_STR:
+        return PyUnicode_DecodeUTF8(data, n, NULL);
+    case SNAP_PICKLE:
+        if (r->pickle == NULL && (r->pickle = PyImport_ImportModule("pickle")) == NULL)
+            return NULL;
+        return PyObject_CallMethod(r->pickle, "loads", "y#", data, (Py_ssize_t)n);
+    }
+    PyErr_Format(PyExc_ValueError, "bad object tag %d in TTLRU snapshot", tag);
+    return NULL;
+}
+
+/* Insert the items of a snapshot, with their remaining ttl less the time since the dump. */
+static int
+lru_restore(LRU *self, const char *data, Py_ssize_t len)
+{
+    SnapReader r = {(const unsigned char *)data, (const unsigned char *)data + len, NULL};
+    PyObject *key = NULL, *value = NULL;
+    PyTime_t t_now = TIME_UNSET;
+    int64_t dumped, ttl;
+    Py_hash_t hash;
+    int res = -1;
+
+    if (len < SNAPSHOT_MAGIC_LEN || memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+        PyErr_SetString(PyExc_ValueError, "not a TTLRU snapshot");
+        return -1;
+    }
+    r.p += SNAPSHOT_MAGIC_LEN;
+    if (snap_get_i64(&r, &dumped) != 0)
+        return -1;
+    /* the tick clock does not follow the system time */
+    if (self->clock == LRU_CLOCK_TICK || (dumped = clock_system() - dumped) < 0)
+        dumped = 0;
+
+    self->notify_hold++;
+    while (r.p < r.end) {
+        key = snap_get_object(&r);
+        if (key == NULL)
+            goto done;
+        value = snap_get_object(&r);
+        if (value == NULL || snap_get_i64(&r, &ttl) != 0)
+            goto done;
+        if (ttl == -1 || (ttl -= dumped) > 0) {
+            hash = PyObject_Hash(key);
+            if (hash == -1 || lru_set_item(self, key, hash, value, ttl, &t_now) != 0)
+                goto done;
+        }
+        Py_CLEAR(key);
+        Py_CLEAR(value);
+    }
+    res = 0;
+done:
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    Py_XDECREF(r.pickle);
+    self->notify_hold--;
+    lru_notify(self);
+    return res;
+}
+
+static PyObject *
+LRU_loads(LRU *self, PyObject *data)
+{
+    Py_buffer view;
+    int res;
+
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) != 0)
+        return NULL;
+    res = lru_restore(self, view.buf, view.len);
+    PyBuffer_Release(&view);
+    if (res != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/* A path is mapped with mmap, a file object is read at once. */
+static PyObject *
+LRU_load(LRU *self, PyObject *file)
+{
+    PyObject *f, *data = NULL, *mmap_mod, *fileno, *kwargs, *access, *res = NULL;
+    int opened;
+
+    f = snap_open(file, "read", "rb", &opened);
+    if (f == NULL)
+        return NULL;
+    if (!opened) {
+        data = PyObject_CallMethod(f, "read", NULL);
+    } else if ((mmap_mod = PyImport_ImportModule("mmap")) != NULL) {
+        fileno = PyObject_CallMethod(f, "fileno", NULL);
+        access = PyObject_GetAttrString(mmap_mod, "ACCESS_READ");
+        kwargs = access ? Py_BuildValue("{s:O}", "access", access) : NULL;
+        if (fileno && kwargs) {
+            PyObject *mmap_args = Py_BuildValue("(Oi)", fileno, 0);
+            PyObject *mmap_type = PyObject_GetAttrString(mmap_mod, "mmap");
+
+            if (mmap_args && mmap_type)
+                data = PyObject_Call(mmap_type, mmap_args, kwargs);
+            Py_XDECREF(mmap_args);
+            Py_XDECREF(mmap_type);
+        }
+        Py_XDECREF(fileno);
+        Py_XDECREF(access);
+        Py_XDECREF(kwargs);
+        Py_DECREF(mmap_mod);
+    }
+    if (data) {
+        res = LRU_loads(self, data);
+        if (opened) {
+            PyObject *closed = PyObject_CallMethod(data, "close", NULL);
+            if (closed == NULL)
+                Py_CLEAR(res);
+            Py_XDECREF(closed);
+        }
+        Py_DECREF(data);
+    }
+    if (snap_close(f, opened) != 0)
+        Py_CLEAR(res);
+    Py_DECREF(f);
+    return res;
+}
+
+static PyObject *
+LRU_reduce(LRU *self)
+{
+    PyObject *callback = self->callback ? self->callback : Py_None;
+    PyObject *weigher = self->weigher ? self->weigher : Py_None;
+    PyObject *state = LRU_dumps(self);
+
+    if (state == NULL)
+        return NULL;
+    /* the callables are pickled by reference, pickle raises for those it cannot find */
+    if (self->refresher)
+        state = Py_BuildValue("(NOL)", state, self->refresher, (long long)self->soft_ttl);
+    if (state == NULL)
+        return NULL;
+    return Py_BuildValue("O(nOLnissinOsnL)N", Py_TYPE(self), self->size, callback, self->default_ttl,
+                         self->auto_purge, self->preallocate, clock_names[self->clock],
+                         policy_names[self->policy], self->approximate, self->max_weight, weigher,
+                         notify_names[self->notify], self->max_missing,
+                         (long long)self->expire_after_access, state);
+}
+
+static PyObject *
+LRU_setdefault(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key;
+    PyObject *default_obj;
+    PyObject *result;
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash;
+
+    if (!check_nargs("setdefault", nargs, 1, 2))
+        return NULL;
+    key = args[0];
+    default_obj = nargs > 1 ? args[1] : NULL;
+
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    result = lru_get_item(self, key, hash, &t_now);
+    if (result || PyErr_Occurred())
+        return result;
+
+    if (!default_obj)
+        default_obj = Py_None;
+
+    if (lru_set_item(self, key, hash, default_obj, self->default_ttl, &t_now) != 0)
+        return NULL;
+
+    Py_INCREF(default_obj);
+    return default_obj;
+}
+
+static PyObject *
+LRU_getset_with_default_factory(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key;
+    PyObject *default_factory;
+    PyObject *result;
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash;
+
+    if (!check_nargs("getset_with_default_factory", nargs, 2, 2))
+        return NULL;
+    key = args[0];
+    default_factory = args[1];
+
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    result = lru_get_item(self, key, hash, &t_now);
+    if (result || PyErr_Occurred())
+        return result;
+
+    if (!PyCallable_Check(default_factory)) {
+        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+        return NULL;
+    }
+
+    result = PyObject_CallObject(default_factory, NULL);
+
+    if (!result)
+        return NULL;
+
+    /* the factory may have taken a while, the ttl starts now */
+    t_now = TIME_UNSET;
+
+    if (lru_set_item(self, key, hash, result, self->default_ttl, &t_now) != 0) {
+        Py_DECREF(result);
+        return NULL;
+    }
+
+    return result;
+}
+
+/*
+ * Single flight loading. get_or_load() keeps one flight per key being loaded
+ * in self->flights, a capsule with a lock held by the thread running the
+ * loader. The other threads that miss on the key wait on the lock, with the
+ * GIL released, then share the result or the exception. aget_or_load() keeps
+ * the asyncio task of the loader in self->aflights and every coroutine awaits
+ * it through asyncio.shield(). With error_ttl an exception of the loader is
+ * kept in self->failures and raised again for error_ttl ns without loading.
+ */
+typedef struct {
+    PyThread_type_lock lock;
+    unsigned long owner;
+    PyObject *result;
+    PyObject *exc;
+} Flight;
+
+static void
+flight_destructor(PyObject *capsule)
+{
+    Flight *flight = (Flight *)PyCapsule_GetPointer(capsule, "ttlru.flight");
+
+    if (flight == NULL)
+        return;
+    if (flight->lock)
+        PyThread_free_lock(flight->lock);
+    Py_XDECREF(flight->result);
+    Py_XDECREF(flight->exc);
+    PyMem_Free(flight);
+}
+
+static PyObject *
+flight_new(void)
+{
+    Flight *flight = PyMem_Calloc(1, sizeof(Flight));
+    PyObject *capsule;
+
+    if (flight == NULL)
+        return PyErr_NoMemory();
+    flight->lock = PyThread_allocate_lock();
+    if (flight->lock == NULL) {
+        PyMem_Free(flight);
+        PyErr_SetString(PyExc_RuntimeError, "cannot allocate lock");
+        return NULL;
+    }
+    PyThread_acquire_lock(flight->lock, NOWAIT_LOCK);
+    flight->owner = PyThread_get_thread_ident();
+    capsule = PyCapsule_New(flight, "ttlru.flight", flight_destructor);
+    if (capsule == NULL) {
+        PyThread_free_lock(flight->lock);
+        PyMem_Free(flight);
+    }
+    return capsule;
+}
+
+/*
+ * A new instance of the exception of a failed load, built from its args and
+ * __dict__ as pickle does, with the original as its __cause__. Each waiter
+ * and each call within error_ttl raises its own one: raising the kept one
+ * again would grow its traceback every time, from several threads at once
+ * without the GIL. An exception that cannot be built again is given as is.
+ */
+static PyObject *
+exc_copy(PyObject *exc)
+{
+    PyObject *args, *dict, *copy, *copy_dict;
+
+    args = PyObject_GetAttrString(exc, "args");
+    if (args == NULL || !PyTuple_Check(args))
+        goto fail;
+    copy = PyObject_Call((PyObject *)Py_TYPE(exc), args, NULL);
+    Py_DECREF(args);
+    args = NULL;
+    if (copy == NULL)
+        goto fail;
+    if (!PyExceptionInstance_Check(copy)) {
+        Py_DECREF(copy);
+        goto fail;
+    }
+    dict = PyObject_GetAttrString(exc, "__dict__");
+    if (dict && PyDict_Check(dict) && PyDict_GET_SIZE(dict)) {
+        copy_dict = PyObject_GetAttrString(copy, "__dict__");
+        if (copy_dict == NULL || !PyDict_Check(copy_dict) || PyDict_Update(copy_dict, dict) != 0) {
+            Py_XDECREF(copy_dict);
+            Py_DECREF(dict);
+            Py_DECREF(copy);
+            goto fail;
+        }
+        Py_DECREF(copy_dict);
+    }
+    Py_XDECREF(dict);
+    PyErr_Clear();
+    Py_INCREF(exc);
+    PyException_SetCause(copy, exc);
+    return copy;
+
+fail:
+    Py_XDECREF(args);
+    PyErr_Clear();
+    Py_INCREF(exc);
+    return exc;
+}
+
+/* Wait for the flight to land and return its result, or raise a copy of its exception. */
+static PyObject *
+flight_wait(PyObject *capsule)
+{
+    Flight *flight = (Flight *)PyCapsule_GetPointer(capsule, "ttlru.flight");
+
+    if (flight->result == NULL && flight->exc == NULL &&
+        flight->owner == PyThread_get_thread_ident()) {
+        PyErr_SetString(PyExc_RuntimeError, "get_or_load() called again for a key its loader is loading");
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    PyThread_acquire_lock(flight->lock, WAIT_LOCK);
+    PyThread_release_lock(flight->lock);
+    Py_END_ALLOW_THREADS
+    if (flight->exc) {
+        PyObject *exc = exc_copy(flight->exc);
+
+        PyErr_SetObject((PyObject *)Py_TYPE(exc), exc);
+        Py_DECREF(exc);
+        return NULL;
+    }
+    Py_INCREF(flight->result);
+    return flight->result;
+}
+
+/* Parse an optional ttl argument, None gives dflt. */
+static int
+ttl_from_arg(PyObject *obj, PyTime_t dflt, PyTime_t *ttl)
+{
+    if (obj == NULL || obj == Py_None) {
+        *ttl = dflt;
+        return 0;
+    }
+    *ttl = PyLong_AsLongLong(obj);
+    if (*ttl == -1 && PyErr_Occurred())
+        return -1;
+    return 0;
+}
+
+/* Returns 1 and a copy of the exception in *exc if key failed less than error_ttl ago. */
+static int
+lru_failure(LRU *self, PyObject *key, PyObject **exc)
+{
+    PyObject *failure;
+
+    if (self->failures == NULL || PyDict_GET_SIZE(self->failures) == 0)
+        return 0;
+    failure = PyDict_GetItemWithError(self->failures, key);
+    if (failure == NULL)
+        return PyErr_Occurred() ? -1 : 0;
+    if (PyLong_AsLongLong(PyTuple_GET_ITEM(failure, 1)) <= lru_now(self)) {
+        return PyDict_DelItem(self->failures, key) == 0 ? 0 : -1;
+    }
+    /* the copy runs __init__ of the exception, which may drop the failure */
+    Py_INCREF(failure);
+    *exc = exc_copy(PyTuple_GET_ITEM(failure, 0));
+    Py_DECREF(failure);
+    return 1;
+}
+
+/*
+ * Keep the exception of a failed load. Like the items, there are at most size
+ * failures, when they are full the expired ones go, then all of them.
+ */
+static int
+lru_remember_failure(LRU *self, PyObject *key, PyObject *exc, PyTime_t error_ttl)
+{
+    PyObject *failure, *k, *v, *expired;
+    Py_ssize_t pos = 0, i;
+    PyTime_t t_now = lru_now(self);
+    int res;
+
+    if (self->failures == NULL && (self->failures = PyDict_New()) == NULL)
+        return -1;
+    if (PyDict_GET_SIZE(self->failures) >= self->size) {
+        expired = PyList_New(0);
+        if (expired == NULL)
+            return -1;
+        while (PyDict_Next(self->failures, &pos, &k, &v)) {
+            if (PyLong_AsLongLong(PyTuple_GET_ITEM(v, 1)) <= t_now &&
+                PyList_Append(expired, k) != 0) {
+                Py_DECREF(expired);
+                return -1;
+            }
+        }
+        for (i = 0; i < PyList_GET_SIZE(expired); i++) {
+            if (PyDict_DelItem(self->failures, PyList_GET_ITEM(expired, i)) != 0) {
+                Py_DECREF(expired);
+                return -1;
+            }
+        }
+        Py_DECREF(expired);
+        if (PyDict_GET_SIZE(self->failures) >= self->size)
+            PyDict_Clear(self->failures);
+    }
+    failure = Py_BuildValue("(OL)", exc, t_now + error_ttl);
+    if (failure == NULL)
+        return -1;
+    res = PyDict_SetItem(self->failures, key, failure);
+    Py_DECREF(failure);
+    return res;
+}
+
+/* Drop the flight of key from flights, if it is still this one. */
+static void
+lru_land(PyObject *flights, PyObject *key, PyObject *flight)
+{
+    PyObject *exc_type, *exc_value, *exc_tb;
+
+    /* the tp_clear of the GC may have dropped the dict */
+    if (flights == NULL)
+        return;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    if (PyDict_GetItemWithError(flights, key) == flight)
+        PyDict_DelItem(flights, key);
+    PyErr_Clear();
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/*
+ * The first half of get_or_load(), under the lock. Returns 1 with the value in
+ * *result on a hit, 0 with a new reference to the flight of key in *capsule,
+ * *own set when this call started it, or -1 with an exception set.
+ */
+static int
+lru_flight_take(LRU *self, PyObject *key, Py_hash_t hash, PyObject **result,
+                PyObject **capsule, int *own)
+{
+    PyTime_t t_now = TIME_UNSET;
+    PyObject *exc;
+    int res;
+
+    *result = lru_get_item(self, key, hash, &t_now);
+    if (*result)
+        return 1;
+    if (PyErr_Occurred())
+        return -1;
+    res = lru_failure(self, key, &exc);
+    if (res != 0) {
+        if (res > 0) {
+            PyErr_SetObject((PyObject *)Py_TYPE(exc), exc);
+            Py_DECREF(exc);
+        }
+        return -1;
+    }
+
+    if (self->flights == NULL && (self->flights = PyDict_New()) == NULL)
+        return -1;
+    *capsule = PyDict_GetItemWithError(self->flights, key);
+    if (*capsule) {
+        Py_INCREF(*capsule);
+        *own = 0;
+        return 0;
+    }
+    if (PyErr_Occurred())
+        return -1;
+    *capsule = flight_new();
+    if (*capsule == NULL)
+        return -1;
+    if (PyDict_SetItem(self->flights, key, *capsule) != 0) {
+        Py_CLEAR(*capsule);
+        return -1;
+    }
+    *own = 1;
+    return 0;
+}
+
+/*
+ * The second half, under the lock: insert the result of the loader, or keep
+ * its exception with error_ttl, and land the flight. Steals result.
+ */
+static PyObject *
+lru_flight_end(LRU *self, PyObject *key, Py_hash_t hash, PyObject *capsule, PyObject *loader,
+               PyObject *result, PyTime_t ttl, PyTime_t error_ttl)
+{
+    Flight *flight = (Flight *)PyCapsule_GetPointer(capsule, "ttlru.flight");
+    PyObject *exc_type, *exc, *exc_tb;
+    PyTime_t t_now = TIME_UNSET;
+
+    if (result && lru_set_item(self, key, hash, result, ttl, &t_now) != 0)
+        Py_CLEAR(result);
+    if (result) {
+        Py_INCREF(result);
+        flight->result = result;
+    } else {
+        PyErr_Fetch(&exc_type, &exc, &exc_tb);
+        PyErr_NormalizeException(&exc_type, &exc, &exc_tb);
+        if (exc_tb)
+            PyException_SetTraceback(exc, exc_tb);
+        Py_INCREF(exc);
+        flight->exc = exc;
+        if (error_ttl >= 0 && lru_remember_failure(self, key, exc, error_ttl) != 0)
+            PyErr_WriteUnraisable(loader);
+        PyErr_Restore(exc_type, exc, exc_tb);
+    }
+    lru_land(self->flights, key, capsule);
+    return result;
+}
+
+/*
+ * The lock of the TTLRU is only held around the two halves, never around the
+ * loader, so a slow loader does not stall the other threads on free-threaded
+ * builds.
+ */
+static PyObject *
+LRU_get_or_load(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "loader", "ttl", "error_ttl", NULL};
+    PyObject *key, *loader, *ttl_obj = Py_None, *error_ttl_obj = Py_None;
+    PyObject *result = NULL, *capsule = NULL;
+    PyTime_t ttl, error_ttl;
+    Py_hash_t hash;
+    int res, own = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OO:get_or_load", kwlist,
+                                     &key, &loader, &ttl_obj, &error_ttl_obj))
+        return NULL;
+    if (ttl_from_arg(ttl_obj, self->default_ttl, &ttl) != 0 ||
+        ttl_from_arg(error_ttl_obj, -1, &error_ttl) != 0)
+        return NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    res = lru_flight_take(self, key, hash, &result, &capsule, &own);
+    Py_END_CRITICAL_SECTION();
+    if (res != 0)
+        return result;
+    if (!own) {
+        result = flight_wait(capsule);
+        Py_DECREF(capsule);
+        return result;
+    }
+
+    /* the loader may take a while, the ttl starts when it returns */
+    result = PyObject_CallObject(loader, NULL);
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = lru_flight_end(self, key, hash, capsule, loader, result, ttl, error_ttl);
+    Py_END_CRITICAL_SECTION();
+    PyThread_release_lock(((Flight *)PyCapsule_GetPointer(capsule, "ttlru.flight"))->lock);
+    Py_DECREF(capsule);
+    return result;
+}
+
+/*
+ * Done callback of an aget_or_load() task. Its self is the tuple
+ * (lru, key, ttl, error_ttl).
+ */
+static PyObject *
+lru_aflight_done(PyObject *state, PyObject *task)
+{
+    LRU *self = (LRU *)PyTuple_GET_ITEM(state, 0);
+    PyObject *key = PyTuple_GET_ITEM(state, 1);
+    PyTime_t ttl = PyLong_AsLongLong(PyTuple_GET_ITEM(state, 2));
+    PyTime_t error_ttl = PyLong_AsLongLong(PyTuple_GET_ITEM(state, 3));
+    PyTime_t t_now = TIME_UNSET;
+    PyObject *cancelled, *exc, *result = NULL;
+    Py_hash_t hash;
+    int res = -1;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    lru_land(self->aflights, key, task);
+    cancelled = PyObject_CallMethod(task, "cancelled", NULL);
+    if (cancelled == NULL)
+        goto done;
+    if (cancelled == Py_True) {
+        res = 0;
+        goto done;
+    }
+    exc = PyObject_CallMethod(task, "exception", NULL);
+    if (exc == NULL)
+        goto done;
+    if (exc != Py_None) {
+        res = error_ttl >= 0 ? lru_remember_failure(self, key, exc, error_ttl) : 0;
+        Py_DECREF(exc);
+        goto done;
+    }
+    Py_DECREF(exc);
+    result = PyObject_CallMethod(task, "result", NULL);
+    if (result == NULL || (hash = PyObject_Hash(key)) == -1)
+        goto done;
+    res = lru_set_item(self, key, hash, result, ttl, &t_now);
+done:
+    Py_XDECREF(cancelled);
+    Py_XDECREF(result);
+    Py_END_CRITICAL_SECTION();
+    if (res != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef lru_aflight_done_def = {
+    "_aflight_done", (PyCFunction)lru_aflight_done, METH_O, NULL
+};
+
+/*
+ * What aget_or_load() uses of asyncio, with the names of the methods it calls
+ * on a loop and a future, set up by its first call so that a hit does not go
+ * through the import system and the attribute lookups of the module.
+ */
+enum {
+    ASYNCIO_GET_RUNNING_LOOP,
+    ASYNCIO_ENSURE_FUTURE,
+    ASYNCIO_SHIELD,
+    ASYNCIO_CREATE_FUTURE,      /* the rest are method names */
+    ASYNCIO_SET_RESULT,
+    ASYNCIO_SET_EXCEPTION,
+    ASYNCIO_NAMES
+};
+
+static const char * const asyncio_names[] = {
+    "get_running_loop", "ensure_future", "shield", "create_future", "set_result", "set_exception",
+};
+static PyObject *asyncio_api;   /* tuple of the functions and the interned method names */
+
+#ifdef Py_GIL_DISABLED
+static PyMutex asyncio_api_mutex;
+#endif
+
+/* Borrowed reference to asyncio_api, NULL with an exception set on error. */
+static PyObject *
+asyncio_api_get(void)
+{
+    PyObject *asyncio, *api, *obj;
+    int i;
+
+#ifdef Py_GIL_DISABLED
+    PyMutex_Lock(&asyncio_api_mutex);
+#endif
+    if (asyncio_api == NULL && (asyncio = PyImport_ImportModule("asyncio")) != NULL) {
+        api = PyTuple_New(ASYNCIO_NAMES);
+        for (i = 0; api && i < ASYNCIO_NAMES; i++) {
+            if (i < ASYNCIO_CREATE_FUTURE)
+                obj = PyObject_GetAttrString(asyncio, asyncio_names[i]);
+            else
+                obj = PyUnicode_InternFromString(asyncio_names[i]);
+            if (obj == NULL)
+                Py_CLEAR(api);
+            else
+                PyTuple_SET_ITEM(api, i, obj);
+        }
+        Py_DECREF(asyncio);
+        asyncio_api = api;
+    }
+    api = asyncio_api;
+#ifdef Py_GIL_DISABLED
+    PyMutex_Unlock(&asyncio_api_mutex);
+#endif
+    return api;
+}
+
+/* A future of the running loop that is already done with value, or with exc. */
+static PyObject *
+lru_done_future(PyObject *api, PyObject *value, PyObject *exc)
+{
+    PyObject *loop, *fut, *res;
+
+    loop = PyObject_CallObject(PyTuple_GET_ITEM(api, ASYNCIO_GET_RUNNING_LOOP), NULL);
+    if (loop == NULL)
+        return NULL;
+    fut = PyObject_CallMethodObjArgs(loop, PyTuple_GET_ITEM(api, ASYNCIO_CREATE_FUTURE), NULL);
+    Py_DECREF(loop);
+    if (fut == NULL)
+        return NULL;
+    if (exc)
+        res = PyObject_CallMethodObjArgs(fut, PyTuple_GET_ITEM(api, ASYNCIO_SET_EXCEPTION), exc, NULL);
+    else
+        res = PyObject_CallMethodObjArgs(fut, PyTuple_GET_ITEM(api, ASYNCIO_SET_RESULT), value, NULL);
+    if (res == NULL) {
+        Py_DECREF(fut);
+        return NULL;
+    }
+    Py_DECREF(res);
+    return fut;
+}
+
+static PyObject *
+LRU_aget_or_load(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "loader", "ttl", "error_ttl", NULL};
+    PyObject *key, *loader, *ttl_obj = Py_None, *error_ttl_obj = Py_None;
+    PyObject *api, *value, *exc, *coro, *task = NULL, *state, *callback, *res;
+    PyObject *result = NULL;
+    PyTime_t t_now = TIME_UNSET;
+    PyTime_t ttl, error_ttl;
+    Py_hash_t hash;
+    int found;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|OO:aget_or_load", kwlist,
+                                     &key, &loader, &ttl_obj, &error_ttl_obj))
+        return NULL;
+    if (ttl_from_arg(ttl_obj, self->default_ttl, &ttl) != 0 ||
+        ttl_from_arg(error_ttl_obj, -1, &error_ttl) != 0)
+        return NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    api = asyncio_api_get();
+    if (api == NULL)
+        return NULL;
+    /* a hit is a future too, already done, so that it works like the one of a miss */
+    value = lru_get_item(self, key, hash, &t_now);
+    if (value || PyErr_Occurred()) {
+        if (value)
+            result = lru_done_future(api, value, NULL);
+        Py_XDECREF(value);
+        return result;
+    }
+    found = lru_failure(self, key, &exc);
+    if (found != 0) {
+        if (found > 0) {
+            result = lru_done_future(api, NULL, exc);
+            Py_DECREF(exc);
+        }
+        goto done;
+    }
+
+    if (self->aflights == NULL && (self->aflights = PyDict_New()) == NULL)
+        goto done;
+    task = PyDict_GetItemWithError(self->aflights, key);
+    if (task) {
+        Py_INCREF(task);
+    } else {
+        if (PyErr_Occurred())
+            goto done;
+        coro = PyObject_CallObject(loader, NULL);
+        if (coro == NULL)
+            goto done;
+        task = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(api, ASYNCIO_ENSURE_FUTURE), coro, NULL);
+        Py_DECREF(coro);
+        if (task == NULL)
+            goto done;
+        state = Py_BuildValue("(OOLL)", self, key, ttl, error_ttl);
+        if (state == NULL)
+            goto done;
+        callback = PyCFunction_New(&lru_aflight_done_def, state);
+        Py_DECREF(state);
+        if (callback == NULL)
+            goto done;
+        res = PyObject_CallMethod(task, "add_done_callback", "O", callback);
+        Py_DECREF(callback);
+        if (res == NULL)
+            goto done;
+        Py_DECREF(res);
+        if (PyDict_SetItem(self->aflights, key, task) != 0)
+            goto done;
+    }
+    /* a waiter that is cancelled must not cancel the load of the others */
+    result = PyObject_CallFunctionObjArgs(PyTuple_GET_ITEM(api, ASYNCIO_SHIELD), task, NULL);
+done:
+    Py_XDECREF(task);
+    return result;
+}
+
+/*
+ * Remove key and return its value. Without a default, a missing key raises
+ * the same KeyError as L[key] does.
+ */
+static PyObject *
+lru_pop(LRU *self, PyObject *key, Py_hash_t hash, PyObject *default_obj)
+{
+    PyObject *result;
+    PyObject *node_key;
+    Py_ssize_t ix;
+
+    /* Trying to access the item by key. */
+    ix = lru_lookup(self, key, hash);
+    if (ix == -2)
+        return NULL;
+    if (ix >= 0 && NODE(self, ix)->expire != -1 &&
+        IS_EXPIRED(lru_now(self), NODE(self, ix))) {
+        lru_delete_expire(self, (uint32_t)ix, EXPIRED_READ);
+        lru_notify(self);
+        ix = -1;
+    }
+
+    if (ix >= 0) {
+        /* Found, unlink it and hand the reference of the value to the caller */
+        self->hits++;
+        self->metrics.hits++;
+        self->metrics.deletes++;
+        lru_unlink_node(self, (uint32_t)ix, &node_key, &result);
+        Py_DECREF(node_key);
+        return result;
+    }
+
+    self->misses++;
+    self->metrics.misses++;
+    if (default_obj) {
+        /* key missing, and default_obj given */
+        Py_INCREF(default_obj);
+        return default_obj;
+    }
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+}
+
+static PyObject *
+LRU_pop(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    Py_hash_t hash;
+
+    if (!check_nargs("pop", nargs, 1, 2))
+        return NULL;
+    hash = PyObject_Hash(args[0]);
+    if (hash == -1)
+        return NULL;
+    return lru_pop(self, args[0], hash, nargs > 1 ? args[1] : NULL);
+}
+
+/* The value returned by lookup() for a key known to be absent */
+static PyObject *ttlru_missing;
+
+static PyObject *
+LRU_set_missing(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "ttl", NULL};
+    PyObject *key, *ttl_obj = Py_None;
+    PyTime_t t_now = TIME_UNSET;
+    PyTime_t ttl;
+    Py_hash_t hash;
+    Py_ssize_t ix;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:set_missing", kwlist, &key, &ttl_obj))
+        return NULL;
+    if (ttl_from_arg(ttl_obj, self->default_ttl, &ttl) != 0)
+        return NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    /* the key is gone, so is its value */
+    ix = lru_lookup(self, key, hash);
+    if (ix == -2)
+        return NULL;
+    if (ix >= 0) {
+        lru_drop_node(self, (uint32_t)ix);
+        self->metrics.deletes++;
+    }
+    if (missing_set(self, key, hash, ttl == -1 ? -1 : lru_now_cached(self, &t_now) + ttl,
+                    lru_now_cached(self, &t_now)) != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_lookup(LRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *result;
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash;
+    int absent;
+
+    if (!check_nargs("lookup", nargs, 1, 2))
+        return NULL;
+    hash = PyObject_Hash(args[0]);
+    if (hash == -1)
+        return NULL;
+    result = lru_get_item(self, args[0], hash, &t_now);
+    if (result || PyErr_Occurred())
+        return result;
+    absent = self->missing_used ? missing_check(self, args[0], hash, &t_now) : 0;
+    if (absent < 0)
+        return NULL;
+    result = absent ? ttlru_missing : nargs > 1 ? args[1] : Py_None;
+    Py_INCREF(result);
+    return result;
+}
+
+/*
+ * touch(), expire_at() and ttl() work on the node in place: the value, the
+ * position in the list and the stats stay as they are, only the expire time
+ * and the place in the heap change.
+ */
+static PyObject *
+lru_set_expire(LRU *self, PyObject *key, PyTime_t expire)
+{
+    Py_hash_t hash = PyObject_Hash(key);
+    Py_ssize_t ix;
+
+    if (hash == -1)
+        return NULL;
+    ix = lru_find_live(self, key, hash);
+    if (ix == -2)
+        return NULL;
+    if (ix == -1)
+        Py_RETURN_FALSE;
+    NODE(self, ix)->expire = expire;
+    if (heap_update(self, (uint32_t)ix) != 0)
+        return NULL;
+    Py_RETURN_TRUE;
+}
+
+static PyObject *
+LRU_touch(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "ttl", NULL};
+    PyObject *key, *ttl_obj = Py_None;
+    PyTime_t ttl;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O:touch", kwlist, &key, &ttl_obj))
+        return NULL;
+    if (ttl_from_arg(ttl_obj, self->default_ttl, &ttl) != 0)
+        return NULL;
+    return lru_set_expire(self, key, ttl == -1 ? -1 : lru_now(self) + ttl);
+}
+
+static PyObject *
+LRU_expire_at(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "ts", NULL};
+    PyObject *key;
+    PyTime_t ts;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OL:expire_at", kwlist, &key, &ts))
+        return NULL;
+    if (ts < -1) {
+        PyErr_SetString(PyExc_ValueError, "ts should be -1 or a time of L.now()");
+        return NULL;
+    }
+    return lru_set_expire(self, key, ts);
+}
+
+static PyObject *
+LRU_ttl(LRU *self, PyObject *key)
+{
+    Py_hash_t hash = PyObject_Hash(key);
+    Py_ssize_t ix;
+    PyTime_t expire, now;
+
+    if (hash == -1)
+        return NULL;
+    ix = lru_find_live(self, key, hash);
+    if (ix == -2)
+        return NULL;
+    if (ix == -1)
+        Py_RETURN_NONE;
+    expire = NODE(self, ix)->expire;
+    if (expire == -1)
+        return PyLong_FromLong(-1);
+    now = lru_now(self);
+    return PyLong_FromLongLong(expire > now ? expire - now : 0);
+}
+
+static PyObject *
+LRU_set_tag(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"key", "tag", NULL};
+    PyObject *key, *tag;
+    Py_hash_t hash;
+    int res;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO:set_tag", kwlist, &key, &tag))
+        return NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    res = lru_tag(self, key, hash, tag);
+    if (res < 0)
+        return NULL;
+    return PyBool_FromLong(res);
+}
+
+/*
+ * Remove the items of tag, in the order of its list. Like del, it calls no
+ * callback for the live items and counts them as deletes, the expired ones are
+ * expirations and notified as such. The nodes are unlinked first and the
+ * references released or notified after, so code run then sees the group gone.
+ * Returns the number of live items removed.
+ */
+static PyObject *
+LRU_invalidate_tag(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"tag", NULL};
+    PyObject *tag, *id_obj, **refs;
+    Py_ssize_t id, i, count, live = 0;
+    PyTime_t t_now;
+    uint32_t ix;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:invalidate_tag", kwlist, &tag))
+        return NULL;
+    if (self->tag_ids == NULL)
+        return PyLong_FromLong(0);
+    id_obj = PyDict_GetItemWithError(self->tag_ids, tag);
+    if (id_obj == NULL)
+        return PyErr_Occurred() ? NULL : PyLong_FromLong(0);
+    id = PyLong_AsSsize_t(id_obj);
+    if (id == -1 && PyErr_Occurred())
+        return NULL;
+    /* the dict lookup may have run code that changed the tags */
+    if (id >= self->tags_cap || self->tags[id].tag == NULL)
+        return PyLong_FromLong(0);
+    count = self->tags[id].count;
+    if (count == 0)
+        return PyLong_FromLong(0);
+    refs = PyMem_New(PyObject *, 2 * count);
+    if (refs == NULL)
+        return PyErr_NoMemory();
+    /* the live items fill refs from the start, the expired ones from the end */
+    t_now = lru_now(self);
+    for (i = 0; i < count; i++) {
+        ix = self->tags[id].first;
+        if (NODE(self, ix)->expire != -1 && IS_EXPIRED(t_now, NODE(self, ix)))
+            lru_unlink_node(self, ix, &refs[2 * (count - 1 - (i - live))],
+                            &refs[2 * (count - 1 - (i - live)) + 1]);
+        else {
+            lru_unlink_node(self, ix, &refs[2 * live], &refs[2 * live + 1]);
+            live++;
+        }
+    }
+    self->metrics.deletes += live;
+    for (i = 0; i < 2 * live; i++)
+        Py_DECREF(refs[i]);
+    for (i = count - 1; i >= live; i--)
+        lru_evicted(self, refs[2 * i], refs[2 * i + 1], EXPIRED_TAG);
+    PyMem_Free(refs);
+    lru_notify(self);
+    return PyLong_FromSsize_t(live);
+}
+
+/*
+ * First not expired node from the head (or the tail). The expired nodes
+ * before it are counted in *expired, the caller drops them with
+ * lru_drop_expired() once it is done with the node.
+ */
+static uint32_t
+lru_peek_node(LRU *self, int from_tail, PyTime_t t_now, Py_ssize_t *expired)
+{
+    uint32_t node;
+
+    *expired = 0;
+    node = from_tail ? self->last : self->first;
+    while (node != NIL) {
+        if (!IS_EXPIRED(t_now, NODE(self, node)))
+            return node;
+        (*expired)++;
+        node = from_tail ? NODE(self, node)->prev : NODE(self, node)->next;
+    }
+    return NIL;
+}
+
+static PyObject *
+lru_peek_item(LRU *self, int from_tail)
+{
+    PyTime_t t_now = lru_now(self);
+    Py_ssize_t expired;
+    uint32_t node = lru_peek_node(self, from_tail, t_now, &expired);
+    PyObject *result;
+
+    if (node == NIL) {
+        result = Py_None;
+        Py_INCREF(result);
+    }
+    else {
+        result = get_item(NODE(self, node));
+    }
+    lru_drop_expired(self, from_tail, expired, t_now, EXPIRED_PEEK);
+    return result;
+}
+
+static PyObject *
+LRU_peek_first_item(LRU *self)
+{
+    return lru_peek_item(self, 0);
+}
+
+static PyObject *
+LRU_peek_last_item(LRU *self)
+{
+    return lru_peek_item(self, 1);
+}
+
+static PyObject *
+LRU_popitem(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"least_recent", NULL};
+    int pop_least_recent = 1;
+    PyObject *result;
+    PyObject *key, *value;
+    uint32_t node;
+    Py_ssize_t expired;
+    PyTime_t t_now;
+
+#if PY_MAJOR_VERSION >= 3
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &pop_least_recent))
+        return NULL;
+#else
+    {
+        PyObject *arg_ob = Py_True;
+        if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &arg_ob))
+            return NULL;
+        pop_least_recent = PyObject_IsTrue(arg_ob);
+        if (pop_least_recent == -1)
+            return NULL;
+    }
+#endif
+    t_now = lru_now(self);
+    result = PyTuple_New(2);
+    if (result == NULL)
+        return NULL;
+    node = lru_peek_node(self, pop_least_recent, t_now, &expired);
+    if (node == NIL) {
+        Py_DECREF(result);
+        lru_drop_expired(self, pop_least_recent, expired, t_now, EXPIRED_PEEK);
+        PyErr_SetString(PyExc_KeyError, "popitem(): LRU dict is empty");
+        return NULL;
+    }
+    lru_unlink_node(self, node, &key, &value);
+    self->metrics.deletes++;
+    PyTuple_SET_ITEM(result, 0, key);
+    PyTuple_SET_ITEM(result, 1, value);
+    lru_drop_expired(self, pop_least_recent, expired, t_now, EXPIRED_PEEK);
+    return result;
+}
+
+static PyObject *
+LRU_keys(LRU *self) {
+    return collect(self, get_key);
+}
+
+static PyObject *
+get_value(Node *node)
+{
+    Py_INCREF(node->value);
+    return node->value;
+}
+
+static PyObject *
+LRU_values(LRU *self)
+{
+    return collect(self, get_value);
+}
+
+static PyObject *
+LRU_set_callback(LRU *self, PyObject *args)
+{
+    return set_callback(self, args);
+}
+
+
+
+static PyObject *
+LRU_items(LRU *self)
+{
+    return collect(self, get_item);
+}
+
+static int
+lru_set_size(LRU *self, Py_ssize_t newSize)
+{
+    PyTime_t t_now = TIME_UNSET;
+
+    while (lru_length(self) > newSize) {
+        lru_evict_one(self, &t_now, EVICTED_CAPACITY);
+    }
+    self->size = newSize;
+    lru_notify(self);
+    return policy_resize(self);
+}
+
+static PyObject *
+LRU_set_max_weight(LRU *self, PyObject *args)
+{
+    PyTime_t t_now = TIME_UNSET;
+    Py_ssize_t max_weight;
+
+    if (!PyArg_ParseTuple(args, "n:set_max_weight", &max_weight))
+        return NULL;
+    if (!self->max_weight) {
+        PyErr_SetString(PyExc_ValueError, "set_max_weight() needs a TTLRU created with max_weight");
+        return NULL;
+    }
+    if (max_weight <= 0) {
+        PyErr_SetString(PyExc_ValueError, "max_weight should be a positive number");
+        return NULL;
+    }
+    self->max_weight = max_weight;
+    lru_fit_weight(self, &t_now);
+    lru_notify(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_get_max_weight(LRU *self)
+{
+    return PyLong_FromSsize_t(self->max_weight);
+}
+
+static PyObject *
+LRU_get_weight(LRU *self)
+{
+    return PyLong_FromSsize_t(self->total_weight);
+}
+
+static PyObject *
+LRU_set_size(LRU *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t newSize;
+    if (!PyArg_ParseTuple(args, "n", &newSize)) {
+        return NULL;
+    }
+    if (newSize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        return NULL;
+    }
+    if (lru_set_size(self, newSize) != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/*
+ * Reset the storage to an empty table. The nodes are detached first and their
+ * references released afterwards, so code run by a release sees an empty cache.
+ * A preallocated cache keeps its node array and table, only the links are reset.
+ */
+static int
+lru_reset(LRU *self)
+{
+    Node *nodes;
+    Py_ssize_t top;
+    int keep;
+    size_t tablesize;
+    uint32_t *table;
+    PyObject **refs = NULL;
+    Py_ssize_t i, n = 0;
+
+    /* first, as releasing the tags may run code that uses the TTLRU */
+    tag_reset(self);
+    nodes = self->nodes;
+    top = self->nodes_top;
+    keep = self->preallocate && self->nodes != NULL;
+    tablesize = keep ? self->mask + 1 : TABLE_MINSIZE;
+    table = PyMem_New(uint32_t, tablesize);
+    if (!table) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    /* every allocation is done before the first node is detached */
+    if (keep && self->used) {
+        refs = PyMem_New(PyObject *, self->used * 2);
+        if (!refs) {
+            PyMem_Free(table);
+            PyErr_NoMemory();
+            return -1;
+        }
+        for (i = 0; i < top; i++) {
+            if (nodes[i].key) {
+                refs[n++] = nodes[i].key;
+                refs[n++] = nodes[i].value;
+                nodes[i].key = nodes[i].value = NULL;
+            }
+        }
+    }
+    memset(table, 0xff, tablesize * sizeof(uint32_t));
+    PyMem_Free(self->table);
+    self->table = table;
+    self->mask = tablesize - 1;
+    self->used = self->fill = 0;
+    if (!keep) {
+        self->nodes = NULL;
+        self->nodes_cap = 0;
+        PyMem_Free(self->weights);
+        self->weights = NULL;
+        PyMem_Free(self->ttls);
+        self->ttls = NULL;
+    }
+    self->total_weight = 0;
+    self->nodes_top = 0;
+    self->free = NIL;
+    self->first = self->last = NIL;
+    self->heap_len = 0;
+    policy_clear(self);
+    self->version++;
+
+    if (keep) {
+        for (i = 0; i < n; i++)
+            Py_DECREF(refs[i]);
+        PyMem_Free(refs);
+        return 0;
+    }
+    for (i = 0; i < top; i++) {
+        if (nodes[i].key) {
+            Py_DECREF(nodes[i].key);
+            Py_DECREF(nodes[i].value);
+        }
+    }
+    PyMem_Free(nodes);
+    return 0;
+}
+
+/* Allocate the node array and the table for size items up front. */
+static int
+lru_preallocate(LRU *self)
+{
+    Py_ssize_t cap = self->size + 1;
+
+    if (cap > MAX_NODES)
+        cap = MAX_NODES;
+    if (cap > self->nodes_cap && node_reserve(self, cap) != 0)
+        return -1;
+    if ((size_t)cap * 3 >= (self->mask + 1) * 2)
+        return table_resize(self, cap);
+    return 0;
+}
+
+static PyObject *
+LRU_clear(LRU *self)
+{
+    if (lru_reset(self) != 0)
+        return NULL;
+    if (self->failures)
+        PyDict_Clear(self->failures);
+    missing_clear(self);
+
+    self->hits = 0;
+    self->misses = 0;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+LRU_purge_expired(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"max_items", "max_ns", NULL};
+    PyObject *max_items_obj = Py_None;
+    PyObject *max_ns_obj = Py_None;
+    Py_ssize_t max_items = -1;
+    PyTime_t max_ns = -1;
+    Py_ssize_t count;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OO:purge_expired", kwlist,
+                                     &max_items_obj, &max_ns_obj))
+        return NULL;
+    if (max_items_obj != Py_None) {
+        max_items = PyLong_AsSsize_t(max_items_obj);
+        if (max_items == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_items < 0) {
+            PyErr_SetString(PyExc_ValueError, "max_items should not be negative");
+            return NULL;
+        }
+    }
+    if (max_ns_obj != Py_None) {
+        max_ns = PyLong_AsLongLong(max_ns_obj);
+        if (max_ns == -1 && PyErr_Occurred())
+            return NULL;
+        if (max_ns < 0) {
+            PyErr_SetString(PyExc_ValueError, "max_ns should not be negative");
+            return NULL;
+        }
+    }
+
+    count = lru_purge(self, lru_now(self), max_items, max_ns, EXPIRED_PURGE);
+    self->purged += count;
+    /* the negative entries are not counted, and only swept by an unbounded purge */
+    if (self->missing_used && max_items == -1 && max_ns == -1)
+        missing_purge(self, lru_now(self));
+    lru_notify(self);
+    return PyLong_FromSsize_t(count);
+}
+
+static PyObject *
+LRU_set_notify(LRU *self, PyObject *args)
+{
+    const char *name;
+    Py_ssize_t max_records = 0;
+    int notify;
+
+    if (!PyArg_ParseTuple(args, "s|n:set_notify", &name, &max_records))
+        return NULL;
+    notify = notify_from_name(name);
+    if (notify < 0)
+        return NULL;
+    if (max_records < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_records should not be negative");
+        return NULL;
+    }
+    self->notify = notify;
+    self->ring_max = max_records;
+    while (self->ring_max && self->ring_len > self->ring_max) {
+        Eviction *ev = &self->ring[self->ring_head];
+        Py_DECREF(ev->key);
+        Py_DECREF(ev->value);
+        self->ring_head = (self->ring_head + 1) & (self->ring_cap - 1);
+        self->ring_len--;
+        self->ring_dropped++;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_set_refresher(LRU *self, PyObject *args)
+{
+    PyObject *refresher;
+    PyTime_t soft_ttl = -1;
+
+    if (!PyArg_ParseTuple(args, "O|L:set_refresher", &refresher, &soft_ttl))
+        return NULL;
+    if (refresher == Py_None) {
+        Py_CLEAR(self->refresher);
+        self->soft_ttl = -1;
+        Py_RETURN_NONE;
+    }
+    if (!PyCallable_Check(refresher)) {
+        PyErr_SetString(PyExc_TypeError, "refresher must be callable");
+        return NULL;
+    }
+    if (soft_ttl < 0) {
+        PyErr_SetString(PyExc_ValueError, "soft_ttl should not be negative");
+        return NULL;
+    }
+    if (self->ttls == NULL && self->nodes_cap) {
+        Py_ssize_t i;
+
+        /* the items already there have no soft expire and are never refreshed */
+        self->ttls = PyMem_New(PyTime_t, self->nodes_cap);
+        if (self->ttls == NULL)
+            return PyErr_NoMemory();
+        for (i = 0; i < self->nodes_cap; i++)
+            self->ttls[i] = -1;
+    }
+    Py_INCREF(refresher);
+    Py_XSETREF(self->refresher, refresher);
+    self->soft_ttl = soft_ttl;
+    Py_RETURN_NONE;
+}
+
+/* The state of __reduce__(): a snapshot, or (snapshot, refresher, soft_ttl). */
+static PyObject *
+LRU_setstate(LRU *self, PyObject *state)
+{
+    PyObject *args, *res;
+
+    if (!PyTuple_Check(state))
+        return LRU_loads(self, state);
+    if (PyTuple_GET_SIZE(state) != 3) {
+        PyErr_SetString(PyExc_ValueError, "invalid TTLRU state");
+        return NULL;
+    }
+    /* the refresher first, so the loaded items get a soft expire */
+    args = PyTuple_GetSlice(state, 1, 3);
+    if (args == NULL)
+        return NULL;
+    res = LRU_set_refresher(self, args);
+    Py_DECREF(args);
+    if (res == NULL)
+        return NULL;
+    Py_DECREF(res);
+    return LRU_loads(self, PyTuple_GET_ITEM(state, 0));
+}
+
+static PyObject *
+LRU_drain_evictions(LRU *self)
+{
+    return ring_take(self);
+}
+
+static PyObject *
+LRU_get_missing_stats(LRU *self)
+{
+    return Py_BuildValue("nnnn", self->missing_used, self->missing_hits, self->missing_evicted,
+                         self->missing_expired);
+}
+
+static PyObject *
+LRU_get_notify_stats(LRU *self)
+{
+    return Py_BuildValue("nn", self->ring_len, self->ring_dropped);
+}
+
+static PyObject *
+LRU_set_auto_purge(LRU *self, PyObject *args)
+{
+    Py_ssize_t auto_purge;
+    if (!PyArg_ParseTuple(args, "n", &auto_purge)) {
+        return NULL;
+    }
+    if (auto_purge < 0) {
+        PyErr_SetString(PyExc_ValueError, "auto_purge should not be negative");
+        return NULL;
+    }
+    self->auto_purge = auto_purge;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_get_purge_stats(LRU *self)
+{
+    return Py_BuildValue("nn", self->purged, self->auto_purged);
+}
+
+static PyObject *
+LRU_get_pool_stats(LRU *self)
+{
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n}",
+                         "capacity", self->nodes_cap,
+                         "used", self->used,
+                         "free", self->nodes_cap - self->used,
+                         "grows", self->pool_grows,
+                         "reused", self->pool_reused);
+}
+
+static PyObject *
+LRU_get_policy_stats(LRU *self)
+{
+    static const char *seg_names[][3] = {
+        {"lru", NULL, NULL},
+        {"protected", "probation", NULL},
+        {"am", "a1in", NULL},
+        {"window", "protected", "probation"},
+    };
+    PyObject *segs = PyDict_New();
+    PyObject *count;
+    int s;
+
+    if (segs == NULL)
+        return NULL;
+    for (s = 0; s < 3 && seg_names[self->policy][s]; s++) {
+        count = PyLong_FromSsize_t(self->seg_count[s]);
+        if (count == NULL || PyDict_SetItemString(segs, seg_names[self->policy][s], count) != 0) {
+            Py_XDECREF(count);
+            Py_DECREF(segs);
+            return NULL;
+        }
+        Py_DECREF(count);
+    }
+    return Py_BuildValue("{s:s,s:O,s:N,s:n,s:n}",
+                         "policy", policy_names[self->policy],
+                         "approximate", self->approximate ? Py_True : Py_False,
+                         "segments", segs,
+                         "admitted", self->policy_admitted,
+                         "rejected", self->policy_rejected);
+}
+
+static PyObject *
+LRU_tick(LRU *self, PyObject *args)
+{
+    PyObject *now_obj = Py_None;
+
+    if (!PyArg_ParseTuple(args, "|O:tick", &now_obj))
+        return NULL;
+    if (self->clock != LRU_CLOCK_TICK) {
+        PyErr_SetString(PyExc_TypeError, "tick() needs a TTLRU with clock='tick'");
+        return NULL;
+    }
+    if (now_obj == Py_None) {
+        self->clock_now = clock_monotonic();
+    } else {
+        PyTime_t now = PyLong_AsLongLong(now_obj);
+        if (now == -1 && PyErr_Occurred())
+            return NULL;
+        self->clock_now = now;
+    }
+    return PyLong_FromLongLong(self->clock_now);
+}
+
+static PyObject *
+LRU_now(LRU *self)
+{
+    return PyLong_FromLongLong(lru_now(self));
+}
+
+static PyObject *
+LRU_get_size(LRU *self)
+{
+    return Py_BuildValue("n", self->size);
+}
+
+static PyObject *
+LRU_get_stats(LRU *self)
+{
+    return Py_BuildValue("nn", self->hits, self->misses);
+}
+
+static PyObject *
+latency_list(const Py_ssize_t *buckets)
+{
+    PyObject *list = PyList_New(LATENCY_BUCKETS);
+    PyObject *count;
+    int i;
+
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < LATENCY_BUCKETS; i++) {
+        count = PyLong_FromSsize_t(buckets[i]);
+        if (count == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, count);
+    }
+    return list;
+}
+
+static PyObject *
+LRU_get_metrics(LRU *self)
+{
+    const LRUMetrics *m = &self->metrics;
+    PyObject *latency;
+
+    if (self->latency_sample)
+        latency = Py_BuildValue("{s:N,s:N}",
+                                "get", latency_list(m->latency[LATENCY_GET]),
+                                "set", latency_list(m->latency[LATENCY_SET]));
+    else {
+        latency = Py_None;
+        Py_INCREF(latency);
+    }
+    if (latency == NULL)
+        return NULL;
+    return Py_BuildValue(
+        "{s:n,s:n,s:n,s:n,s:n,s:n,"
+        "s:{s:n,s:n},"
+        "s:{s:n,s:n,s:n,s:n,s:n,s:n,s:n,s:n},"
+        "s:n,s:n,s:N}",
+        "hits", m->hits,
+        "misses", m->misses,
+        "expired_misses", m->expired_misses,
+        "inserts", m->inserts,
+        "updates", m->updates,
+        "deletes", m->deletes,
+        "evictions",
+            "capacity", m->removed[EVICTED_CAPACITY],
+            "weight", m->removed[EVICTED_WEIGHT],
+        "expirations",
+            "read", m->removed[EXPIRED_READ],
+            "evict", m->removed[EXPIRED_EVICT],
+            "purge", m->removed[EXPIRED_PURGE],
+            "auto_purge", m->removed[EXPIRED_AUTO_PURGE],
+            "iter", m->removed[EXPIRED_ITER],
+            "collect", m->removed[EXPIRED_COLLECT],
+            "peek", m->removed[EXPIRED_PEEK],
+            "tag", m->removed[EXPIRED_TAG],
+        "items", lru_length(self),
+        "expired_items", self->heap_len ? heap_count_expired(self, lru_now(self)) : 0,
+        "latency", latency);
+}
+
+static PyObject *
+LRU_reset_metrics(LRU *self)
+{
+    memset(&self->metrics, 0, sizeof(self->metrics));
+    self->latency_tick = 0;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+LRU_set_latency_sample(LRU *self, PyObject *args)
+{
+    Py_ssize_t sample;
+
+    if (!PyArg_ParseTuple(args, "n:set_latency_sample", &sample))
+        return NULL;
+    if (sample < 0) {
+        PyErr_SetString(PyExc_ValueError, "latency_sample should not be negative");
+        return NULL;
+    }
+    self->latency_sample = sample;
+    self->latency_tick = 0;
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Iterators and views. An iterator walks the list one node per step, from the
+ * MRU or from the LRU end, and skips the nodes that expired before it was
+ * created. With reap it also drops them. Any other change of the list order,
+ * including a read that moves an item to the head, stops the iteration with
+ * a RuntimeError.
+ */
+enum {
+    ITER_KEYS,
+    ITER_VALUES,
+    ITER_ITEMS,
+};
+
+typedef struct {
+    PyObject_HEAD
+    LRU *lru;
+    uint32_t node;
+    int kind;
+    int reverse;
+    int reap;
+    size_t version;
+    PyTime_t t_now;
+} LRUIter;
+
+static PyTypeObject LRUIterType;
+
+static PyObject *
+lru_iter_new(LRU *lru, int kind, int reverse, int reap)
+{
+    LRUIter *it = PyObject_GC_New(LRUIter, &LRUIterType);
+
+    if (it == NULL)
+        return NULL;
+    Py_INCREF(lru);
+    it->lru = lru;
+    it->node = reverse ? lru->last : lru->first;
+    it->kind = kind;
+    it->reverse = reverse;
+    it->reap = reap;
+    it->version = lru->version;
+    it->t_now = lru_now(lru);
+    lru->iterators++;
+    PyObject_GC_Track(it);
+    return (PyObject *)it;
+}
+
+static int
+lru_iter_traverse(LRUIter *it, visitproc visit, void *arg)
+{
+    Py_VISIT(it->lru);
+    return 0;
+}
+
+/* Like the end of the iteration, the iterator lets go of the TTLRU. */
+static int
+lru_iter_clear(LRUIter *it)
+{
+    LRU *lru = it->lru;
+
+    if (lru) {
+        it->lru = NULL;
+        Py_BEGIN_CRITICAL_SECTION(lru);
+        lru->iterators--;
+        Py_END_CRITICAL_SECTION();
+        Py_DECREF(lru);
+    }
+    return 0;
+}
+
+static void
+lru_iter_dealloc(LRUIter *it)
+{
+    PyObject_GC_UnTrack(it);
+    lru_iter_clear(it);
+    PyObject_GC_Del(it);
+}
+
+static PyObject *
+lru_iter_step(LRUIter *it)
+{
+    LRU *lru = it->lru;
+    PyObject *key, *value;
+    uint32_t curr;
+    Node *node;
+
+    if (lru == NULL)
+        return NULL;
+    if (it->version != lru->version) {
+        PyErr_SetString(PyExc_RuntimeError, "TTLRU changed during iteration");
+        return NULL;
+    }
+
+    while (it->node != NIL) {
+        curr = it->node;
+        node = NODE(lru, curr);
+        it->node = it->reverse ? node->prev : node->next;
+        if (!IS_EXPIRED(it->t_now, node)) {
+            switch (it->kind) {
+            case ITER_KEYS:
+                return get_key(node);
+            case ITER_VALUES:
+                return get_value(node);
+            default:
+                return get_item(node);
+            }
+        }
+        if (it->reap) {
+            lru_unlink_node(lru, curr, &key, &value);
+            lru->metrics.removed[EXPIRED_ITER]++;
+            it->version = lru->version;
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (it->version != lru->version) {
+                PyErr_SetString(PyExc_RuntimeError, "TTLRU changed during iteration");
+                return NULL;
+            }
+        }
+    }
+
+    it->lru = NULL;
+    lru->iterators--;
+    Py_DECREF(lru);
+    return NULL;
+}
+
+static PyObject *
+lru_iter_next(LRUIter *it)
+{
+    LRU *lru = it->lru;
+    PyObject *res;
+
+    if (lru == NULL)
+        return NULL;
+    /* the last step drops the reference of the iterator */
+    Py_INCREF(lru);
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    res = lru_iter_step(it);
+    Py_END_CRITICAL_SECTION();
+    Py_DECREF(lru);
+    return res;
+}
+
+static PyTypeObject LRUIterType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru.TTLRUIterator",   /* tp_name */
+    sizeof(LRUIter),         /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    (destructor)lru_iter_dealloc, /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    0,                       /* tp_compare */
+    0,                       /* tp_repr */
+    0,                       /* tp_as_number */
+    0,                       /* tp_as_sequence */
+    0,                       /* tp_as_mapping */
+    0,                       /* tp_hash */
+    0,                       /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    "TTLRU iterator",        /* tp_doc */
+    (traverseproc)lru_iter_traverse, /* tp_traverse */
+    (inquiry)lru_iter_clear, /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    PyObject_SelfIter,       /* tp_iter */
+    (iternextfunc)lru_iter_next, /* tp_iternext */
+};
+
+static PyObject *
+lru_iter_method(LRU *self, PyObject *args, PyObject *kwds, int kind)
+{
+    static char *kwlist[] = {"reverse", "reap", NULL};
+    int reverse = 0;
+    int reap = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|pp", kwlist, &reverse, &reap))
+        return NULL;
+    return lru_iter_new(self, kind, reverse, reap);
+}
+
+static PyObject *
+LRU_iterkeys(LRU *self, PyObject *args, PyObject *kwds)
+{
+    return lru_iter_method(self, args, kwds, ITER_KEYS);
+}
+
+static PyObject *
+LRU_itervalues(LRU *self, PyObject *args, PyObject *kwds)
+{
+    return lru_iter_method(self, args, kwds, ITER_VALUES);
+}
+
+static PyObject *
+LRU_iteritems(LRU *self, PyObject *args, PyObject *kwds)
+{
+    return lru_iter_method(self, args, kwds, ITER_ITEMS);
+}
+
+static PyObject *
+LRU_iter(LRU *self)
+{
+    return lru_iter_new(self, ITER_KEYS, 0, 0);
+}
+
+static PyObject *
+LRU_reversed(LRU *self)
+{
+    return lru_iter_new(self, ITER_KEYS, 1, 0);
+}
+
+/* A view only keeps the TTLRU, every iteration starts a new walk of the list. */
+typedef struct {
+    PyObject_HEAD
+    LRU *lru;
+    int kind;
+} LRUView;
+
+static PyTypeObject LRUViewType;
+
+static PyObject *
+lru_view_new(LRU *lru, int kind)
+{
+    LRUView *view = PyObject_GC_New(LRUView, &LRUViewType);
+
+    if (view == NULL)
+        return NULL;
+    Py_INCREF(lru);
+    view->lru = lru;
+    view->kind = kind;
+    PyObject_GC_Track(view);
+    return (PyObject *)view;
+}
+
+/* A view always has its TTLRU, a cycle through it is broken by the tp_clear of the TTLRU */
+static int
+lru_view_traverse(LRUView *view, visitproc visit, void *arg)
+{
+    Py_VISIT(view->lru);
+    return 0;
+}
+
+static void
+lru_view_dealloc(LRUView *view)
+{
+    PyObject_GC_UnTrack(view);
+    Py_DECREF(view->lru);
+    PyObject_GC_Del(view);
+}
+
+static Py_ssize_t
+lru_view_len(LRUView *view)
+{
+    Py_ssize_t len;
+
+    Py_BEGIN_CRITICAL_SECTION(view->lru);
+    len = LRU_length(view->lru);
+    Py_END_CRITICAL_SECTION();
+    return len;
+}
+
+static PyObject *
+lru_view_new_iter(LRUView *view, int reverse)
+{
+    PyObject *it;
+
+    Py_BEGIN_CRITICAL_SECTION(view->lru);
+    it = lru_iter_new(view->lru, view->kind, reverse, 0);
+    Py_END_CRITICAL_SECTION();
+    return it;
+}
+
+static PyObject *
+lru_view_iter(LRUView *view)
+{
+    return lru_view_new_iter(view, 0);
+}
+
+static PyObject *
+lru_view_reversed(LRUView *view)
+{
+    return lru_view_new_iter(view, 1);
+}
+
+/* Membership does not move the item, like "key in L". */
+static int
+lru_view_contains_unlocked(LRUView *view, PyObject *obj)
+{
+    LRU *lru = view->lru;
+    PyTime_t t_now = lru_now(lru);
+    Py_ssize_t ix;
+    Py_hash_t hash;
+    PyObject *value;
+    uint32_t curr;
+    int res;
+
+    switch (view->kind) {
+    case ITER_KEYS:
+        return LRU_contains_check_with_ttl(lru, obj);
+    case ITER_ITEMS:
+        if (!PyTuple_Check(obj) || PyTuple_GET_SIZE(obj) != 2)
+            return 0;
+        hash = PyObject_Hash(PyTuple_GET_ITEM(obj, 0));
+        if (hash == -1)
+            return -1;
+        ix = lru_lookup(lru, PyTuple_GET_ITEM(obj, 0), hash);
+        if (ix < 0)
+            return ix == -2 ? -1 : 0;
+        if (IS_EXPIRED(t_now, NODE(lru, ix)))
+            return 0;
+        value = NODE(lru, ix)->value;
+        Py_INCREF(value);
+        res = PyObject_RichCompareBool(value, PyTuple_GET_ITEM(obj, 1), Py_EQ);
+        Py_DECREF(value);
+        return res;
+    default:
+        for (curr = lru->first; curr != NIL; curr = NODE(lru, curr)->next) {
+            size_t version = lru->version;
+
+            if (IS_EXPIRED(t_now, NODE(lru, curr)))
+                continue;
+            value = NODE(lru, curr)->value;
+            Py_INCREF(value);
+            res = PyObject_RichCompareBool(value, obj, Py_EQ);
+            Py_DECREF(value);
+            if (res != 0)
+                return res;
+            if (version != lru->version) {
+                PyErr_SetString(PyExc_RuntimeError, "TTLRU changed during iteration");
+                return -1;
+            }
+        }
+        return 0;
+    }
+}
+
+static int
+lru_view_contains(LRUView *view, PyObject *obj)
+{
+    int res;
+
+    Py_BEGIN_CRITICAL_SECTION(view->lru);
+    res = lru_view_contains_unlocked(view, obj);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PySequenceMethods lru_view_as_sequence = {
+    (lenfunc)lru_view_len,          /* sq_length */
+    0,                              /* sq_concat */
+    0,                              /* sq_repeat */
+    0,                              /* sq_item */
+    0,                              /* sq_slice */
+    0,                              /* sq_ass_item */
+    0,                              /* sq_ass_slice */
+    (objobjproc)lru_view_contains,  /* sq_contains */
+};
+
+static PyMethodDef lru_view_methods[] = {
+    {"__reversed__", (PyCFunction)lru_view_reversed, METH_NOARGS,
+                    PyDoc_STR("V.__reversed__() -> iterator in LRU order")},
+    {NULL,	NULL},
+};
+
+static PyTypeObject LRUViewType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru.TTLRUView",       /* tp_name */
+    sizeof(LRUView),         /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    (destructor)lru_view_dealloc, /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    0,                       /* tp_compare */
+    0,                       /* tp_repr */
+    0,                       /* tp_as_number */
+    &lru_view_as_sequence,   /* tp_as_sequence */
+    0,                       /* tp_as_mapping */
+    0,                       /* tp_hash */
+    0,                       /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    "Live view of the keys, values or items of a TTLRU in MRU order", /* tp_doc */
+    (traverseproc)lru_view_traverse, /* tp_traverse */
+    0,                       /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    (getiterfunc)lru_view_iter, /* tp_iter */
+    0,                       /* tp_iternext */
+    lru_view_methods,        /* tp_methods */
+};
+
+static PyObject *
+LRU_keys_view(LRU *self)
+{
+    return lru_view_new(self, ITER_KEYS);
+}
+
+static PyObject *
+LRU_values_view(LRU *self)
+{
+    return lru_view_new(self, ITER_VALUES);
+}
+
+static PyObject *
+LRU_items_view(LRU *self)
+{
+    return lru_view_new(self, ITER_ITEMS);
+}
+
+LOCKED_LEN(LRU_length)
+LOCKED_O(lru_subscript)
+LOCKED_ASS(lru_ass_sub)
+LOCKED_CONTAINS(LRU_seq_contains)
+LOCKED_NOARGS(LRU_iter)
+LOCKED_O(LRU_contains_key)
+LOCKED_NOARGS(LRU_keys)
+LOCKED_NOARGS(LRU_values)
+LOCKED_NOARGS(LRU_items)
+LOCKED_KEYWORDS(LRU_iterkeys)
+LOCKED_KEYWORDS(LRU_itervalues)
+LOCKED_KEYWORDS(LRU_iteritems)
+LOCKED_NOARGS(LRU_reversed)
+LOCKED_FASTCALL(LRU_set_with_ttl)
+LOCKED_FASTCALL(LRU_get)
+LOCKED_FASTCALL(LRU_setdefault)
+LOCKED_FASTCALL(LRU_getset_with_default_factory)
+LOCKED_FASTCALL(LRU_pop)
+LOCKED_NOARGS(LRU_dumps)
+LOCKED_O(LRU_dump)
+LOCKED_O(LRU_loads)
+LOCKED_O(LRU_setstate)
+LOCKED_O(LRU_load)
+LOCKED_NOARGS(LRU_reduce)
+LOCKED_KEYWORDS(LRU_aget_or_load)
+LOCKED_KEYWORDS(LRU_popitem)
+LOCKED_KEYWORDS(LRU_set_size)
+LOCKED_NOARGS(LRU_clear)
+LOCKED_KEYWORDS(LRU_get_many)
+LOCKED_KEYWORDS(LRU_set_many)
+LOCKED_O(LRU_delete_many)
+LOCKED_VARARGS(LRU_tick)
+LOCKED_KEYWORDS(LRU_purge_expired)
+LOCKED_NOARGS(LRU_get_weight)
+LOCKED_NOARGS(LRU_get_stats)
+LOCKED_NOARGS(LRU_get_pool_stats)
+LOCKED_VARARGS(LRU_set_auto_purge)
+LOCKED_NOARGS(LRU_get_purge_stats)
+LOCKED_NOARGS(LRU_get_policy_stats)
+LOCKED_NOARGS(LRU_get_metrics)
+LOCKED_NOARGS(LRU_reset_metrics)
+LOCKED_VARARGS(LRU_set_latency_sample)
+LOCKED_VARARGS(LRU_set_notify)
+LOCKED_VARARGS(LRU_set_refresher)
+LOCKED_NOARGS(LRU_drain_evictions)
+LOCKED_NOARGS(LRU_get_notify_stats)
+LOCKED_KEYWORDS(LRU_set_missing)
+LOCKED_FASTCALL(LRU_lookup)
+LOCKED_NOARGS(LRU_get_missing_stats)
+LOCKED_KEYWORDS(LRU_touch)
+LOCKED_KEYWORDS(LRU_expire_at)
+LOCKED_O(LRU_ttl)
+LOCKED_KEYWORDS(LRU_set_tag)
+LOCKED_KEYWORDS(LRU_invalidate_tag)
+LOCKED_VARARGS(LRU_set_max_weight)
+LOCKED_NOARGS(LRU_peek_first_item)
+LOCKED_NOARGS(LRU_peek_last_item)
+LOCKED_KEYWORDS(LRU_update)
+LOCKED_VARARGS(LRU_set_callback)
+
+static PyMappingMethods LRU_as_mapping = {
+    (lenfunc)LOCKED(LRU_length),        /*mp_length*/
+    (binaryfunc)LOCKED(lru_subscript),  /*mp_subscript*/
+    (objobjargproc)LOCKED(lru_ass_sub), /*mp_ass_subscript*/
+};
+
+/* Hack to implement "key in lru" */
+static PySequenceMethods lru_as_sequence = {
+    0,                             /* sq_length */
+    0,                             /* sq_concat */
+    0,                             /* sq_repeat */
+    0,                             /* sq_item */
+    0,                             /* sq_slice */
+    0,                             /* sq_ass_item */
+    0,                             /* sq_ass_slice */
+    (objobjproc) LOCKED(LRU_seq_contains), /* sq_contains */
+    0,                             /* sq_inplace_concat */
+    0,                             /* sq_inplace_repeat */
+};
+
+static PyMethodDef LRU_methods[] = {
+    {"__contains__", (PyCFunction)LOCKED(LRU_contains_key), METH_O | METH_COEXIST,
+                    PyDoc_STR("L.__contains__(key) -> Check if key is there in L")},
+    {"keys", (PyCFunction)LOCKED(LRU_keys), METH_NOARGS,
+                    PyDoc_STR("L.keys() -> list of L's keys in MRU order")},
+    {"values", (PyCFunction)LOCKED(LRU_values), METH_NOARGS,
+                    PyDoc_STR("L.values() -> list of L's values in MRU order")},
+    {"items", (PyCFunction)LOCKED(LRU_items), METH_NOARGS,
+                    PyDoc_STR("L.items() -> list of L's items (key,value) in MRU order")},
+    {"keys_view", (PyCFunction)LRU_keys_view, METH_NOARGS,
+                    PyDoc_STR("L.keys_view() -> live view of L's keys in MRU order")},
+    {"values_view", (PyCFunction)LRU_values_view, METH_NOARGS,
+                    PyDoc_STR("L.values_view() -> live view of L's values in MRU order")},
+    {"items_view", (PyCFunction)LRU_items_view, METH_NOARGS,
+                    PyDoc_STR("L.items_view() -> live view of L's items (key,value) in MRU order")},
+    {"iterkeys", (PyCFunction)LOCKED(LRU_iterkeys), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.iterkeys(reverse=False, reap=False) -> iterator over L's keys in MRU order, or LRU order with reverse. With reap, expired items are removed on the way")},
+    {"itervalues", (PyCFunction)LOCKED(LRU_itervalues), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.itervalues(reverse=False, reap=False) -> iterator over L's values, see iterkeys()")},
+    {"iteritems", (PyCFunction)LOCKED(LRU_iteritems), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.iteritems(reverse=False, reap=False) -> iterator over L's items (key,value), see iterkeys()")},
+    {"__reversed__", (PyCFunction)LOCKED(LRU_reversed), METH_NOARGS,
+                    PyDoc_STR("L.__reversed__() -> iterator over L's keys in LRU order")},
+    {"has_key",	(PyCFunction)LOCKED(LRU_contains_key), METH_O,
+                    PyDoc_STR("L.has_key(key) -> Check if key is there in L")},
+    {"set_with_ttl", (PyCFunction)(void(*)(void))LOCKED(LRU_set_with_ttl), METH_FASTCALL,
+                    PyDoc_STR("L.set_with_ttl(key, value, ttl[, tag]) -> Set key to value with a ttl, and tag it for invalidate_tag() when tag is given")},                
+    {"get",	(PyCFunction)(void(*)(void))LOCKED(LRU_get), METH_FASTCALL,
+                    PyDoc_STR("L.get(key, [, value]) -> If L has key return its value, otherwise instead")},
+    {"setdefault", (PyCFunction)(void(*)(void))LOCKED(LRU_setdefault), METH_FASTCALL,
+                    PyDoc_STR("L.setdefault(key, default=None) -> If L has key return its value, otherwise insert key with a value of default and return default")},
+    {"getset_with_default_factory", (PyCFunction)(void(*)(void))LOCKED(LRU_getset_with_default_factory), METH_FASTCALL,
+                    PyDoc_STR("L.getset_with_default_factory(key, default_factory) -> If L has key return its value, otherwise insert key with a new value from default_factory and return it")},
+    {"get_or_load", (PyCFunction)LRU_get_or_load, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.get_or_load(key, loader, ttl=None, error_ttl=None) -> If L has key return its value, otherwise call loader() once for all the threads that miss on key at the same time, insert and return its value. Its exception is raised in all of them, and with error_ttl raised again without loading for error_ttl ns")},
+    {"aget_or_load", (PyCFunction)LOCKED(LRU_aget_or_load), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.aget_or_load(key, loader, ttl=None, error_ttl=None) -> future of the value of key, already done on a hit. On a miss loader() is awaited in one task shared by all the coroutines that miss on key at the same time")},
+    {"dumps", (PyCFunction)LOCKED(LRU_dumps), METH_NOARGS,
+                    PyDoc_STR("L.dumps() -> bytes snapshot of the items that are not expired, in LRU order and with their remaining ttl")},
+    {"dump", (PyCFunction)LOCKED(LRU_dump), METH_O,
+                    PyDoc_STR("L.dump(file) -> write the snapshot of dumps() to a path or to a binary file object")},
+    {"loads", (PyCFunction)LOCKED(LRU_loads), METH_O,
+                    PyDoc_STR("L.loads(data) -> insert the items of a snapshot in their order, less the time since the dump is taken off their ttl")},
+    {"load", (PyCFunction)LOCKED(LRU_load), METH_O,
+                    PyDoc_STR("L.load(file) -> insert the items of a snapshot from a path, which is mapped with mmap, or from a binary file object")},
+    {"__reduce__", (PyCFunction)LOCKED(LRU_reduce), METH_NOARGS, NULL},
+    {"__setstate__", (PyCFunction)LOCKED(LRU_setstate), METH_O, NULL},
+    {"pop", (PyCFunction)(void(*)(void))LOCKED(LRU_pop), METH_FASTCALL,
+                    PyDoc_STR("L.pop(key[, default]) -> If L has key return its value and remove it from L, otherwise return default. If default is not given and key is not in L, a KeyError is raised.")},
+    {"set_missing", (PyCFunction)LOCKED(LRU_set_missing), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.set_missing(key, ttl=None) -> remember that key is absent, for ttl ns or the default ttl. The value of key is removed, setting one removes the negative entry")},
+    {"lookup", (PyCFunction)(void(*)(void))LOCKED(LRU_lookup), METH_FASTCALL,
+                    PyDoc_STR("L.lookup(key[, default]) -> like get(), but ttlru.MISSING for a key set with set_missing()")},
+    {"get_missing_stats", (PyCFunction)LOCKED(LRU_get_missing_stats), METH_NOARGS,
+                    PyDoc_STR("L.get_missing_stats() -> (count, hits, evicted, expired) of the negative entries")},
+    {"touch", (PyCFunction)LOCKED(LRU_touch), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.touch(key, ttl=None) -> set the ttl of key to ttl ns from now, or the default ttl, without rewriting its value. False if key is not there")},
+    {"expire_at", (PyCFunction)LOCKED(LRU_expire_at), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.expire_at(key, ts) -> make key expire at ts, a time of L.now(), or never with -1. False if key is not there")},
+    {"ttl", (PyCFunction)LOCKED(LRU_ttl), METH_O,
+                    PyDoc_STR("L.ttl(key) -> remaining ttl of key in ns, -1 if it does not expire, None if key is not there")},
+    {"set_tag", (PyCFunction)LOCKED(LRU_set_tag), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.set_tag(key, tag) -> tag key for invalidate_tag(), None removes its tag. False if key is not there")},
+    {"invalidate_tag", (PyCFunction)LOCKED(LRU_invalidate_tag), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.invalidate_tag(tag) -> remove the items tagged with tag, without calling the callback, and return their number")},
+    {"popitem", (PyCFunction)LOCKED(LRU_popitem), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.popitem([least_recent=True]) -> Returns and removes a (key, value) pair. The pair returned is the least-recently used if least_recent is true, or the most-recently used if false.")},
+    {"set_size", (PyCFunction)LOCKED(LRU_set_size), METH_VARARGS,
+                    PyDoc_STR("L.set_size() -> set size of LRU")},
+    {"get_size", (PyCFunction)LRU_get_size, METH_NOARGS,
+                    PyDoc_STR("L.get_size() -> get size of LRU")},
+    {"set_max_weight", (PyCFunction)LOCKED(LRU_set_max_weight), METH_VARARGS,
+                    PyDoc_STR("L.set_max_weight(max_weight) -> set the weight limit, evicting items until the total weight fits")},
+    {"get_max_weight", (PyCFunction)LRU_get_max_weight, METH_NOARGS,
+                    PyDoc_STR("L.get_max_weight() -> the weight limit, 0 if there is none")},
+    {"get_weight", (PyCFunction)LOCKED(LRU_get_weight), METH_NOARGS,
+                    PyDoc_STR("L.get_weight() -> the total weight of the items")},
+    {"clear", (PyCFunction)LOCKED(LRU_clear), METH_NOARGS,
+                    PyDoc_STR("L.clear() -> clear LRU")},
+    {"get_stats", (PyCFunction)LOCKED(LRU_get_stats), METH_NOARGS,
+                    PyDoc_STR("L.get_stats() -> returns a tuple with cache hits and misses")},
+    {"get_many", (PyCFunction)LOCKED(LRU_get_many), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.get_many(keys, default=None, as_dict=False) -> list of the values of keys, default for missing keys. With as_dict, a dict of the keys that are in L")},
+    {"set_many", (PyCFunction)LOCKED(LRU_set_many), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.set_many(items[, ttl]) -> set all items of a dict or of an iterable of (key, value) or (key, value, ttl)")},
+    {"delete_many", (PyCFunction)LOCKED(LRU_delete_many), METH_O,
+                    PyDoc_STR("L.delete_many(keys) -> delete keys from L, missing keys are skipped. Returns the number of deleted keys")},
+    {"from_items", (PyCFunction)LRU_from_items, METH_VARARGS | METH_KEYWORDS | METH_CLASS,
+                    PyDoc_STR("TTLRU.from_items(items, size=len(items), ...) -> new TTLRU loaded with items, the other arguments are passed to TTLRU()")},
+    {"tick", (PyCFunction)LOCKED(LRU_tick), METH_VARARGS,
+                    PyDoc_STR("L.tick([now]) -> move the tick clock to now, or to the current monotonic time. Returns the new time")},
+    {"now", (PyCFunction)LRU_now, METH_NOARGS,
+                    PyDoc_STR("L.now() -> current time of the clock of L in nanoseconds")},
+    {"get_pool_stats", (PyCFunction)LOCKED(LRU_get_pool_stats), METH_NOARGS,
+                    PyDoc_STR("L.get_pool_stats() -> returns a dict with the node pool capacity, the used and free nodes, the number of times the pool grew and the number of reused nodes")},
+    {"get_policy_stats", (PyCFunction)LOCKED(LRU_get_policy_stats), METH_NOARGS,
+                    PyDoc_STR("L.get_policy_stats() -> returns a dict with the policy, the number of items per segment and, for tinylfu, how often the window candidate was admitted or rejected")},
+    {"get_metrics", (PyCFunction)LOCKED(LRU_get_metrics), METH_NOARGS,
+                    PyDoc_STR("L.get_metrics() -> returns a dict with the hit, miss, insert, update and delete counters, the evictions and expirations by cause, the number of items and of expired items and, when sampling is on, the latency histograms")},
+    {"reset_metrics", (PyCFunction)LOCKED(LRU_reset_metrics), METH_NOARGS,
+                    PyDoc_STR("L.reset_metrics() -> set all the counters of get_metrics() to zero")},
+    {"set_latency_sample", (PyCFunction)LOCKED(LRU_set_latency_sample), METH_VARARGS,
+                    PyDoc_STR("L.set_latency_sample(n) -> time one get and one set out of n into the latency histograms, 0 turns it off")},
+    {"purge_expired", (PyCFunction)LOCKED(LRU_purge_expired), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.purge_expired(max_items=None, max_ns=None) -> remove expired items, earliest first, until none is left or the budget is used up. Returns the number of removed items")},
+    {"set_notify", (PyCFunction)LOCKED(LRU_set_notify), METH_VARARGS,
+                    PyDoc_STR("L.set_notify(mode, max_records=0) -> 'call' calls the callback with (key, value) on every eviction, 'batch' calls it with a list of (key, value, reason) when the call that evicted returns and 'queue' keeps the evictions for drain_evictions(). With max_records, the oldest queued evictions are dropped")},
+    {"set_refresher", (PyCFunction)LOCKED(LRU_set_refresher), METH_VARARGS,
+                    PyDoc_STR("L.set_refresher(refresher, soft_ttl) -> items inserted or updated from now on go stale soft_ttl ns later. The first read of a stale item still returns its value and calls refresher(key, value), when that returns a future its result replaces the value. None turns it off")},
+    {"drain_evictions", (PyCFunction)LOCKED(LRU_drain_evictions), METH_NOARGS,
+                    PyDoc_STR("L.drain_evictions() -> remove and return the queued evictions, a list of (key, value, reason) with reason 'capacity', 'weight' or 'expired'")},
+    {"get_notify_stats", (PyCFunction)LOCKED(LRU_get_notify_stats), METH_NOARGS,
+                    PyDoc_STR("L.get_notify_stats() -> returns a tuple with the number of queued evictions and of the dropped ones")},
+    {"set_auto_purge", (PyCFunction)LOCKED(LRU_set_auto_purge), METH_VARARGS,
+                    PyDoc_STR("L.set_auto_purge(n) -> remove up to n expired items on every insert, update or delete, 0 turns it off")},
+    {"get_purge_stats", (PyCFunction)LOCKED(LRU_get_purge_stats), METH_NOARGS,
+                    PyDoc_STR("L.get_purge_stats() -> returns a tuple with the number of items removed by purge_expired and by auto purge")},
+    {"peek_first_item", (PyCFunction)LOCKED(LRU_peek_first_item), METH_NOARGS,
+                    PyDoc_STR("L.peek_first_item() -> returns the MRU item (key,value) without changing key order")},
+    {"peek_last_item", (PyCFunction)LOCKED(LRU_peek_last_item), METH_NOARGS,
+                    PyDoc_STR("L.peek_last_item() -> returns the LRU item (key,value) without changing key order")},
+    {"update", (PyCFunction)LOCKED(LRU_update), METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("L.update() -> update value for key in LRU")},
+    {"set_callback", (PyCFunction)LOCKED(LRU_set_callback), METH_VARARGS,
+                    PyDoc_STR("L.set_callback(callback) -> set a callback to call when an item is evicted.")},
+    {NULL,	NULL},
+};
+
+/* The pairs are taken first, building the dict may run __hash__ and __eq__ of the keys. */
+static PyObject*
+LRU_repr(LRU* self)
+{
+    PyObject *items, *item, *dict;
+    PyObject *result = NULL;
+    size_t version = self->version;
+    Py_ssize_t i = 0;
+    uint32_t curr;
+
+    items = PyList_New(lru_length(self));
+    if (items == NULL)
+        return NULL;
+    for (curr = self->first; curr != NIL; curr = NODE(self, curr)->next) {
+        item = get_item(NODE(self, curr));
+        if (item == NULL)
+            goto done;
+        PyList_SET_ITEM(items, i++, item);
+        if (self->version != version) {
+            PyErr_SetString(PyExc_RuntimeError, "TTLRU changed during repr");
+            goto done;
+        }
+    }
+    dict = PyDict_New();
+    if (dict == NULL)
+        goto done;
+    if (PyDict_MergeFromSeq2(dict, items, 1) == 0)
+        result = PyObject_Repr(dict);
+    Py_DECREF(dict);
+done:
+    Py_DECREF(items);
+    return result;
+}
+
+LOCKED_NOARGS(LRU_repr)
+
+static int
+LRU_init(LRU *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "callback", "ttl", "auto_purge", "preallocate", "clock",
+                             "policy", "approximate", "max_weight", "weigher", "notify",
+                             "max_missing", "expire_after_access", NULL};
+    PyObject *callback = NULL;
+    PyObject *weigher = NULL;
+    const char *clock = "monotonic";
+    const char *policy = "lru";
+    const char *notify = "call";
+    self->callback = NULL;
+    self->default_ttl = -1;
+    self->auto_purge = 0;
+    self->preallocate = 0;
+    self->approximate = 0;
+    self->max_weight = 0;
+    self->weigher = NULL;
+    self->weights = NULL;
+    self->ring = NULL;
+    self->ring_cap = self->ring_head = self->ring_len = 0;
+    self->ring_max = self->ring_dropped = 0;
+    self->notify_hold = 0;
+    self->flights = self->aflights = self->failures = NULL;
+    self->refresher = self->refresh_key = NULL;
+    self->soft_ttl = -1;
+    self->refresh_token = -1;
+    self->refresh_seq = 0;
+    self->ttls = NULL;
+    self->missing = NULL;
+    self->missing_used = 0;
+    self->max_missing = -1;
+    self->missing_hand = 0;
+    self->missing_hits = self->missing_evicted = self->missing_expired = 0;
+    self->expire_after_access = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|OLnpsspnOsnL", kwlist, &self->size, &callback,
+                                     &self->default_ttl, &self->auto_purge, &self->preallocate,
+                                     &clock, &policy, &self->approximate, &self->max_weight,
+                                     &weigher, &notify, &self->max_missing,
+                                     &self->expire_after_access)) {
+        return -1;
+    }
+    self->notify = notify_from_name(notify);
+    if (self->notify < 0)
+        return -1;
+    self->clock = clock_from_name(clock);
+    if (self->clock < 0)
+        return -1;
+    self->policy = policy_from_name(policy);
+    if (self->policy < 0)
+        return -1;
+    if (self->approximate && self->policy != POLICY_LRU) {
+        PyErr_SetString(PyExc_ValueError, "approximate needs policy='lru'");
+        return -1;
+    }
+    self->clock_now = clock_monotonic();
+
+    if (callback && callback != Py_None) {
+        if (!PyCallable_Check(callback)) {
+            PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+            return -1;
+        }
+        Py_XINCREF(callback);
+        self->callback = callback;
+    }
+
+    if ((Py_ssize_t)self->size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        return -1;
+    }
+    if (self->max_weight < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_weight should not be negative");
+        return -1;
+    }
+    if (weigher && weigher != Py_None) {
+        if (!self->max_weight) {
+            PyErr_SetString(PyExc_ValueError, "weigher needs max_weight");
+            return -1;
+        }
+        if (!PyCallable_Check(weigher)) {
+            PyErr_SetString(PyExc_TypeError, "weigher must be callable");
+            return -1;
+        }
+        Py_INCREF(weigher);
+        self->weigher = weigher;
+    }
+    if (self->auto_purge < 0) {
+        PyErr_SetString(PyExc_ValueError, "auto_purge should not be negative");
+        return -1;
+    }
+    if (self->expire_after_access < 0) {
+        PyErr_SetString(PyExc_ValueError, "expire_after_access should not be negative");
+        return -1;
+    }
+    self->nodes = NULL;
+    self->nodes_cap = self->nodes_top = 0;
+    self->free = NIL;
+    self->first = self->last = NIL;
+    self->heap = NULL;
+    self->heap_len = self->heap_cap = 0;
+    self->table = NULL;
+    self->pool_grows = self->pool_reused = 0;
+    self->ghost = self->sketch = self->door = NULL;
+    self->ghost_seq = 0;
+    self->policy_admitted = self->policy_rejected = 0;
+    self->tag_links = NULL;
+    self->tags = NULL;
+    self->tags_cap = self->tags_used = self->tags_live = 0;
+    self->tags_free = NIL;
+    self->tag_ids = NULL;
+    if (policy_resize(self) != 0)
+        return -1;
+    if (lru_reset(self) != 0)
+        return -1;
+    if (self->preallocate && lru_preallocate(self) != 0)
+        return -1;
+    self->purged = self->auto_purged = 0;
+    self->iterators = 0;
+    self->hits = 0;
+    self->misses = 0;
+    memset(&self->metrics, 0, sizeof(self->metrics));
+    self->latency_sample = self->latency_tick = 0;
+    return 0;
+}
+
+/*
+ * The nodes are not objects and are not tracked by the GC, only the TTLRU is.
+ * tp_traverse walks the node array in place, free nodes have no key.
+ */
+static int
+LRU_traverse(LRU *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->nodes_top; i++) {
+        Py_VISIT(self->nodes[i].key);
+        Py_VISIT(self->nodes[i].value);
+    }
+    for (i = 0; i < self->ring_len; i++) {
+        Eviction *ev = &self->ring[(self->ring_head + i) & (self->ring_cap - 1)];
+
+        Py_VISIT(ev->key);
+        Py_VISIT(ev->value);
+    }
+    if (self->missing) {
+        for (i = 0; (size_t)i <= self->missing_mask; i++)
+            Py_VISIT(self->missing[i].key);
+    }
+    for (i = 0; i < self->tags_cap; i++)
+        Py_VISIT(self->tags[i].tag);
+    Py_VISIT(self->tag_ids);
+    Py_VISIT(self->callback);
+    Py_VISIT(self->weigher);
+    Py_VISIT(self->refresher);
+    Py_VISIT(self->refresh_key);
+    Py_VISIT(self->flights);
+    Py_VISIT(self->aflights);
+    Py_VISIT(self->failures);
+    return 0;
+}
+
+/* Break a cycle: drop the items and the callbacks, the TTLRU stays usable and empty. */
+static int
+LRU_tp_clear(LRU *self)
+{
+    ring_free(self);
+    missing_clear(self);
+    tag_reset(self);
+    if (self->table && lru_reset(self) != 0)
+        PyErr_Clear();
+    Py_CLEAR(self->callback);
+    Py_CLEAR(self->weigher);
+    Py_CLEAR(self->refresher);
+    Py_CLEAR(self->refresh_key);
+    Py_CLEAR(self->flights);
+    Py_CLEAR(self->aflights);
+    Py_CLEAR(self->failures);
+    return 0;
+}
+
+static void
+LRU_dealloc(LRU *self)
+{
+    Py_ssize_t i;
+
+    PyObject_GC_UnTrack(self);
+    if (self->table) {
+        for (i = 0; i < self->nodes_top; i++) {
+            if (self->nodes[i].key) {
+                Py_DECREF(self->nodes[i].key);
+                Py_DECREF(self->nodes[i].value);
+            }
+        }
+        PyMem_Free(self->nodes);
+        PyMem_Free(self->table);
+        PyMem_Free(self->heap);
+    }
+    PyMem_Free(self->ghost);
+    PyMem_Free(self->sketch);
+    PyMem_Free(self->door);
+    PyMem_Free(self->weights);
+    PyMem_Free(self->ttls);
+    ring_free(self);
+    missing_clear(self);
+    tag_reset(self);
+    Py_XDECREF(self->flights);
+    Py_XDECREF(self->aflights);
+    Py_XDECREF(self->failures);
+    Py_XDECREF(self->refresher);
+    Py_XDECREF(self->refresh_key);
+    Py_XDECREF(self->weigher);
+    Py_XDECREF(self->callback);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(lru_doc,
+"TTLRU(size, callback=None, ttl=-1, auto_purge=0, preallocate=False, clock='monotonic', policy='lru', approximate=False, max_weight=0, weigher=None, notify='call', max_missing=-1, expire_after_access=0) -> new TTLRU dict that can store up to size elements\n"
+"A TTLRU dict behaves like a standard dict, except that it stores only fixed\n"
+"set of elements. Once the size overflows, it evicts least recently used\n"
+"items.  If a callback is set it will call the callback with the evicted key\n"
+" and item.\n\n"
+"Eg:\n"
+">>> l = TTLRU(3)\n"
+">>> for i in range(5):\n"
+">>>   l[i] = str(i)\n"
+">>> l.keys()\n"
+"[2,3,4]\n\n"
+"Note: A TTLRU(n) can be thought of as a dict that will have the most\n"
+"recently accessed n items.\n\n"
+"If auto_purge is set, every insert, update or delete also removes up to\n"
+"auto_purge expired items. If preallocate is true, the memory for size items\n"
+"is allocated up front and kept by clear().\n\n"
+"clock picks the time source of the ttl: 'monotonic', 'coarse' (the coarse\n"
+"monotonic clock of the kernel), 'tick' (only moves on L.tick()) or 'system'\n"
+"(the wall clock).\n\n"
+"policy picks the eviction policy: 'lru', 'slru' (segmented LRU), '2q' or\n"
+"'tinylfu' (W-TinyLFU). The last three keep items that are used again and\n"
+"again when many keys are only used once. With approximate, the lru policy\n"
+"uses the CLOCK algorithm: a read only marks the item and the order is fixed\n"
+"up when an item is evicted.\n\n"
+"With max_weight, items are also evicted until their total weight fits in\n"
+"max_weight. weigher(key, value) gives the weight of an item, without it the\n"
+"weight is an estimate of the bytes used by the item.\n\n"
+"set_missing() keeps up to max_missing negative entries, keys known to be\n"
+"absent, apart from the items. -1 is size, 0 turns them off.\n\n"
+"With expire_after_access, a read of an item that has a ttl pushes its expire\n"
+"time to at least expire_after_access ns later.\n");
+
+static PyTypeObject LRUType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru.TTLRU",           /* tp_name */
+    sizeof(LRU),             /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    (destructor)LRU_dealloc, /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    0,                       /* tp_compare */
+    (reprfunc)LOCKED(LRU_repr), /* tp_repr */
+    0,                       /* tp_as_number */
+    &lru_as_sequence,        /* tp_as_sequence */
+    &LRU_as_mapping,         /* tp_as_mapping */
+    0,                       /* tp_hash */
+    0,                       /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    lru_doc,                 /* tp_doc */
+    (traverseproc)LRU_traverse, /* tp_traverse */
+    (inquiry)LRU_tp_clear,   /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    (getiterfunc)LOCKED(LRU_iter), /* tp_iter */
+    0,                       /* tp_iternext */
+    LRU_methods,             /* tp_methods */
+    0,                       /* tp_members */
+    0,                       /* tp_getset */
+    0,                       /* tp_base */
+    0,                       /* tp_dict */
+    0,                       /* tp_descr_get */
+    0,                       /* tp_descr_set */
+    0,                       /* tp_dictoffset */
+    (initproc)LRU_init,      /* tp_init */
+    0,                       /* tp_alloc */
+    0,                       /* tp_new */
+};
+
+/*
+ * ShardedTTLRU spreads the keys over a fixed number of TTLRU shards of
+ * size / shards items each. An operation hashes the key once, picks the shard
+ * from the hash and only holds the lock of that shard, so on free-threaded
+ * builds threads working on different shards do not contend. The LRU order,
+ * the size and the stats are per shard.
+ */
+typedef struct {
+    PyObject_HEAD
+    Py_ssize_t size;
+    Py_ssize_t nshards;
+    LRU **shards;
+} ShardedLRU;
+
+#define SHARD_LOCKED(shard, stmt) do { \
+    Py_BEGIN_CRITICAL_SECTION(shard); \
+    stmt; \
+    Py_END_CRITICAL_SECTION(); \
+} while (0)
+
+static LRU *
+sharded_shard(ShardedLRU *self, Py_hash_t hash)
+{
+    /* Fibonacci hashing, the table of the shard uses the low bits of hash */
+    uint64_t h = (uint64_t)hash * UINT64_C(0x9E3779B97F4A7C15);
+
+    return self->shards[(h >> 32) % (uint64_t)self->nshards];
+}
+
+static void
+sharded_free_shards(ShardedLRU *self)
+{
+    Py_ssize_t i;
+
+    if (self->shards) {
+        for (i = 0; i < self->nshards; i++)
+            Py_XDECREF(self->shards[i]);
+        PyMem_Free(self->shards);
+        self->shards = NULL;
+    }
+    self->nshards = 0;
+}
+
+static Py_ssize_t
+Sharded_length(ShardedLRU *self)
+{
+    Py_ssize_t i, len, total = 0;
+
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], len = LRU_length(self->shards[i]));
+        total += len;
+    }
+    return total;
+}
+
+static int
+Sharded_seq_contains(ShardedLRU *self, PyObject *key)
+{
+    Py_hash_t hash = PyObject_Hash(key);
+    LRU *shard;
+    int res;
+
+    if (hash == -1)
+        return -1;
+    shard = sharded_shard(self, hash);
+    SHARD_LOCKED(shard, res = lru_contains(shard, key, hash));
+    return res;
+}
+
+static PyObject *
+Sharded_contains_key(ShardedLRU *self, PyObject *key)
+{
+    int res = Sharded_seq_contains(self, key);
+
+    if (res < 0)
+        return NULL;
+    return PyBool_FromLong(res);
+}
+
+static PyObject *
+sharded_get_item(ShardedLRU *self, PyObject *key)
+{
+    PyTime_t t_now = TIME_UNSET;
+    PyObject *result;
+    Py_hash_t hash = PyObject_Hash(key);
+    LRU *shard;
+
+    if (hash == -1)
+        return NULL;
+    shard = sharded_shard(self, hash);
+    SHARD_LOCKED(shard, result = lru_get_item(shard, key, hash, &t_now));
+    return result;
+}
+
+static PyObject *
+Sharded_subscript(ShardedLRU *self, PyObject *key)
+{
+    PyObject *result = sharded_get_item(self, key);
+
+    if (!result && !PyErr_Occurred())
+        PyErr_SetObject(PyExc_KeyError, key);
+    return result;
+}
+
+static int
+sharded_set_item(ShardedLRU *self, PyObject *key, PyObject *value, PyObject *ttl_obj)
+{
+    PyTime_t t_now = TIME_UNSET;
+    PyTime_t ttl = 0;
+    Py_hash_t hash;
+    LRU *shard;
+    int res;
+
+    if (ttl_obj) {
+        ttl = PyLong_AsLongLong(ttl_obj);
+        if (ttl == -1 && PyErr_Occurred())
+            return -1;
+    }
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return -1;
+    shard = sharded_shard(self, hash);
+    SHARD_LOCKED(shard, res = lru_set_item(shard, key, hash, value,
+                                           ttl_obj ? ttl : shard->default_ttl, &t_now));
+    return res;
+}
+
+static int
+Sharded_ass_sub(ShardedLRU *self, PyObject *key, PyObject *value)
+{
+    return sharded_set_item(self, key, value, NULL);
+}
+
+static PyObject *
+Sharded_get(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *default_obj;
+    PyObject *result;
+
+    if (!check_nargs("get", nargs, 1, 2))
+        return NULL;
+    result = sharded_get_item(self, args[0]);
+    if (result || PyErr_Occurred())
+        return result;
+    default_obj = nargs > 1 ? args[1] : Py_None;
+    Py_INCREF(default_obj);
+    return default_obj;
+}
+
+static PyObject *
+Sharded_set_with_ttl(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyTime_t ttl;
+    Py_hash_t hash;
+    LRU *shard;
+    int res;
+
+    if (!check_nargs("set_with_ttl", nargs, 3, 4))
+        return NULL;
+    if (nargs == 3) {
+        if (sharded_set_item(self, args[0], args[1], args[2]) != 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+    ttl = PyLong_AsLongLong(args[2]);
+    if (ttl == -1 && PyErr_Occurred())
+        return NULL;
+    hash = PyObject_Hash(args[0]);
+    if (hash == -1)
+        return NULL;
+    shard = sharded_shard(self, hash);
+    /* the set and the tag happen under one lock */
+    SHARD_LOCKED(shard, res = lru_set_tagged(shard, args[0], hash, args[1], ttl, args[3]));
+    if (res != 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Sharded_setdefault(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyTime_t t_now = TIME_UNSET;
+    PyObject *key;
+    PyObject *default_obj;
+    PyObject *result;
+    Py_hash_t hash;
+    LRU *shard;
+
+    if (!check_nargs("setdefault", nargs, 1, 2))
+        return NULL;
+    key = args[0];
+    default_obj = nargs > 1 ? args[1] : Py_None;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    shard = sharded_shard(self, hash);
+    /* the lookup and the insert happen under one lock */
+    Py_BEGIN_CRITICAL_SECTION(shard);
+    result = lru_get_item(shard, key, hash, &t_now);
+    if (!result && !PyErr_Occurred()) {
+        if (lru_set_item(shard, key, hash, default_obj, shard->default_ttl, &t_now) == 0) {
+            Py_INCREF(default_obj);
+            result = default_obj;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+static PyObject *
+Sharded_pop(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *key;
+    PyObject *default_obj;
+    PyObject *result;
+    Py_hash_t hash;
+    LRU *shard;
+
+    if (!check_nargs("pop", nargs, 1, 2))
+        return NULL;
+    key = args[0];
+    default_obj = nargs > 1 ? args[1] : NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        return NULL;
+    shard = sharded_shard(self, hash);
+    SHARD_LOCKED(shard, result = lru_pop(shard, key, hash, default_obj));
+    return result;
+}
+
+/* The shard of the key, the first argument, or NULL with an exception set */
+static LRU *
+sharded_key_shard(ShardedLRU *self, PyObject *args)
+{
+    Py_hash_t hash;
+
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "missing key argument");
+        return NULL;
+    }
+    hash = PyObject_Hash(PyTuple_GET_ITEM(args, 0));
+    if (hash == -1)
+        return NULL;
+    return sharded_shard(self, hash);
+}
+
+/* The methods whose first argument is the key, on the shard of the key */
+static PyObject *
+sharded_by_key(ShardedLRU *self, PyObject *args, PyObject *kwds,
+             PyObject *(*method)(LRU *, PyObject *, PyObject *))
+{
+    PyObject *result;
+    LRU *shard = sharded_key_shard(self, args);
+
+    if (shard == NULL)
+        return NULL;
+    SHARD_LOCKED(shard, result = method(shard, args, kwds));
+    return result;
+}
+
+static PyObject *
+Sharded_get_or_load(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    LRU *shard = sharded_key_shard(self, args);
+
+    /* it locks the shard itself, not around the loader */
+    return shard ? LRU_get_or_load(shard, args, kwds) : NULL;
+}
+
+static PyObject *
+Sharded_set_missing(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_by_key(self, args, kwds, LRU_set_missing);
+}
+
+static PyObject *
+Sharded_touch(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_by_key(self, args, kwds, LRU_touch);
+}
+
+static PyObject *
+Sharded_expire_at(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_by_key(self, args, kwds, LRU_expire_at);
+}
+
+static PyObject *
+Sharded_set_tag(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_by_key(self, args, kwds, LRU_set_tag);
+}
+
+static PyObject *
+Sharded_ttl(ShardedLRU *self, PyObject *key)
+{
+    PyObject *result;
+    Py_hash_t hash = PyObject_Hash(key);
+    LRU *shard;
+
+    if (hash == -1)
+        return NULL;
+    shard = sharded_shard(self, hash);
+    SHARD_LOCKED(shard, result = LRU_ttl(shard, key));
+    return result;
+}
+
+static PyObject *
+Sharded_lookup(ShardedLRU *self, PyObject *const *args, Py_ssize_t nargs)
+{
+    PyObject *result;
+    Py_hash_t hash;
+    LRU *shard;
+
+    if (!check_nargs("lookup", nargs, 1, 2))
+        return NULL;
+    hash = PyObject_Hash(args[0]);
+    if (hash == -1)
+        return NULL;
+    shard = sharded_shard(self, hash);
+    SHARD_LOCKED(shard, result = LRU_lookup(shard, args, nargs));
+    return result;
+}
+
+static PyObject *
+Sharded_aget_or_load(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_by_key(self, args, kwds, LRU_aget_or_load);
+}
+
+/* Concatenate the lists of all the shards, each in its own MRU order. */
+static PyObject *
+sharded_collect(ShardedLRU *self, PyObject *(*getter)(Node *))
+{
+    PyObject *list = PyList_New(0);
+    PyObject *part;
+    Py_ssize_t i;
+
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], part = collect(self->shards[i], getter));
+        if (part == NULL ||
+            PyList_SetSlice(list, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX, part) != 0) {
+            Py_XDECREF(part);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(part);
+    }
+    return list;
+}
+
+static PyObject *
+Sharded_keys(ShardedLRU *self)
+{
+    return sharded_collect(self, get_key);
+}
+
+static PyObject *
+Sharded_values(ShardedLRU *self)
+{
+    return sharded_collect(self, get_value);
+}
+
+static PyObject *
+Sharded_items(ShardedLRU *self)
+{
+    return sharded_collect(self, get_item);
+}
+
+static PyObject *
+Sharded_drain_evictions(ShardedLRU *self)
+{
+    PyObject *list = PyList_New(0);
+    PyObject *part;
+    Py_ssize_t i;
+
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], part = ring_take(self->shards[i]));
+        if (part == NULL ||
+            PyList_SetSlice(list, PY_SSIZE_T_MAX, PY_SSIZE_T_MAX, part) != 0) {
+            Py_XDECREF(part);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(part);
+    }
+    return list;
+}
+
+static PyObject *
+Sharded_clear(ShardedLRU *self)
+{
+    Py_ssize_t i;
+    PyObject *res;
+
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], res = LRU_clear(self->shards[i]));
+        if (res == NULL)
+            return NULL;
+        Py_DECREF(res);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Sharded_get_size(ShardedLRU *self)
+{
+    return Py_BuildValue("n", self->size);
+}
+
+static PyObject *
+Sharded_set_size(ShardedLRU *self, PyObject *args)
+{
+    Py_ssize_t newSize, per_shard, i;
+    int res;
+
+    if (!PyArg_ParseTuple(args, "n", &newSize))
+        return NULL;
+    if (newSize < self->nshards) {
+        PyErr_SetString(PyExc_ValueError, "Size should not be less than the number of shards");
+        return NULL;
+    }
+    per_shard = (newSize + self->nshards - 1) / self->nshards;
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], res = lru_set_size(self->shards[i], per_shard));
+        if (res != 0)
+            return NULL;
+    }
+    self->size = newSize;
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+Sharded_get_stats(ShardedLRU *self)
+{
+    Py_ssize_t i, hits = 0, misses = 0;
+
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], {
+            hits += self->shards[i]->hits;
+            misses += self->shards[i]->misses;
+        });
+    }
+    return Py_BuildValue("nn", hits, misses);
+}
+
+static PyObject *
+Sharded_get_weight(ShardedLRU *self)
+{
+    Py_ssize_t i, weight = 0;
+
+    for (i = 0; i < self->nshards; i++)
+        SHARD_LOCKED(self->shards[i], weight += self->shards[i]->total_weight);
+    return PyLong_FromSsize_t(weight);
+}
+
+static PyObject *
+Sharded_get_shard_stats(ShardedLRU *self)
+{
+    PyObject *list = PyList_New(self->nshards);
+    PyObject *stats;
+    LRU *shard;
+    Py_ssize_t i;
+
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        shard = self->shards[i];
+        SHARD_LOCKED(shard, stats = Py_BuildValue("nnn", shard->hits, shard->misses,
+                                                  lru_length(shard)));
+        if (stats == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, stats);
+    }
+    return list;
+}
+
+/* Run a TTLRU method on every shard in turn and sum its integer results. */
+static PyObject *
+sharded_sum(ShardedLRU *self, PyObject *(*method)(LRU *, PyObject *, PyObject *),
+            PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t i, count, total = 0;
+    PyObject *res;
+
+    for (i = 0; i < self->nshards; i++) {
+        SHARD_LOCKED(self->shards[i], res = method(self->shards[i], args, kwds));
+        if (res == NULL)
+            return NULL;
+        count = PyLong_AsSsize_t(res);
+        Py_DECREF(res);
+        if (count == -1 && PyErr_Occurred())
+            return NULL;
+        total += count;
+    }
+    return PyLong_FromSsize_t(total);
+}
+
+static PyObject *
+Sharded_purge_expired(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_sum(self, LRU_purge_expired, args, kwds);
+}
+
+static PyObject *
+Sharded_invalidate_tag(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    return sharded_sum(self, LRU_invalidate_tag, args, kwds);
+}
+
+/* Every shard moves to the same time. */
+static PyObject *
+Sharded_tick(ShardedLRU *self, PyObject *args)
+{
+    PyObject *now_obj = Py_None;
+    PyObject *now_args;
+    PyObject *res = NULL;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "|O:tick", &now_obj))
+        return NULL;
+    if (now_obj == Py_None)
+        now_args = Py_BuildValue("(L)", clock_monotonic());
+    else
+        now_args = PyTuple_Pack(1, now_obj);
+    if (now_args == NULL)
+        return NULL;
+    for (i = 0; i < self->nshards; i++) {
+        Py_XDECREF(res);
+        SHARD_LOCKED(self->shards[i], res = LRU_tick(self->shards[i], now_args));
+        if (res == NULL)
+            break;
+    }
+    Py_DECREF(now_args);
+    return res;
+}
+
+static PyObject *
+Sharded_set_refresher(ShardedLRU *self, PyObject *args)
+{
+    PyObject *res = NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i < self->nshards; i++) {
+        Py_XDECREF(res);
+        SHARD_LOCKED(self->shards[i], res = LRU_set_refresher(self->shards[i], args));
+        if (res == NULL)
+            break;
+    }
+    return res;
+}
+
+static PyObject *
+Sharded_get_shard_count(ShardedLRU *self)
+{
+    return PyLong_FromSsize_t(self->nshards);
+}
+
+static PyMethodDef Sharded_methods[] = {
+    {"__contains__", (PyCFunction)Sharded_contains_key, METH_O | METH_COEXIST,
+                    PyDoc_STR("S.__contains__(key) -> Check if key is there in S")},
+    {"keys", (PyCFunction)Sharded_keys, METH_NOARGS,
+                    PyDoc_STR("S.keys() -> list of the keys of every shard, each shard in MRU order")},
+    {"values", (PyCFunction)Sharded_values, METH_NOARGS,
+                    PyDoc_STR("S.values() -> list of the values of every shard, each shard in MRU order")},
+    {"items", (PyCFunction)Sharded_items, METH_NOARGS,
+                    PyDoc_STR("S.items() -> list of the (key, value) pairs of every shard, each shard in MRU order")},
+    {"get", (PyCFunction)(void(*)(void))Sharded_get, METH_FASTCALL,
+                    PyDoc_STR("S.get(key[, default]) -> If S has key return its value, otherwise default")},
+    {"set_with_ttl", (PyCFunction)(void(*)(void))Sharded_set_with_ttl, METH_FASTCALL,
+                    PyDoc_STR("S.set_with_ttl(key, value, ttl[, tag]) -> set key to value with a ttl in nanoseconds, see TTLRU.set_with_ttl()")},
+    {"setdefault", (PyCFunction)(void(*)(void))Sharded_setdefault, METH_FASTCALL,
+                    PyDoc_STR("S.setdefault(key[, default]) -> If S has key return its value, otherwise insert key with a value of default and return default")},
+    {"get_or_load", (PyCFunction)Sharded_get_or_load, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.get_or_load(key, loader, ttl=None, error_ttl=None) -> see TTLRU.get_or_load()")},
+    {"aget_or_load", (PyCFunction)Sharded_aget_or_load, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.aget_or_load(key, loader, ttl=None, error_ttl=None) -> see TTLRU.aget_or_load()")},
+    {"pop", (PyCFunction)(void(*)(void))Sharded_pop, METH_FASTCALL,
+                    PyDoc_STR("S.pop(key[, default]) -> If S has key return its value and remove it from S, otherwise return default. If default is not given and key is not in S, a KeyError is raised.")},
+    {"set_missing", (PyCFunction)Sharded_set_missing, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.set_missing(key, ttl=None) -> see TTLRU.set_missing()")},
+    {"lookup", (PyCFunction)(void(*)(void))Sharded_lookup, METH_FASTCALL,
+                    PyDoc_STR("S.lookup(key[, default]) -> see TTLRU.lookup()")},
+    {"touch", (PyCFunction)Sharded_touch, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.touch(key, ttl=None) -> see TTLRU.touch()")},
+    {"expire_at", (PyCFunction)Sharded_expire_at, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.expire_at(key, ts) -> see TTLRU.expire_at()")},
+    {"ttl", (PyCFunction)Sharded_ttl, METH_O,
+                    PyDoc_STR("S.ttl(key) -> see TTLRU.ttl()")},
+    {"set_tag", (PyCFunction)Sharded_set_tag, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.set_tag(key, tag) -> see TTLRU.set_tag()")},
+    {"invalidate_tag", (PyCFunction)Sharded_invalidate_tag, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.invalidate_tag(tag) -> invalidate tag in every shard, see TTLRU.invalidate_tag()")},
+    {"clear", (PyCFunction)Sharded_clear, METH_NOARGS,
+                    PyDoc_STR("S.clear() -> clear every shard")},
+    {"get_size", (PyCFunction)Sharded_get_size, METH_NOARGS,
+                    PyDoc_STR("S.get_size() -> get the total size")},
+    {"set_size", (PyCFunction)Sharded_set_size, METH_VARARGS,
+                    PyDoc_STR("S.set_size(size) -> set the total size, each shard holds size / shards items")},
+    {"get_stats", (PyCFunction)Sharded_get_stats, METH_NOARGS,
+                    PyDoc_STR("S.get_stats() -> returns a tuple with the cache hits and misses of all the shards")},
+    {"get_shard_stats", (PyCFunction)Sharded_get_shard_stats, METH_NOARGS,
+                    PyDoc_STR("S.get_shard_stats() -> returns a list with a tuple of hits, misses and length per shard")},
+    {"get_weight", (PyCFunction)Sharded_get_weight, METH_NOARGS,
+                    PyDoc_STR("S.get_weight() -> the total weight of the items of all the shards")},
+    {"set_refresher", (PyCFunction)Sharded_set_refresher, METH_VARARGS,
+                    PyDoc_STR("S.set_refresher(refresher, soft_ttl) -> set the refresher of every shard, see TTLRU.set_refresher()")},
+    {"drain_evictions", (PyCFunction)Sharded_drain_evictions, METH_NOARGS,
+                    PyDoc_STR("S.drain_evictions() -> remove and return the queued evictions of all the shards, see TTLRU.drain_evictions()")},
+    {"get_shard_count", (PyCFunction)Sharded_get_shard_count, METH_NOARGS,
+                    PyDoc_STR("S.get_shard_count() -> number of shards")},
+    {"tick", (PyCFunction)Sharded_tick, METH_VARARGS,
+                    PyDoc_STR("S.tick([now]) -> move the tick clock of every shard to now, or to the current monotonic time. Returns the new time")},
+    {"purge_expired", (PyCFunction)Sharded_purge_expired, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("S.purge_expired(max_items=None, max_ns=None) -> remove expired items from every shard, the budget applies per shard. Returns the number of removed items")},
+    {NULL,	NULL},
+};
+
+static PyMappingMethods Sharded_as_mapping = {
+    (lenfunc)Sharded_length,            /*mp_length*/
+    (binaryfunc)Sharded_subscript,      /*mp_subscript*/
+    (objobjargproc)Sharded_ass_sub,     /*mp_ass_subscript*/
+};
+
+static PySequenceMethods Sharded_as_sequence = {
+    0,                             /* sq_length */
+    0,                             /* sq_concat */
+    0,                             /* sq_repeat */
+    0,                             /* sq_item */
+    0,                             /* sq_slice */
+    0,                             /* sq_ass_item */
+    0,                             /* sq_ass_slice */
+    (objobjproc)Sharded_seq_contains, /* sq_contains */
+};
+
+/* ShardedTTLRU(size, shards=16, ...), the other arguments are passed to TTLRU(). */
+static int
+Sharded_init(ShardedLRU *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *shard_args = NULL;
+    PyObject *shard_kwds = NULL;
+    PyObject *shards_obj = NULL;
+    PyObject *size_obj;
+    Py_ssize_t size, nshards = 16, i;
+    int res = -1;
+
+    sharded_free_shards(self);
+    if (PyTuple_GET_SIZE(args) < 1) {
+        PyErr_SetString(PyExc_TypeError, "ShardedTTLRU() missing required argument 'size'");
+        return -1;
+    }
+    size = PyLong_AsSsize_t(PyTuple_GET_ITEM(args, 0));
+    if (size == -1 && PyErr_Occurred())
+        return -1;
+    if (kwds) {
+        shard_kwds = PyDict_Copy(kwds);
+        if (shard_kwds == NULL)
+            return -1;
+        shards_obj = PyDict_GetItemString(shard_kwds, "shards");
+    }
+    if (shards_obj) {
+        nshards = PyLong_AsSsize_t(shards_obj);
+        if (nshards == -1 && PyErr_Occurred())
+            goto done;
+        if (PyDict_DelItemString(shard_kwds, "shards") != 0)
+            goto done;
+    }
+    if (size <= 0) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        goto done;
+    }
+    if (nshards <= 0 || nshards > size) {
+        PyErr_SetString(PyExc_ValueError, "shards should be between 1 and size");
+        goto done;
+    }
+    /* like size, the weight limit and the negative entries are split over the shards */
+    for (i = 0; i < 2; i++) {
+        const char *limit = i ? "max_missing" : "max_weight";
+        Py_ssize_t value;
+
+        if (shard_kwds == NULL || (size_obj = PyDict_GetItemString(shard_kwds, limit)) == NULL)
+            continue;
+        value = PyLong_AsSsize_t(size_obj);
+        if (value == -1 && PyErr_Occurred())
+            goto done;
+        if (value > 0) {
+            size_obj = PyLong_FromSsize_t((value + nshards - 1) / nshards);
+            if (size_obj == NULL || PyDict_SetItemString(shard_kwds, limit, size_obj) != 0) {
+                Py_XDECREF(size_obj);
+                goto done;
+            }
+            Py_DECREF(size_obj);
+        }
+    }
+
+    shard_args = PyTuple_New(PyTuple_GET_SIZE(args));
+    if (shard_args == NULL)
+        goto done;
+    size_obj = PyLong_FromSsize_t((size + nshards - 1) / nshards);
+    if (size_obj == NULL)
+        goto done;
+    PyTuple_SET_ITEM(shard_args, 0, size_obj);
+    for (i = 1; i < PyTuple_GET_SIZE(args); i++) {
+        Py_INCREF(PyTuple_GET_ITEM(args, i));
+        PyTuple_SET_ITEM(shard_args, i, PyTuple_GET_ITEM(args, i));
+    }
+
+    self->shards = PyMem_New(LRU *, nshards);
+    if (self->shards == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (i = 0; i < nshards; i++)
+        self->shards[i] = NULL;
+    self->nshards = nshards;
+    for (i = 0; i < nshards; i++) {
+        self->shards[i] = (LRU *)PyObject_Call((PyObject *)&LRUType, shard_args, shard_kwds);
+        if (self->shards[i] == NULL) {
+            sharded_free_shards(self);
+            goto done;
+        }
+    }
+    self->size = size;
+    res = 0;
+done:
+    Py_XDECREF(shard_args);
+    Py_XDECREF(shard_kwds);
+    return res;
+}
+
+/* The shards break the cycles, with their tp_clear */
+static int
+Sharded_traverse(ShardedLRU *self, visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i = 0; self->shards && i < self->nshards; i++)
+        Py_VISIT(self->shards[i]);
+    return 0;
+}
+
+static void
+Sharded_dealloc(ShardedLRU *self)
+{
+    PyObject_GC_UnTrack(self);
+    sharded_free_shards(self);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+PyDoc_STRVAR(sharded_doc,
+"ShardedTTLRU(size, shards=16, callback=None, ttl=-1, ...) -> new TTLRU split\n"
+"into shards TTLRU of size / shards items each\n"
+"A key always goes to the same shard, picked from its hash. Each shard has\n"
+"its own lock on free-threaded Python builds, so threads using different\n"
+"shards run in parallel. The LRU order is kept per shard. The other arguments\n"
+"are passed to TTLRU() for every shard.\n");
+
+static PyTypeObject ShardedLRUType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru.ShardedTTLRU",    /* tp_name */
+    sizeof(ShardedLRU),      /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    (destructor)Sharded_dealloc, /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    0,                       /* tp_compare */
+    0,                       /* tp_repr */
+    0,                       /* tp_as_number */
+    &Sharded_as_sequence,    /* tp_as_sequence */
+    &Sharded_as_mapping,     /* tp_as_mapping */
+    0,                       /* tp_hash */
+    0,                       /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    sharded_doc,             /* tp_doc */
+    (traverseproc)Sharded_traverse, /* tp_traverse */
+    0,                       /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    0,                       /* tp_iter */
+    0,                       /* tp_iternext */
+    Sharded_methods,         /* tp_methods */
+    0,                       /* tp_members */
+    0,                       /* tp_getset */
+    0,                       /* tp_base */
+    0,                       /* tp_dict */
+    0,                       /* tp_descr_get */
+    0,                       /* tp_descr_set */
+    0,                       /* tp_dictoffset */
+    (initproc)Sharded_init,  /* tp_init */
+    0,                       /* tp_alloc */
+    0,                       /* tp_new */
+};
+
+/*
+ * cached(size, ttl=-1, typed=False) memoizes a function on a TTLRU, like
+ * functools.lru_cache. The wrapper builds the key of a call in C, with the
+ * argument itself as the key for a single int or str, hashes it once for the
+ * lookup and the insert, and calls the function on a miss without holding the
+ * lock of the TTLRU. The wrapper of a coroutine function returns a CachedCall
+ * awaitable, which stores the result when the coroutine returns.
+ */
+typedef struct {
+    PyObject_HEAD
+    PyObject *func;
+    LRU *cache;
+    int typed;
+    int coro;
+    PyObject *dict;
+} Cached;
+
+typedef struct {
+    PyObject_HEAD
+    Cached *owner;      /* NULL on a hit */
+    PyObject *key;
+    Py_hash_t hash;
+    PyObject *iter;     /* __await__() of the coroutine on a miss, NULL once it returned */
+    PyObject *value;    /* the value on a hit, NULL once it is returned */
+} CachedCall;
+
+static PyTypeObject CachedType;
+static PyTypeObject CachedCallType;
+static PyTypeObject CacheInfoType;
+
+/* Calls of f.method() load f without binding it, as for a function */
+#ifdef Py_TPFLAGS_METHOD_DESCRIPTOR
+#define CACHED_FLAGS Py_TPFLAGS_METHOD_DESCRIPTOR
+#else
+#define CACHED_FLAGS 0
+#endif
+
+static PyStructSequence_Field cache_info_fields[] = {
+    {"hits", NULL},
+    {"misses", NULL},
+    {"maxsize", NULL},
+    {"currsize", NULL},
+    {NULL}
+};
+
+static PyStructSequence_Desc cache_info_desc = {
+    "ttlru.CacheInfo",
+    "cache_info() of a cached() function, like the one of functools.lru_cache",
+    cache_info_fields,
+    4
+};
+
+/* Separates the positional and the keyword arguments in a key, like in functools */
+static PyObject *cached_kwd_mark;
+
+static PyObject *
+cached_make_key(Cached *self, PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+    Py_ssize_t nkwds = kwds ? PyDict_GET_SIZE(kwds) : 0;
+    Py_ssize_t size, i, pos = 0, ix = 0;
+    PyObject *key, *k, *v;
+
+    if (!self->typed && nkwds == 0) {
+        if (nargs == 1) {
+            k = PyTuple_GET_ITEM(args, 0);
+            /* an int or a str never equals a tuple key, other types might */
+            if (PyUnicode_CheckExact(k) || PyLong_CheckExact(k)) {
+                Py_INCREF(k);
+                return k;
+            }
+        }
+        Py_INCREF(args);
+        return args;
+    }
+    size = nargs + (nkwds ? 1 + nkwds * 2 : 0);
+    if (self->typed)
+        size += nargs + nkwds;
+    key = PyTuple_New(size);
+    if (key == NULL)
+        return NULL;
+    for (i = 0; i < nargs; i++) {
+        Py_INCREF(PyTuple_GET_ITEM(args, i));
+        PyTuple_SET_ITEM(key, ix++, PyTuple_GET_ITEM(args, i));
+    }
+    if (nkwds) {
+        Py_INCREF(cached_kwd_mark);
+        PyTuple_SET_ITEM(key, ix++, cached_kwd_mark);
+        while (PyDict_Next(kwds, &pos, &k, &v)) {
+            Py_INCREF(k);
+            PyTuple_SET_ITEM(key, ix++, k);
+            Py_INCREF(v);
+            PyTuple_SET_ITEM(key, ix++, v);
+        }
+    }
+    if (self->typed) {
+        for (i = 0; i < nargs; i++) {
+            Py_INCREF(Py_TYPE(PyTuple_GET_ITEM(args, i)));
+            PyTuple_SET_ITEM(key, ix++, (PyObject *)Py_TYPE(PyTuple_GET_ITEM(args, i)));
+        }
+        pos = 0;
+        while (nkwds && PyDict_Next(kwds, &pos, &k, &v)) {
+            Py_INCREF(Py_TYPE(v));
+            PyTuple_SET_ITEM(key, ix++, (PyObject *)Py_TYPE(v));
+        }
+    }
+    return key;
+}
+
+static PyObject *
+cached_get(LRU *cache, PyObject *key, Py_hash_t hash)
+{
+    PyTime_t t_now = TIME_UNSET;
+    PyObject *result;
+
+    Py_BEGIN_CRITICAL_SECTION(cache);
+    result = lru_get_item(cache, key, hash, &t_now);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+static int
+cached_set(LRU *cache, PyObject *key, Py_hash_t hash, PyObject *value)
+{
+    PyTime_t t_now = TIME_UNSET;
+    int res;
+
+    Py_BEGIN_CRITICAL_SECTION(cache);
+    res = lru_set_item(cache, key, hash, value, cache->default_ttl, &t_now);
+    Py_END_CRITICAL_SECTION();
     return res;
 }
 
+static PyObject *
+cached_call_new(Cached *owner, PyObject *key, Py_hash_t hash, PyObject *awaitable, PyObject *value)
+{
+    CachedCall *call;
+    PyObject *iter = NULL;
+
+    if (awaitable) {
+        unaryfunc await = Py_TYPE(awaitable)->tp_as_async ?
+                          Py_TYPE(awaitable)->tp_as_async->am_await : NULL;
+
+        if (await == NULL) {
+            PyErr_Format(PyExc_TypeError, "cached coroutine function returned a non awaitable %.100s",
+                         Py_TYPE(awaitable)->tp_name);
+            return NULL;
+        }
+        iter = await(awaitable);
+        if (iter == NULL)
+            return NULL;
+    }
+    call = PyObject_GC_New(CachedCall, &CachedCallType);
+    if (call == NULL) {
+        Py_XDECREF(iter);
+        return NULL;
+    }
+    if (awaitable)
+        Py_INCREF(owner);
+    call->owner = awaitable ? owner : NULL;
+    Py_INCREF(key);
+    call->key = key;
+    call->hash = hash;
+    call->iter = iter;
+    Py_XINCREF(value);
+    call->value = value;
+    PyObject_GC_Track(call);
+    return (PyObject *)call;
+}
+
+static PyObject *
+Cached_call(Cached *self, PyObject *args, PyObject *kwds)
+{
+    PyObject *key, *result;
+    Py_hash_t hash;
+
+    key = cached_make_key(self, args, kwds);
+    if (key == NULL)
+        return NULL;
+    hash = PyObject_Hash(key);
+    if (hash == -1)
+        goto error;
+    result = cached_get(self->cache, key, hash);
+    if (result) {
+        if (self->coro) {
+            PyObject *value = result;
+
+            result = cached_call_new(self, key, hash, NULL, value);
+            Py_DECREF(value);
+        }
+        Py_DECREF(key);
+        return result;
+    }
+    if (PyErr_Occurred())
+        goto error;
+
+    result = PyObject_Call(self->func, args, kwds);
+    if (result == NULL)
+        goto error;
+    if (self->coro) {
+        PyObject *awaitable = result;
+
+        result = cached_call_new(self, key, hash, awaitable, NULL);
+        Py_DECREF(awaitable);
+    } else if (cached_set(self->cache, key, hash, result) != 0) {
+        Py_CLEAR(result);
+    }
+    Py_DECREF(key);
+    return result;
+error:
+    Py_DECREF(key);
+    return NULL;
+}
+
+static PyObject *
+Cached_descr_get(PyObject *self, PyObject *obj, PyObject *type)
+{
+    if (obj == NULL || obj == Py_None) {
+        Py_INCREF(self);
+        return self;
+    }
+    return PyMethod_New(self, obj);
+}
+
+static PyObject *
+Cached_cache_info(Cached *self)
+{
+    PyObject *info = NULL;
+    Py_ssize_t hits, misses, size;
+    Py_ssize_t length = PyObject_Size((PyObject *)self->cache);
+
+    if (length == -1)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(self->cache);
+    hits = self->cache->hits;
+    misses = self->cache->misses;
+    size = self->cache->size;
+    Py_END_CRITICAL_SECTION();
+    info = PyStructSequence_New(&CacheInfoType);
+    if (info == NULL)
+        return NULL;
+    PyStructSequence_SET_ITEM(info, 0, PyLong_FromSsize_t(hits));
+    PyStructSequence_SET_ITEM(info, 1, PyLong_FromSsize_t(misses));
+    PyStructSequence_SET_ITEM(info, 2, PyLong_FromSsize_t(size));
+    PyStructSequence_SET_ITEM(info, 3, PyLong_FromSsize_t(length));
+    if (PyErr_Occurred()) {
+        Py_DECREF(info);
+        return NULL;
+    }
+    return info;
+}
+
+static PyObject *
+Cached_cache_clear(Cached *self)
+{
+    return PyObject_CallMethod((PyObject *)self->cache, "clear", NULL);
+}
+
+static PyObject *
+Cached_cache_parameters(Cached *self)
+{
+    return Py_BuildValue("{s:n,s:L,s:O}", "maxsize", self->cache->size,
+                         "ttl", (long long)self->cache->default_ttl,
+                         "typed", self->typed ? Py_True : Py_False);
+}
+
+static PyObject *
+Cached_reduce(Cached *self)
+{
+    /* pickled by name like a function, the module attribute is the wrapper */
+    return PyObject_GetAttrString((PyObject *)self, "__qualname__");
+}
+
+static int
+Cached_traverse(Cached *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->func);
+    Py_VISIT(self->cache);
+    Py_VISIT(self->dict);
+    return 0;
+}
+
+static int
+Cached_tp_clear(Cached *self)
+{
+    Py_CLEAR(self->func);
+    Py_CLEAR(self->cache);
+    Py_CLEAR(self->dict);
+    return 0;
+}
+
+static void
+Cached_dealloc(Cached *self)
+{
+    PyObject_GC_UnTrack(self);
+    Cached_tp_clear(self);
+    PyObject_GC_Del(self);
+}
+
+static PyMethodDef Cached_methods[] = {
+    {"cache_info", (PyCFunction)Cached_cache_info, METH_NOARGS,
+                    PyDoc_STR("f.cache_info() -> CacheInfo(hits, misses, maxsize, currsize) of the cache")},
+    {"cache_clear", (PyCFunction)Cached_cache_clear, METH_NOARGS,
+                    PyDoc_STR("f.cache_clear() -> remove all the results and reset the hits and misses")},
+    {"cache_parameters", (PyCFunction)Cached_cache_parameters, METH_NOARGS,
+                    PyDoc_STR("f.cache_parameters() -> dict of the maxsize, ttl and typed arguments")},
+    {"__reduce__", (PyCFunction)Cached_reduce, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMemberDef Cached_members[] = {
+    {"cache", T_OBJECT, offsetof(Cached, cache), READONLY,
+                    PyDoc_STR("the TTLRU of the results")},
+    {NULL}
+};
+
+static PyGetSetDef Cached_getset[] = {
+    {"__dict__", PyObject_GenericGetDict, PyObject_GenericSetDict, NULL, NULL},
+    {NULL}
+};
+
+static PyTypeObject CachedType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru._cached_wrapper", /* tp_name */
+    sizeof(Cached),          /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    (destructor)Cached_dealloc, /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    0,                       /* tp_compare */
+    0,                       /* tp_repr */
+    0,                       /* tp_as_number */
+    0,                       /* tp_as_sequence */
+    0,                       /* tp_as_mapping */
+    0,                       /* tp_hash */
+    (ternaryfunc)Cached_call, /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC | CACHED_FLAGS, /* tp_flags */
+    0,                       /* tp_doc */
+    (traverseproc)Cached_traverse, /* tp_traverse */
+    (inquiry)Cached_tp_clear, /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    0,                       /* tp_iter */
+    0,                       /* tp_iternext */
+    Cached_methods,          /* tp_methods */
+    Cached_members,          /* tp_members */
+    Cached_getset,           /* tp_getset */
+    0,                       /* tp_base */
+    0,                       /* tp_dict */
+    Cached_descr_get,        /* tp_descr_get */
+    0,                       /* tp_descr_set */
+    offsetof(Cached, dict),  /* tp_dictoffset */
+    0,                       /* tp_init */
+    0,                       /* tp_alloc */
+    0,                       /* tp_new */
+};
+
+/* Raise StopIteration(value), the way an awaitable returns value. */
+static PyObject *
+cached_call_return(PyObject *value)
+{
+    PyObject *exc = PyObject_CallFunctionObjArgs(PyExc_StopIteration, value, NULL);
+
+    if (exc) {
+        PyErr_SetObject(PyExc_StopIteration, exc);
+        Py_DECREF(exc);
+    }
+    return NULL;
+}
+
+/*
+ * Result of a step of the coroutine. When it returns, StopIteration carries
+ * its value, which goes to the cache before the StopIteration goes on.
+ */
+static PyObject *
+cached_call_step(CachedCall *self, PyObject *result)
+{
+    PyObject *type, *exc, *tb, *value;
+    int res;
+
+    if (result)
+        return result;
+    Py_CLEAR(self->iter);
+    if (PyErr_Occurred() && !PyErr_ExceptionMatches(PyExc_StopIteration))
+        return NULL;
+    if (!PyErr_Occurred())
+        return cached_call_return(Py_None);
+    PyErr_Fetch(&type, &exc, &tb);
+    PyErr_NormalizeException(&type, &exc, &tb);
+    value = PyObject_GetAttrString(exc, "value");
+    if (value == NULL) {
+        Py_XDECREF(type);
+        Py_XDECREF(exc);
+        Py_XDECREF(tb);
+        return NULL;
+    }
+    res = cached_set(self->owner->cache, self->key, self->hash, value);
+    Py_DECREF(value);
+    if (res != 0) {
+        Py_XDECREF(type);
+        Py_XDECREF(exc);
+        Py_XDECREF(tb);
+        return NULL;
+    }
+    PyErr_Restore(type, exc, tb);
+    return NULL;
+}
+
+static PyObject *
+CachedCall_send(CachedCall *self, PyObject *arg)
+{
+    PyObject *value;
+
+    if (self->iter == NULL) {
+        if (self->value == NULL) {
+            PyErr_SetString(PyExc_RuntimeError, "cannot reuse already awaited coroutine");
+            return NULL;
+        }
+        value = self->value;
+        self->value = NULL;
+        cached_call_return(value);
+        Py_DECREF(value);
+        return NULL;
+    }
+    if (arg == Py_None && Py_TYPE(self->iter)->tp_iternext)
+        return cached_call_step(self, Py_TYPE(self->iter)->tp_iternext(self->iter));
+    return cached_call_step(self, PyObject_CallMethod(self->iter, "send", "O", arg));
+}
+
+static PyObject *
+CachedCall_next(CachedCall *self)
+{
+    return CachedCall_send(self, Py_None);
+}
+
+#if PY_VERSION_HEX >= 0x030A0000
+/* await through am_send returns the value of a hit without raising StopIteration */
+static PySendResult
+CachedCall_am_send(CachedCall *self, PyObject *arg, PyObject **result)
+{
+    PyObject *type, *exc, *tb;
+
+    if (self->iter == NULL && self->value) {
+        *result = self->value;
+        self->value = NULL;
+        return PYGEN_RETURN;
+    }
+    *result = CachedCall_send(self, arg);
+    if (*result)
+        return PYGEN_NEXT;
+    if (!PyErr_ExceptionMatches(PyExc_StopIteration))
+        return PYGEN_ERROR;
+    PyErr_Fetch(&type, &exc, &tb);
+    PyErr_NormalizeException(&type, &exc, &tb);
+    *result = exc ? PyObject_GetAttrString(exc, "value") : NULL;
+    Py_XDECREF(type);
+    Py_XDECREF(exc);
+    Py_XDECREF(tb);
+    return *result ? PYGEN_RETURN : PYGEN_ERROR;
+}
+#endif
+
+static PyObject *
+CachedCall_throw(CachedCall *self, PyObject *args)
+{
+    PyObject *throw, *result;
+
+    if (self->iter == NULL) {
+        /* like a coroutine that did not start or that returned, raise it as is */
+        PyObject *typ = PyTuple_GET_SIZE(args) ? PyTuple_GET_ITEM(args, 0) : PyExc_TypeError;
+
+        Py_CLEAR(self->value);
+        if (PyExceptionInstance_Check(typ))
+            PyErr_SetObject((PyObject *)Py_TYPE(typ), typ);
+        else
+            PyErr_SetObject(typ, PyTuple_GET_SIZE(args) > 1 ? PyTuple_GET_ITEM(args, 1) : Py_None);
+        return NULL;
+    }
+    throw = PyObject_GetAttrString(self->iter, "throw");
+    if (throw == NULL)
+        return NULL;
+    result = PyObject_Call(throw, args, NULL);
+    Py_DECREF(throw);
+    return cached_call_step(self, result);
+}
+
+static PyObject *
+CachedCall_close(CachedCall *self)
+{
+    PyObject *iter = self->iter;
+    PyObject *result;
+
+    Py_CLEAR(self->value);
+    if (iter == NULL)
+        Py_RETURN_NONE;
+    self->iter = NULL;
+    if (!PyObject_HasAttrString(iter, "close")) {
+        Py_DECREF(iter);
+        Py_RETURN_NONE;
+    }
+    result = PyObject_CallMethod(iter, "close", NULL);
+    Py_DECREF(iter);
+    return result;
+}
+
+static PyObject *
+CachedCall_await(CachedCall *self)
+{
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static int
+CachedCall_traverse(CachedCall *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->owner);
+    Py_VISIT(self->key);
+    Py_VISIT(self->iter);
+    Py_VISIT(self->value);
+    return 0;
+}
+
+static int
+CachedCall_tp_clear(CachedCall *self)
+{
+    Py_CLEAR(self->owner);
+    Py_CLEAR(self->key);
+    Py_CLEAR(self->iter);
+    Py_CLEAR(self->value);
+    return 0;
+}
+
+static void
+CachedCall_dealloc(CachedCall *self)
+{
+    PyObject_GC_UnTrack(self);
+    CachedCall_tp_clear(self);
+    PyObject_GC_Del(self);
+}
+
+static PyMethodDef CachedCall_methods[] = {
+    {"send", (PyCFunction)CachedCall_send, METH_O, NULL},
+    {"throw", (PyCFunction)CachedCall_throw, METH_VARARGS, NULL},
+    {"close", (PyCFunction)CachedCall_close, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyAsyncMethods CachedCall_as_async = {
+    (unaryfunc)CachedCall_await, /* am_await */
+    0,                       /* am_aiter */
+    0,                       /* am_anext */
+#if PY_VERSION_HEX >= 0x030A0000
+    (sendfunc)CachedCall_am_send, /* am_send */
+#endif
+};
+
+static PyTypeObject CachedCallType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru._cached_call",    /* tp_name */
+    sizeof(CachedCall),      /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    (destructor)CachedCall_dealloc, /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    &CachedCall_as_async,    /* tp_as_async */
+    0,                       /* tp_repr */
+    0,                       /* tp_as_number */
+    0,                       /* tp_as_sequence */
+    0,                       /* tp_as_mapping */
+    0,                       /* tp_hash */
+    0,                       /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC, /* tp_flags */
+    0,                       /* tp_doc */
+    (traverseproc)CachedCall_traverse, /* tp_traverse */
+    (inquiry)CachedCall_tp_clear, /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    PyObject_SelfIter,       /* tp_iter */
+    (iternextfunc)CachedCall_next, /* tp_iternext */
+    CachedCall_methods,      /* tp_methods */
+};
+
+/* The decorator returned by cached(), its self is the tuple (size, ttl, typed). */
+static PyObject *
+cached_decorate(PyObject *state, PyObject *func)
+{
+    PyObject *inspect, *coro, *res;
+    Cached *self;
+
+    if (!PyCallable_Check(func)) {
+        PyErr_SetString(PyExc_TypeError, "cached() expects a callable");
+        return NULL;
+    }
+    inspect = PyImport_ImportModule("inspect");
+    if (inspect == NULL)
+        return NULL;
+    coro = PyObject_CallMethod(inspect, "iscoroutinefunction", "O", func);
+    Py_DECREF(inspect);
+    if (coro == NULL)
+        return NULL;
+
+    self = PyObject_GC_New(Cached, &CachedType);
+    if (self == NULL) {
+        Py_DECREF(coro);
+        return NULL;
+    }
+    Py_INCREF(func);
+    self->func = func;
+    self->dict = NULL;
+    self->typed = PyObject_IsTrue(PyTuple_GET_ITEM(state, 2));
+    self->coro = PyObject_IsTrue(coro);
+    Py_DECREF(coro);
+    self->cache = (LRU *)PyObject_CallFunctionObjArgs((PyObject *)&LRUType, PyTuple_GET_ITEM(state, 0),
+                                                      Py_None, PyTuple_GET_ITEM(state, 1), NULL);
+    PyObject_GC_Track(self);
+    if (self->cache == NULL || self->typed < 0 || self->coro < 0) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    res = PyImport_ImportModule("functools");
+    if (res)
+        Py_SETREF(res, PyObject_CallMethod(res, "update_wrapper", "OO", self, func));
+    if (res == NULL) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Py_DECREF(res);
+    return (PyObject *)self;
+}
+
+static PyMethodDef cached_decorate_def = {
+    "decorating_function", (PyCFunction)cached_decorate, METH_O, NULL
+};
+
+static PyObject *
+ttlru_cached(PyObject *module, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"size", "ttl", "typed", NULL};
+    PyObject *size = NULL, *ttl_obj = Py_None, *typed = Py_False, *state, *decorator, *func = NULL;
+    PyTime_t ttl;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OOO:cached", kwlist, &size, &ttl_obj, &typed))
+        return NULL;
+    /* @cached without arguments */
+    if (size && PyCallable_Check(size)) {
+        func = size;
+        size = NULL;
+    }
+    if (ttl_from_arg(ttl_obj, -1, &ttl) != 0)
+        return NULL;
+    if (size)
+        state = Py_BuildValue("(OLO)", size, (long long)ttl, typed);
+    else
+        state = Py_BuildValue("(iLO)", 128, (long long)ttl, typed);
+    if (state == NULL)
+        return NULL;
+    decorator = PyCFunction_New(&cached_decorate_def, state);
+    Py_DECREF(state);
+    if (decorator == NULL || func == NULL)
+        return decorator;
+    Py_SETREF(decorator, cached_decorate(PyCFunction_GET_SELF(decorator), func));
+    return decorator;
+}
+
+static PyMethodDef module_methods[] = {
+    {"cached", (PyCFunction)ttlru_cached, METH_VARARGS | METH_KEYWORDS,
+                    PyDoc_STR("cached(size=128, ttl=-1, typed=False) -> decorator that keeps the results of a function "
+                              "in a TTLRU of size items, with a ttl in ns. Like functools.lru_cache, the arguments make "
+                              "the key, typed keeps 1 and 1.0 apart, and the wrapper has cache_info(), cache_clear(), "
+                              "cache_parameters() and its TTLRU in cache. The awaited result of a coroutine function "
+                              "is cached. Also @cached without arguments")},
+    {NULL, NULL, 0, NULL}
+};
+
+#ifndef _WIN32
+/*
+ * SharedTTLRU keeps a cache of bytes and str keys and values in a named POSIX
+ * shared memory segment, so forked workers and other processes on the host
+ * that open the same name share one cache, its ttl and its stats.
+ *
+ * The segment holds a header, a table of bucket heads and size fixed size
+ * slots. Slots refer to each other by index: prev/next for the LRU list, hnext
+ * for the bucket chain, free slots are chained through next. Key and value are
+ * copied into the slot, so an item is limited to item_size bytes. Keys are
+ * hashed with FNV-1a, which is the same in every process, unlike hash().
+ *
+ * One process-shared mutex guards the segment. It is robust on Linux: if a
+ * process dies while holding it, the next process that takes it clears the
+ * cache, since the lists may have been left half updated. The mutex is never
+ * held while Python code can run, the data is copied in and out under the lock
+ * and Python objects are built after it is released.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC UINT64_C(0x31555254544C4853)  /* "SHLTTRU1" */
+
+/* slots an insert into a full segment checks from the tail for an expired one */
+#define SHM_EVICT_SCAN 8
+
+enum {
+    SHM_BYTES,
+    SHM_STR,
+};
+
+typedef struct {
+    uint64_t magic;
+    uint64_t segment_size;
+    uint32_t size;
+    uint32_t item_size;
+    uint32_t mask;
+    uint32_t used;
+    uint32_t first;
+    uint32_t last;
+    uint32_t free;
+    uint32_t pad;
+    int64_t default_ttl;
+    uint64_t hits;
+    uint64_t misses;
+    pthread_mutex_t lock;
+} ShmHeader;
+
+typedef struct {
+    uint64_t hash;
+    int64_t expire;
+    uint32_t prev;
+    uint32_t next;
+    uint32_t hnext;
+    uint32_t klen;
+    uint32_t vlen;
+    uint8_t ktype;
+    uint8_t vtype;
+    char data[];
+} ShmSlot;
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *name;
+    ShmHeader *hdr;
+    size_t mapped;
+} SharedLRU;
+
+/* The bytes of a key or value, with the type to rebuild it. */
+typedef struct {
+    const char *buf;
+    Py_ssize_t len;
+    uint8_t type;
+} ShmBuf;
+
+#define SHM_ALIGN(n) (((n) + 7) & ~(size_t)7)
+#define SHM_SLOT_SIZE(hdr) SHM_ALIGN(sizeof(ShmSlot) + (hdr)->item_size)
+#define SHM_BUCKETS(hdr) ((uint32_t *)((char *)(hdr) + SHM_ALIGN(sizeof(ShmHeader))))
+#define SHM_SLOT(hdr, ix) ((ShmSlot *)((char *)SHM_BUCKETS(hdr) + \
+    SHM_ALIGN(((size_t)(hdr)->mask + 1) * sizeof(uint32_t)) + (size_t)(ix) * SHM_SLOT_SIZE(hdr)))
+#define SHM_EXPIRED(t_now, slot) ((slot)->expire != -1 && (t_now) > (slot)->expire)
+
 static int
-lru_ass_sub(LRU *self, PyObject *key, PyObject *value)
+shm_buf(PyObject *obj, ShmBuf *out, const char *what)
 {
-    return LRU_ass_sub_ttl(self, key, value, self->default_ttl);
+    if (PyBytes_Check(obj)) {
+        out->buf = PyBytes_AS_STRING(obj);
+        out->len = PyBytes_GET_SIZE(obj);
+        out->type = SHM_BYTES;
+        return 0;
+    }
+    if (PyUnicode_Check(obj)) {
+        out->buf = PyUnicode_AsUTF8AndSize(obj, &out->len);
+        out->type = SHM_STR;
+        return out->buf ? 0 : -1;
+    }
+    PyErr_Format(PyExc_TypeError, "SharedTTLRU %s must be bytes or str, not %.200s",
+                 what, Py_TYPE(obj)->tp_name);
+    return -1;
 }
 
 static PyObject *
-LRU_set_with_ttl(LRU *self, PyObject *args)
+shm_object(const char *buf, Py_ssize_t len, uint8_t type)
 {
-    PyObject *key;
-    PyObject *value;
-    _PyTime_t ttl;
-    if (!PyArg_ParseTuple(args, "OOL", &key, &value, &ttl))
-        return NULL;
-    LRU_ass_sub_ttl(self, key, value, ttl);
-    Py_RETURN_NONE;
+    if (type == SHM_STR)
+        return PyUnicode_DecodeUTF8(buf, len, NULL);
+    return PyBytes_FromStringAndSize(buf, len);
 }
 
-static PyMappingMethods LRU_as_mapping = {
-    (lenfunc)lru_length,        /*mp_length*/
-    (binaryfunc)lru_subscript,  /*mp_subscript*/
-    (objobjargproc)lru_ass_sub, /*mp_ass_subscript*/
-};
+static uint64_t
+shm_hash(const ShmBuf *key)
+{
+    uint64_t h = UINT64_C(0xcbf29ce484222325) ^ key->type;
+    Py_ssize_t i;
 
+    for (i = 0; i < key->len; i++) {
+        h ^= (unsigned char)key->buf[i];
+        h *= UINT64_C(0x100000001b3);
+    }
+    return h;
+}
 
-static PyObject *
-get_item(Node *node)
+static void
+shm_format(ShmHeader *hdr)
 {
-    PyObject *tuple = PyTuple_New(2);
-    Py_INCREF(node->key);
-    PyTuple_SET_ITEM(tuple, 0, node->key);
-    Py_INCREF(node->value);
-    PyTuple_SET_ITEM(tuple, 1, node->value);
-    return tuple;
+    uint32_t *buckets = SHM_BUCKETS(hdr);
+    uint32_t i;
+
+    for (i = 0; i <= hdr->mask; i++)
+        buckets[i] = NIL;
+    for (i = 0; i < hdr->size; i++)
+        SHM_SLOT(hdr, i)->next = i + 1 < hdr->size ? i + 1 : NIL;
+    hdr->free = 0;
+    hdr->first = hdr->last = NIL;
+    hdr->used = 0;
 }
 
-static PyObject *
-collect(LRU *self, PyObject * (*getterfunc)(Node *))
+/* Take the mutex of the segment, without holding the GIL while waiting. */
+static int
+shm_lock(SharedLRU *self)
 {
-    register PyObject *v;
-    Node *curr, *need_delete;
-    int i;
-    _PyTime_t t_now;
-    Py_ssize_t old_length;
+    int err;
 
-    old_length = lru_length(self);
-    v = PyList_New(old_length);
-    if (v == NULL)
-        return NULL;
-    curr = self->first;
-    i = 0;
-    t_now = _PyTime_GetSystemClock();
-
-    while (curr) {
-        if (IS_EXPIRED(t_now, curr)){
-            need_delete = curr;
-            curr = curr->next;
-            lru_remove_node(self, need_delete);
-            PUT_NODE(self->dict, need_delete->key, NULL);
-        } else {
-            PyList_SET_ITEM(v, i++, getterfunc(curr));
-            curr = curr->next;    
-        }
+    if (self->hdr == NULL) {
+        PyErr_SetString(PyExc_ValueError, "SharedTTLRU is closed");
+        return -1;
     }
-    assert(i == lru_length(self));
-    PyList_SetSlice(v, i, old_length, NULL);
-    return v;
+    err = pthread_mutex_trylock(&self->hdr->lock);
+    if (err == EBUSY) {
+        Py_BEGIN_ALLOW_THREADS
+        err = pthread_mutex_lock(&self->hdr->lock);
+        Py_END_ALLOW_THREADS
+    }
+#ifdef __linux__
+    if (err == EOWNERDEAD) {
+        shm_format(self->hdr);
+        pthread_mutex_consistent(&self->hdr->lock);
+        err = 0;
+    }
+#endif
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
 }
 
-static PyObject *
-get_key(Node *node)
+static void
+shm_unlock(SharedLRU *self)
 {
-    Py_INCREF(node->key);
-    return node->key;
+    pthread_mutex_unlock(&self->hdr->lock);
 }
 
-static PyObject *
-LRU_update(LRU *self, PyObject *args, PyObject *kwargs)
+static uint32_t
+shm_lookup(ShmHeader *hdr, const ShmBuf *key, uint64_t hash)
 {
-	PyObject *key, *value;
-	PyObject *arg = NULL;
-	Py_ssize_t pos = 0;
-
-	if ((PyArg_ParseTuple(args, "|O", &arg))) {
-		if (arg && PyDict_Check(arg)) {
-			while (PyDict_Next(arg, &pos, &key, &value))
-				lru_ass_sub(self, key, value);
-		}
-	}
-	
-	if (kwargs != NULL && PyDict_Check(kwargs)) {
-		while (PyDict_Next(kwargs, &pos, &key, &value))
-			lru_ass_sub(self, key, value);
-	}
+    uint32_t ix = SHM_BUCKETS(hdr)[hash & hdr->mask];
+    ShmSlot *slot;
 
-	Py_RETURN_NONE;
+    while (ix != NIL) {
+        slot = SHM_SLOT(hdr, ix);
+        if (slot->hash == hash && slot->ktype == key->type && slot->klen == key->len &&
+            memcmp(slot->data, key->buf, key->len) == 0)
+            return ix;
+        ix = slot->hnext;
+    }
+    return NIL;
 }
 
-static PyObject *
-LRU_setdefault(LRU *self, PyObject *args)
+static void
+shm_list_remove(ShmHeader *hdr, uint32_t ix)
 {
-    PyObject *key;
-    PyObject *default_obj = NULL;
-    PyObject *result;
+    ShmSlot *slot = SHM_SLOT(hdr, ix);
 
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_obj))
-        return NULL;
+    if (slot->prev != NIL)
+        SHM_SLOT(hdr, slot->prev)->next = slot->next;
+    else
+        hdr->first = slot->next;
+    if (slot->next != NIL)
+        SHM_SLOT(hdr, slot->next)->prev = slot->prev;
+    else
+        hdr->last = slot->prev;
+}
 
-    result = lru_subscript(self, key);
-    PyErr_Clear();
-    if (result)
-        return result;
+static void
+shm_list_add_at_head(ShmHeader *hdr, uint32_t ix)
+{
+    ShmSlot *slot = SHM_SLOT(hdr, ix);
 
-    if (!default_obj)
-        default_obj = Py_None;
+    slot->prev = NIL;
+    slot->next = hdr->first;
+    if (hdr->first != NIL)
+        SHM_SLOT(hdr, hdr->first)->prev = ix;
+    hdr->first = ix;
+    if (hdr->last == NIL)
+        hdr->last = ix;
+}
 
-    if (lru_ass_sub(self, key, default_obj) != 0)
-        return NULL;
+static void
+shm_delete(ShmHeader *hdr, uint32_t ix)
+{
+    ShmSlot *slot = SHM_SLOT(hdr, ix);
+    uint32_t *link = &SHM_BUCKETS(hdr)[slot->hash & hdr->mask];
 
-    Py_INCREF(default_obj);
-    return default_obj;
+    while (*link != ix)
+        link = &SHM_SLOT(hdr, *link)->hnext;
+    *link = slot->hnext;
+    shm_list_remove(hdr, ix);
+    slot->next = hdr->free;
+    hdr->free = ix;
+    hdr->used--;
 }
 
-static PyObject *
-LRU_getset_with_default_factory(LRU *self, PyObject *args)
+/* Remove every expired item, returns how many. */
+static Py_ssize_t
+shm_purge(ShmHeader *hdr, PyTime_t t_now)
 {
-    PyObject *key;
-    PyObject *default_factory = NULL;
-    PyObject *result;
+    uint32_t ix = hdr->last, prev;
+    Py_ssize_t count = 0;
 
-    if (!PyArg_ParseTuple(args, "OO", &key, &default_factory))
-        return NULL;
+    while (ix != NIL) {
+        prev = SHM_SLOT(hdr, ix)->prev;
+        if (SHM_EXPIRED(t_now, SHM_SLOT(hdr, ix))) {
+            shm_delete(hdr, ix);
+            count++;
+        }
+        ix = prev;
+    }
+    return count;
+}
 
-    result = lru_subscript(self, key);
-    PyErr_Clear();
-    if (result)
-        return result;
+/*
+ * Free a slot of a full segment: the first expired item among the SHM_EVICT_SCAN
+ * least recently used ones, or else the LRU one. Bounded, so an insert never
+ * walks the list under the lock, purge_expired() does the full walk.
+ */
+static void
+shm_evict(ShmHeader *hdr, PyTime_t t_now)
+{
+    uint32_t ix = hdr->last;
+    int i;
 
-    if (!PyCallable_Check(default_factory)) {
-        PyErr_SetString(PyExc_TypeError, "parameter must be callable");
-        return NULL;
+    for (i = 0; i < SHM_EVICT_SCAN && ix != NIL; i++) {
+        if (SHM_EXPIRED(t_now, SHM_SLOT(hdr, ix))) {
+            shm_delete(hdr, ix);
+            return;
+        }
+        ix = SHM_SLOT(hdr, ix)->prev;
     }
+    shm_delete(hdr, hdr->last);
+}
 
-    result = PyObject_CallObject(default_factory, NULL);
+/*
+ * Look key up under the lock. A live item is moved to the head when touch is
+ * set, an expired one is removed. Returns the slot or NIL.
+ */
+static uint32_t
+shm_find(ShmHeader *hdr, const ShmBuf *key, uint64_t hash, int touch)
+{
+    uint32_t ix = shm_lookup(hdr, key, hash);
 
-    if (!result)
-        return NULL;
+    if (ix == NIL)
+        return NIL;
+    if (SHM_EXPIRED(clock_monotonic(), SHM_SLOT(hdr, ix))) {
+        shm_delete(hdr, ix);
+        return NIL;
+    }
+    if (touch && hdr->first != ix) {
+        shm_list_remove(hdr, ix);
+        shm_list_add_at_head(hdr, ix);
+    }
+    return ix;
+}
 
-    if (lru_ass_sub(self, key, result) != 0)
-        return NULL;
+/* Copy the value of a slot out of the segment, returns a PyMem_RawMalloc buffer. */
+static char *
+shm_copy_value(ShmSlot *slot, Py_ssize_t *len, uint8_t *type)
+{
+    char *copy = PyMem_RawMalloc(slot->vlen ? slot->vlen : 1);
 
-    Py_INCREF(result);
-    return result;
+    if (copy) {
+        memcpy(copy, slot->data + slot->klen, slot->vlen);
+        *len = slot->vlen;
+        *type = slot->vtype;
+    }
+    return copy;
 }
 
+/* Get the value of key, NULL without an exception when it is missing. */
 static PyObject *
-LRU_pop(LRU *self, PyObject *args)
+shm_get(SharedLRU *self, PyObject *key_obj)
 {
-    PyObject *key;
-    PyObject *default_obj = NULL;
+    ShmBuf key;
+    uint64_t hash;
+    uint32_t ix;
+    char *copy = NULL;
+    Py_ssize_t len = 0;
+    uint8_t type = 0;
     PyObject *result;
 
-    if (!PyArg_ParseTuple(args, "O|O", &key, &default_obj))
+    if (shm_buf(key_obj, &key, "key") != 0)
+        return NULL;
+    hash = shm_hash(&key);
+    if (shm_lock(self) != 0)
         return NULL;
+    ix = shm_find(self->hdr, &key, hash, 1);
+    if (ix != NIL) {
+        self->hdr->hits++;
+        copy = shm_copy_value(SHM_SLOT(self->hdr, ix), &len, &type);
+    } else {
+        self->hdr->misses++;
+    }
+    shm_unlock(self);
+    if (ix == NIL)
+        return NULL;
+    if (copy == NULL)
+        return PyErr_NoMemory();
+    result = shm_object(copy, len, type);
+    PyMem_RawFree(copy);
+    return result;
+}
 
-    /* Trying to access the item by key. */
-    result = lru_subscript(self, key);
+static int
+shm_set(SharedLRU *self, PyObject *key_obj, PyObject *value_obj, PyTime_t ttl, int use_default)
+{
+    ShmHeader *hdr = self->hdr;
+    ShmBuf key, value;
+    ShmSlot *slot;
+    uint64_t hash;
+    uint32_t ix, *bucket;
+    PyTime_t t_now;
 
-    if (result)
-        /* result != NULL, delete it from dict by key */
-        lru_ass_sub(self, key, NULL);
-    else if (default_obj) {
-        /* result == NULL, i.e. key missing, and default_obj given */
-        PyErr_Clear();
-        Py_INCREF(default_obj);
-        result = default_obj;
+    if (shm_buf(key_obj, &key, "key") != 0 || shm_buf(value_obj, &value, "value") != 0)
+        return -1;
+    if (hdr && (size_t)key.len + (size_t)value.len > hdr->item_size) {
+        PyErr_Format(PyExc_ValueError, "key and value are %zd bytes, more than item_size %u",
+                     key.len + value.len, hdr->item_size);
+        return -1;
     }
-    /* Otherwise (key missing, and default_obj not given [i.e. == NULL]), the
-     * call to lru_subscript (at the location marked by "Trying to access the
-     * item by key" in the comments) has already generated the appropriate
-     * exception. */
+    hash = shm_hash(&key);
+    if (shm_lock(self) != 0)
+        return -1;
+    if (use_default)
+        ttl = hdr->default_ttl;
+    t_now = clock_monotonic();
 
-    return result;
+    ix = shm_lookup(hdr, &key, hash);
+    if (ix != NIL) {
+        shm_list_remove(hdr, ix);
+    } else {
+        if (hdr->free == NIL)
+            shm_evict(hdr, t_now);
+        ix = hdr->free;
+        slot = SHM_SLOT(hdr, ix);
+        hdr->free = slot->next;
+        hdr->used++;
+        slot->hash = hash;
+        bucket = &SHM_BUCKETS(hdr)[hash & hdr->mask];
+        slot->hnext = *bucket;
+        *bucket = ix;
+        slot->ktype = key.type;
+        slot->klen = (uint32_t)key.len;
+        memcpy(slot->data, key.buf, key.len);
+    }
+    slot = SHM_SLOT(hdr, ix);
+    slot->vtype = value.type;
+    slot->vlen = (uint32_t)value.len;
+    memcpy(slot->data + slot->klen, value.buf, value.len);
+    slot->expire = ttl == -1 ? -1 : t_now + ttl;
+    shm_list_add_at_head(hdr, ix);
+    shm_unlock(self);
+    return 0;
+}
+
+/* Remove key, returns 1 if it was there, 0 if not, -1 on error. */
+static int
+shm_del(SharedLRU *self, PyObject *key_obj, char **copy, Py_ssize_t *len, uint8_t *type)
+{
+    ShmBuf key;
+    uint64_t hash;
+    uint32_t ix;
+
+    if (shm_buf(key_obj, &key, "key") != 0)
+        return -1;
+    hash = shm_hash(&key);
+    if (shm_lock(self) != 0)
+        return -1;
+    ix = shm_find(self->hdr, &key, hash, 0);
+    if (ix != NIL) {
+        if (copy)
+            *copy = shm_copy_value(SHM_SLOT(self->hdr, ix), len, type);
+        shm_delete(self->hdr, ix);
+    }
+    shm_unlock(self);
+    if (ix != NIL && copy && *copy == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return ix != NIL;
+}
+
+/* The used slots, expired items that were not removed yet included. */
+static Py_ssize_t
+Shared_length(SharedLRU *self)
+{
+    Py_ssize_t used;
+
+    if (shm_lock(self) != 0)
+        return -1;
+    used = self->hdr->used;
+    shm_unlock(self);
+    return used;
+}
+
+static int
+Shared_seq_contains(SharedLRU *self, PyObject *key_obj)
+{
+    ShmBuf key;
+    uint64_t hash;
+    uint32_t ix;
+
+    if (shm_buf(key_obj, &key, "key") != 0)
+        return -1;
+    hash = shm_hash(&key);
+    if (shm_lock(self) != 0)
+        return -1;
+    ix = shm_find(self->hdr, &key, hash, 0);
+    shm_unlock(self);
+    return ix != NIL;
 }
 
 static PyObject *
-LRU_peek_first_item(LRU *self)
+Shared_contains_key(SharedLRU *self, PyObject *key)
+{
+    int res = Shared_seq_contains(self, key);
+
+    if (res < 0)
+        return NULL;
+    return PyBool_FromLong(res);
+}
+
+static PyObject *
+Shared_subscript(SharedLRU *self, PyObject *key)
 {
-    Node *node, *need_delete;
-    _PyTime_t t_now;
+    PyObject *result = shm_get(self, key);
 
-    t_now = _PyTime_GetSystemClock();
+    if (!result && !PyErr_Occurred())
+        PyErr_SetObject(PyExc_KeyError, key);
+    return result;
+}
 
-    node = self->first;
-    while (node) {
-        if (IS_EXPIRED(t_now, node)){
-            need_delete = node;
-            node = node->next;
-            lru_remove_node(self, need_delete);
-            PUT_NODE(self->dict, need_delete->key, NULL);
-        } else {
-            return get_item(node);
-        }
-    }
-    Py_RETURN_NONE;
+static int
+Shared_ass_sub(SharedLRU *self, PyObject *key, PyObject *value)
+{
+    int res;
+
+    if (value)
+        return shm_set(self, key, value, -1, 1);
+    res = shm_del(self, key, NULL, NULL, NULL);
+    if (res == 0)
+        PyErr_SetObject(PyExc_KeyError, key);
+    return res > 0 ? 0 : -1;
 }
 
 static PyObject *
-LRU_peek_last_item(LRU *self)
+Shared_get(SharedLRU *self, PyObject *args)
 {
-    Node *node, *need_delete;
-    _PyTime_t t_now;
+    PyObject *key;
+    PyObject *default_obj = Py_None;
+    PyObject *result;
 
-    t_now = _PyTime_GetSystemClock();
+    if (!PyArg_ParseTuple(args, "O|O", &key, &default_obj))
+        return NULL;
+    result = shm_get(self, key);
+    if (result || PyErr_Occurred())
+        return result;
+    Py_INCREF(default_obj);
+    return default_obj;
+}
 
-    node = self->last;
-    while (node) {
-        if (IS_EXPIRED(t_now, node)){
-            need_delete = node;
-            node = node->prev;
-            lru_remove_node(self, need_delete);
-            PUT_NODE(self->dict, need_delete->key, NULL);
-        } else {
-            return get_item(node);
-        }
-    }
+static PyObject *
+Shared_set_with_ttl(SharedLRU *self, PyObject *args)
+{
+    PyObject *key;
+    PyObject *value;
+    PyTime_t ttl;
+
+    if (!PyArg_ParseTuple(args, "OOL", &key, &value, &ttl))
+        return NULL;
+    if (shm_set(self, key, value, ttl, 0) != 0)
+        return NULL;
     Py_RETURN_NONE;
 }
 
 static PyObject *
-LRU_popitem(LRU *self, PyObject *args, PyObject *kwds)
+Shared_pop(SharedLRU *self, PyObject *args)
 {
-    static char *kwlist[] = {"least_recent", NULL};
-    int pop_least_recent = 1;
+    PyObject *key;
+    PyObject *default_obj = NULL;
     PyObject *result;
+    char *copy = NULL;
+    Py_ssize_t len;
+    uint8_t type;
+    int res;
 
-#if PY_MAJOR_VERSION >= 3
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &pop_least_recent))
+    if (!PyArg_ParseTuple(args, "O|O", &key, &default_obj))
         return NULL;
-#else
-    {
-        PyObject *arg_ob = Py_True;
-        if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &arg_ob))
-            return NULL;
-        pop_least_recent = PyObject_IsTrue(arg_ob);
-        if (pop_least_recent == -1)
-            return NULL;
+    res = shm_del(self, key, &copy, &len, &type);
+    if (res < 0)
+        return NULL;
+    if (res) {
+        result = shm_object(copy, len, type);
+        PyMem_RawFree(copy);
+        return result;
     }
-#endif
-    if (pop_least_recent)
-        result = LRU_peek_last_item(self);
-    else
-        result = LRU_peek_first_item(self);
-    if (result == Py_None) {
-        PyErr_SetString(PyExc_KeyError, "popitem(): LRU dict is empty");
+    if (default_obj) {
+        Py_INCREF(default_obj);
+        return default_obj;
+    }
+    PyErr_SetObject(PyExc_KeyError, key);
+    return NULL;
+}
+
+/*
+ * Snapshot of the live items in MRU order. The slots are copied under the lock
+ * into one buffer, the objects are built after it is released.
+ */
+static PyObject *
+shm_collect(SharedLRU *self, int kind)
+{
+    ShmHeader *hdr;
+    ShmSlot *slot;
+    size_t slot_size;
+    char *copy = NULL;
+    uint32_t ix, used, n = 0, i;
+    PyTime_t t_now;
+    PyObject *list, *key, *value, *item;
+
+    if (shm_lock(self) != 0)
         return NULL;
+    hdr = self->hdr;
+    slot_size = SHM_SLOT_SIZE(hdr);
+    t_now = clock_monotonic();
+    used = hdr->used;
+    if (used)
+        copy = PyMem_RawMalloc(used * slot_size);
+    if (copy) {
+        for (ix = hdr->first; ix != NIL; ix = SHM_SLOT(hdr, ix)->next) {
+            slot = SHM_SLOT(hdr, ix);
+            if (!SHM_EXPIRED(t_now, slot))
+                memcpy(copy + n++ * slot_size, slot, sizeof(ShmSlot) + slot->klen + slot->vlen);
+        }
     }
-    lru_ass_sub(self, PyTuple_GET_ITEM(result, 0), NULL);
-    Py_INCREF(result);
-    return result;
+    shm_unlock(self);
+    if (used && copy == NULL)
+        return PyErr_NoMemory();
+
+    list = PyList_New(n);
+    for (i = 0; list && i < n; i++) {
+        slot = (ShmSlot *)(copy + i * slot_size);
+        if (kind == ITER_KEYS) {
+            item = shm_object(slot->data, slot->klen, slot->ktype);
+        } else if (kind == ITER_VALUES) {
+            item = shm_object(slot->data + slot->klen, slot->vlen, slot->vtype);
+        } else {
+            key = shm_object(slot->data, slot->klen, slot->ktype);
+            value = shm_object(slot->data + slot->klen, slot->vlen, slot->vtype);
+            item = (key && value) ? PyTuple_Pack(2, key, value) : NULL;
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+        }
+        if (item == NULL) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    PyMem_RawFree(copy);
+    return list;
 }
 
 static PyObject *
-LRU_keys(LRU *self) {
-    return collect(self, get_key);
+Shared_keys(SharedLRU *self)
+{
+    return shm_collect(self, ITER_KEYS);
 }
 
 static PyObject *
-get_value(Node *node)
+Shared_values(SharedLRU *self)
 {
-    Py_INCREF(node->value);
-    return node->value;
+    return shm_collect(self, ITER_VALUES);
 }
 
 static PyObject *
-LRU_values(LRU *self)
+Shared_items(SharedLRU *self)
 {
-    return collect(self, get_value);
+    return shm_collect(self, ITER_ITEMS);
 }
 
 static PyObject *
-LRU_set_callback(LRU *self, PyObject *args)
+Shared_clear(SharedLRU *self)
 {
-    return set_callback(self, args);
+    if (shm_lock(self) != 0)
+        return NULL;
+    shm_format(self->hdr);
+    self->hdr->hits = self->hdr->misses = 0;
+    shm_unlock(self);
+    Py_RETURN_NONE;
 }
 
+static PyObject *
+Shared_purge_expired(SharedLRU *self)
+{
+    Py_ssize_t count;
 
+    if (shm_lock(self) != 0)
+        return NULL;
+    count = shm_purge(self->hdr, clock_monotonic());
+    shm_unlock(self);
+    return PyLong_FromSsize_t(count);
+}
 
 static PyObject *
-LRU_items(LRU *self)
+Shared_get_stats(SharedLRU *self)
 {
-    return collect(self, get_item);
+    uint64_t hits, misses;
+
+    if (shm_lock(self) != 0)
+        return NULL;
+    hits = self->hdr->hits;
+    misses = self->hdr->misses;
+    shm_unlock(self);
+    return Py_BuildValue("KK", (unsigned long long)hits, (unsigned long long)misses);
 }
 
 static PyObject *
-LRU_set_size(LRU *self, PyObject *args, PyObject *kwds)
+Shared_get_size(SharedLRU *self)
 {
-    Py_ssize_t newSize;
-    if (!PyArg_ParseTuple(args, "n", &newSize)) {
-        return NULL;
-    }
-    if (newSize <= 0) {
-        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+    if (self->hdr == NULL) {
+        PyErr_SetString(PyExc_ValueError, "SharedTTLRU is closed");
         return NULL;
     }
-    while (lru_length(self) > newSize) {
-        lru_delete_last(self);
-    }
-    self->size = newSize;
-    Py_RETURN_NONE;
+    return Py_BuildValue("n", (Py_ssize_t)self->hdr->size);
 }
 
-static PyObject *
-LRU_clear(LRU *self)
+static void
+shm_unmap(SharedLRU *self)
 {
-    Node *c = self->first;
-
-    while (c) {
-        Node* n = c;
-        c = c->next;
-        lru_remove_node(self, n);
+    if (self->hdr) {
+        munmap(self->hdr, self->mapped);
+        self->hdr = NULL;
     }
-    PyDict_Clear(self->dict);
-
-    self->hits = 0;
-    self->misses = 0;
-    Py_RETURN_NONE;
 }
 
-
 static PyObject *
-LRU_get_size(LRU *self)
+Shared_close(SharedLRU *self)
 {
-    return Py_BuildValue("i", self->size);
+    shm_unmap(self);
+    Py_RETURN_NONE;
 }
 
 static PyObject *
-LRU_get_stats(LRU *self)
+Shared_unlink(SharedLRU *self)
 {
-    return Py_BuildValue("nn", self->hits, self->misses);
+    if (shm_unlink(PyBytes_AS_STRING(self->name)) != 0 && errno != ENOENT)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
 }
 
+static PyMethodDef Shared_methods[] = {
+    {"__contains__", (PyCFunction)Shared_contains_key, METH_O | METH_COEXIST,
+                    PyDoc_STR("S.__contains__(key) -> Check if key is there in S")},
+    {"keys", (PyCFunction)Shared_keys, METH_NOARGS,
+                    PyDoc_STR("S.keys() -> list of S's keys in MRU order")},
+    {"values", (PyCFunction)Shared_values, METH_NOARGS,
+                    PyDoc_STR("S.values() -> list of S's values in MRU order")},
+    {"items", (PyCFunction)Shared_items, METH_NOARGS,
+                    PyDoc_STR("S.items() -> list of S's items (key,value) in MRU order")},
+    {"get", (PyCFunction)Shared_get, METH_VARARGS,
+                    PyDoc_STR("S.get(key[, default]) -> If S has key return its value, otherwise default")},
+    {"set_with_ttl", (PyCFunction)Shared_set_with_ttl, METH_VARARGS,
+                    PyDoc_STR("S.set_with_ttl(key, value, ttl) -> set key to value with a ttl in nanoseconds")},
+    {"pop", (PyCFunction)Shared_pop, METH_VARARGS,
+                    PyDoc_STR("S.pop(key[, default]) -> If S has key return its value and remove it from S, otherwise return default. If default is not given and key is not in S, a KeyError is raised.")},
+    {"clear", (PyCFunction)Shared_clear, METH_NOARGS,
+                    PyDoc_STR("S.clear() -> clear the cache and its stats for every process")},
+    {"purge_expired", (PyCFunction)Shared_purge_expired, METH_NOARGS,
+                    PyDoc_STR("S.purge_expired() -> remove the expired items. Returns the number of removed items")},
+    {"get_size", (PyCFunction)Shared_get_size, METH_NOARGS,
+                    PyDoc_STR("S.get_size() -> get the number of slots")},
+    {"get_stats", (PyCFunction)Shared_get_stats, METH_NOARGS,
+                    PyDoc_STR("S.get_stats() -> returns a tuple with the cache hits and misses of all the processes")},
+    {"close", (PyCFunction)Shared_close, METH_NOARGS,
+                    PyDoc_STR("S.close() -> unmap the segment, S can not be used afterwards")},
+    {"unlink", (PyCFunction)Shared_unlink, METH_NOARGS,
+                    PyDoc_STR("S.unlink() -> remove the name of the segment, it is freed once every process closed it")},
+    {NULL,	NULL},
+};
 
-/* Hack to implement "key in lru" */
-static PySequenceMethods lru_as_sequence = {
+static PyMappingMethods Shared_as_mapping = {
+    (lenfunc)Shared_length,             /*mp_length*/
+    (binaryfunc)Shared_subscript,       /*mp_subscript*/
+    (objobjargproc)Shared_ass_sub,      /*mp_ass_subscript*/
+};
+
+static PySequenceMethods Shared_as_sequence = {
     0,                             /* sq_length */
     0,                             /* sq_concat */
     0,                             /* sq_repeat */
@@ -759,130 +8114,170 @@ static PySequenceMethods lru_as_sequence = {
     0,                             /* sq_slice */
     0,                             /* sq_ass_item */
     0,                             /* sq_ass_slice */
-    (objobjproc) LRU_seq_contains, /* sq_contains */
-    0,                             /* sq_inplace_concat */
-    0,                             /* sq_inplace_repeat */
-};
-
-static PyMethodDef LRU_methods[] = {
-    {"__contains__", (PyCFunction)LRU_contains_key, METH_O | METH_COEXIST,
-                    PyDoc_STR("L.__contains__(key) -> Check if key is there in L")},
-    {"keys", (PyCFunction)LRU_keys, METH_NOARGS,
-                    PyDoc_STR("L.keys() -> list of L's keys in MRU order")},
-    {"values", (PyCFunction)LRU_values, METH_NOARGS,
-                    PyDoc_STR("L.values() -> list of L's values in MRU order")},
-    {"items", (PyCFunction)LRU_items, METH_NOARGS,
-                    PyDoc_STR("L.items() -> list of L's items (key,value) in MRU order")},
-    {"has_key",	(PyCFunction)LRU_contains, METH_VARARGS,
-                    PyDoc_STR("L.has_key(key) -> Check if key is there in L")},
-    {"set_with_ttl", (PyCFunction)LRU_set_with_ttl, METH_VARARGS,
-                    PyDoc_STR("L.set_with_ttl(key, value, ttl) -> Set key to value with a ttl")},                
-    {"get",	(PyCFunction)LRU_get, METH_VARARGS,
-                    PyDoc_STR("L.get(key, [, value]) -> If L has key return its value, otherwise instead")},
-    {"setdefault", (PyCFunction)LRU_setdefault, METH_VARARGS,
-                    PyDoc_STR("L.setdefault(key, default=None) -> If L has key return its value, otherwise insert key with a value of default and return default")},
-    {"getset_with_default_factory", (PyCFunction)LRU_getset_with_default_factory, METH_VARARGS,
-                    PyDoc_STR("L.getset_with_default_factory(key, default_factory) -> If L has key return its value, otherwise insert key with a new value from default_factory and return it")},
-    {"pop", (PyCFunction)LRU_pop, METH_VARARGS,
-                    PyDoc_STR("L.pop(key[, default]) -> If L has key return its value and remove it from L, otherwise return default. If default is not given and key is not in L, a KeyError is raised.")},
-    {"popitem", (PyCFunctionWithKeywords)LRU_popitem, METH_VARARGS | METH_KEYWORDS,
-                    PyDoc_STR("L.popitem([least_recent=True]) -> Returns and removes a (key, value) pair. The pair returned is the least-recently used if least_recent is true, or the most-recently used if false.")},
-    {"set_size", (PyCFunction)LRU_set_size, METH_VARARGS,
-                    PyDoc_STR("L.set_size() -> set size of LRU")},
-    {"get_size", (PyCFunction)LRU_get_size, METH_NOARGS,
-                    PyDoc_STR("L.get_size() -> get size of LRU")},
-    {"clear", (PyCFunction)LRU_clear, METH_NOARGS,
-                    PyDoc_STR("L.clear() -> clear LRU")},
-    {"get_stats", (PyCFunction)LRU_get_stats, METH_NOARGS,
-                    PyDoc_STR("L.get_stats() -> returns a tuple with cache hits and misses")},
-    {"peek_first_item", (PyCFunction)LRU_peek_first_item, METH_NOARGS,
-                    PyDoc_STR("L.peek_first_item() -> returns the MRU item (key,value) without changing key order")},
-    {"peek_last_item", (PyCFunction)LRU_peek_last_item, METH_NOARGS,
-                    PyDoc_STR("L.peek_last_item() -> returns the LRU item (key,value) without changing key order")},
-    {"update", (PyCFunction)LRU_update, METH_VARARGS | METH_KEYWORDS,
-                    PyDoc_STR("L.update() -> update value for key in LRU")},
-    {"set_callback", (PyCFunction)LRU_set_callback, METH_VARARGS,
-                    PyDoc_STR("L.set_callback(callback) -> set a callback to call when an item is evicted.")},
-    {NULL,	NULL},
+    (objobjproc)Shared_seq_contains, /* sq_contains */
 };
 
-static PyObject*
-LRU_repr(LRU* self)
+static int
+shm_init_lock(ShmHeader *hdr)
 {
-    return PyObject_Repr(self->dict);
+    pthread_mutexattr_t attr;
+    int err;
+
+    err = pthread_mutexattr_init(&attr);
+    if (err == 0)
+        err = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    if (err == 0)
+        err = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    if (err == 0)
+        err = pthread_mutex_init(&hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return err;
 }
 
+/*
+ * SharedTTLRU(name, size, item_size=256, ttl=-1). The segment is created when
+ * it does not exist yet, else it is opened and must have the same layout.
+ */
 static int
-LRU_init(LRU *self, PyObject *args, PyObject *kwds)
+Shared_init(SharedLRU *self, PyObject *args, PyObject *kwds)
 {
-    static char *kwlist[] = {"size", "callback", "ttl", NULL};
-    PyObject *callback = NULL;
-    self->callback = NULL;
-    self->default_ttl = -1;
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|OL", kwlist, &self->size, &callback, &self->default_ttl)) {
+    static char *kwlist[] = {"name", "size", "item_size", "ttl", NULL};
+    PyObject *name_obj;
+    Py_ssize_t size, item_size = 256;
+    PyTime_t ttl = -1;
+    size_t mask = 7, segment_size;
+    ShmHeader *hdr;
+    struct stat st;
+    int fd, created = 0, err, tries;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&n|nL", kwlist, PyUnicode_FSConverter,
+                                     &name_obj, &size, &item_size, &ttl))
+        return -1;
+    shm_unmap(self);
+    Py_XSETREF(self->name, name_obj);
+    if (PyBytes_AS_STRING(name_obj)[0] != '/') {
+        Py_SETREF(self->name, PyBytes_FromFormat("/%s", PyBytes_AS_STRING(name_obj)));
+        if (self->name == NULL)
+            return -1;
+    }
+    if (size <= 0 || size >= (Py_ssize_t)MAX_NODES) {
+        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+        return -1;
+    }
+    if (item_size <= 0 || item_size > UINT32_MAX / 2) {
+        PyErr_SetString(PyExc_ValueError, "item_size should be a positive number");
         return -1;
     }
+    while (mask + 1 < (size_t)size)
+        mask = mask * 2 + 1;
+    segment_size = SHM_ALIGN(sizeof(ShmHeader)) + SHM_ALIGN((mask + 1) * sizeof(uint32_t)) +
+                   (size_t)size * SHM_ALIGN(sizeof(ShmSlot) + item_size);
 
-    if (callback && callback != Py_None) {
-        if (!PyCallable_Check(callback)) {
-            PyErr_SetString(PyExc_TypeError, "parameter must be callable");
+    fd = shm_open(PyBytes_AS_STRING(self->name), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        created = 1;
+        if (ftruncate(fd, segment_size) != 0) {
+            err = errno;
+            close(fd);
+            shm_unlink(PyBytes_AS_STRING(self->name));
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
             return -1;
         }
-        Py_XINCREF(callback);
-        self->callback = callback;
+    } else if (errno == EEXIST) {
+        fd = shm_open(PyBytes_AS_STRING(self->name), O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, self->name);
+        return -1;
+    }
+    /* the creator may not have sized the segment yet */
+    for (tries = 0; !created && tries < 1000; tries++) {
+        if (fstat(fd, &st) != 0 || st.st_size != 0)
+            break;
+        usleep(1000);
+    }
+    if (!created && (fstat(fd, &st) != 0 || (size_t)st.st_size != segment_size)) {
+        close(fd);
+        PyErr_SetString(PyExc_ValueError,
+                        "SharedTTLRU segment exists with a different size or item_size");
+        return -1;
+    }
+    hdr = mmap(NULL, segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
     }
+    self->hdr = hdr;
+    self->mapped = segment_size;
 
-    if ((Py_ssize_t)self->size <= 0) {
-        PyErr_SetString(PyExc_ValueError, "Size should be a positive number");
+    if (created) {
+        hdr->segment_size = segment_size;
+        hdr->size = (uint32_t)size;
+        hdr->item_size = (uint32_t)item_size;
+        hdr->mask = (uint32_t)mask;
+        hdr->default_ttl = ttl;
+        hdr->hits = hdr->misses = 0;
+        shm_format(hdr);
+        err = shm_init_lock(hdr);
+        if (err != 0) {
+            shm_unmap(self);
+            shm_unlink(PyBytes_AS_STRING(self->name));
+            errno = err;
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        /* the magic is written last, it tells the other processes the segment is ready */
+        __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+        return 0;
+    }
+
+    for (tries = 0; __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC && tries < 1000; tries++)
+        usleep(1000);
+    if (hdr->magic != SHM_MAGIC || hdr->segment_size != segment_size ||
+        hdr->size != (uint32_t)size ||
+        hdr->item_size != (uint32_t)item_size) {
+        shm_unmap(self);
+        PyErr_SetString(PyExc_ValueError,
+                        "SharedTTLRU segment exists with a different size or item_size");
         return -1;
     }
-    self->dict = PyDict_New();
-    self->first = self->last = NULL;
-    self->hits = 0;
-    self->misses = 0;
     return 0;
 }
 
 static void
-LRU_dealloc(LRU *self)
+Shared_dealloc(SharedLRU *self)
 {
-    if (self->dict) {
-        LRU_clear(self);
-        Py_DECREF(self->dict);
-        Py_XDECREF(self->callback);
-    }
+    shm_unmap(self);
+    Py_XDECREF(self->name);
     PyObject_Del((PyObject*)self);
 }
 
-PyDoc_STRVAR(lru_doc,
-"TTLRU(size, callback=None, ttl=1e9) -> new TTLRU dict that can store up to size elements\n"
-"A TTLRU dict behaves like a standard dict, except that it stores only fixed\n"
-"set of elements. Once the size overflows, it evicts least recently used\n"
-"items.  If a callback is set it will call the callback with the evicted key\n"
-" and item.\n\n"
-"Eg:\n"
-">>> l = TTLRU(3)\n"
-">>> for i in range(5):\n"
-">>>   l[i] = str(i)\n"
-">>> l.keys()\n"
-"[2,3,4]\n\n"
-"Note: A TTLRU(n) can be thought of as a dict that will have the most\n"
-"recently accessed n items.\n");
+PyDoc_STRVAR(shared_doc,
+"SharedTTLRU(name, size, item_size=256, ttl=-1) -> TTLRU in the POSIX shared\n"
+"memory segment name, for bytes and str keys and values\n"
+"Every process that opens the same name, and every process forked after the\n"
+"cache was created, uses the same items, LRU order and stats. The segment is\n"
+"created on the first open and stays until unlink() is called. Key and value\n"
+"together can not be longer than item_size bytes.\n");
 
-static PyTypeObject LRUType = {
+static PyTypeObject SharedLRUType = {
     PyVarObject_HEAD_INIT(NULL, 0)
-    "ttlru.TTLRU",           /* tp_name */
-    sizeof(LRU),             /* tp_basicsize */
+    "ttlru.SharedTTLRU",     /* tp_name */
+    sizeof(SharedLRU),       /* tp_basicsize */
     0,                       /* tp_itemsize */
-    (destructor)LRU_dealloc, /* tp_dealloc */
+    (destructor)Shared_dealloc, /* tp_dealloc */
     0,                       /* tp_print */
     0,                       /* tp_getattr */
     0,                       /* tp_setattr */
     0,                       /* tp_compare */
-    (reprfunc)LRU_repr,      /* tp_repr */
+    0,                       /* tp_repr */
     0,                       /* tp_as_number */
-    &lru_as_sequence,        /* tp_as_sequence */
-    &LRU_as_mapping,         /* tp_as_mapping */
+    &Shared_as_sequence,     /* tp_as_sequence */
+    &Shared_as_mapping,      /* tp_as_mapping */
     0,                       /* tp_hash */
     0,                       /* tp_call */
     0,                       /* tp_str */
@@ -890,14 +8285,14 @@ static PyTypeObject LRUType = {
     0,                       /* tp_setattro */
     0,                       /* tp_as_buffer */
     Py_TPFLAGS_DEFAULT,      /* tp_flags */
-    lru_doc,                 /* tp_doc */
+    shared_doc,              /* tp_doc */
     0,                       /* tp_traverse */
     0,                       /* tp_clear */
     0,                       /* tp_richcompare */
     0,                       /* tp_weaklistoffset */
     0,                       /* tp_iter */
     0,                       /* tp_iternext */
-    LRU_methods,             /* tp_methods */
+    Shared_methods,          /* tp_methods */
     0,                       /* tp_members */
     0,                       /* tp_getset */
     0,                       /* tp_base */
@@ -905,10 +8300,176 @@ static PyTypeObject LRUType = {
     0,                       /* tp_descr_get */
     0,                       /* tp_descr_set */
     0,                       /* tp_dictoffset */
-    (initproc)LRU_init,      /* tp_init */
+    (initproc)Shared_init,   /* tp_init */
     0,                       /* tp_alloc */
     0,                       /* tp_new */
 };
+#endif /* !_WIN32 */
+
+/*
+ * The C API of ttlru_capi.h, exported as the ttlru._C_API capsule. The
+ * functions are the Python level ones without the argument parsing, each
+ * under the lock of the TTLRU.
+ */
+static PyObject *
+capi_get(PyObject *lru, PyObject *key)
+{
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash = PyObject_Hash(key);
+    PyObject *result;
+
+    if (hash == -1)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    result = lru_get_item((LRU *)lru, key, hash, &t_now);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+static int
+capi_set_with_ttl(PyObject *lru, PyObject *key, PyObject *value, int64_t ttl)
+{
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash = PyObject_Hash(key);
+    int res;
+
+    if (hash == -1)
+        return -1;
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    if (ttl == TTLRU_TTL_DEFAULT)
+        ttl = ((LRU *)lru)->default_ttl;
+    res = lru_set_item((LRU *)lru, key, hash, value, ttl, &t_now);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static int
+capi_delete_item(PyObject *lru, PyObject *key)
+{
+    PyTime_t t_now = TIME_UNSET;
+    Py_hash_t hash = PyObject_Hash(key);
+    Py_ssize_t ix;
+    int res;
+
+    if (hash == -1)
+        return -1;
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    ix = lru_lookup((LRU *)lru, key, hash);
+    if (ix < 0)
+        res = ix == -2 ? -1 : 0;
+    else
+        res = lru_set_item((LRU *)lru, key, hash, NULL, -1, &t_now) == 0 ? 1 : -1;
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static int
+capi_contains(PyObject *lru, PyObject *key)
+{
+    Py_hash_t hash = PyObject_Hash(key);
+    int res;
+
+    if (hash == -1)
+        return -1;
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    res = lru_contains((LRU *)lru, key, hash);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+capi_peek(PyObject *lru, PyObject *key)
+{
+    LRU *self = (LRU *)lru;
+    Py_hash_t hash = PyObject_Hash(key);
+    PyObject *result = NULL;
+    Py_ssize_t ix;
+    Node *node;
+
+    if (hash == -1)
+        return NULL;
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    ix = lru_lookup(self, key, hash);
+    if (ix >= 0) {
+        node = NODE(self, ix);
+        if (node->expire == -1 || !IS_EXPIRED(lru_now(self), node))
+            result = node->value;
+    }
+    /* taken under the lock, another thread may drop the item once it is released */
+    Py_XINCREF(result);
+    Py_END_CRITICAL_SECTION();
+    return result;
+}
+
+static Py_ssize_t
+capi_length(PyObject *lru)
+{
+    Py_ssize_t res;
+
+    Py_BEGIN_CRITICAL_SECTION(lru);
+    res = LRU_length((LRU *)lru);
+    Py_END_CRITICAL_SECTION();
+    return res;
+}
+
+static PyObject *
+Missing_repr(PyObject *self)
+{
+    return PyUnicode_FromString("ttlru.MISSING");
+}
+
+static PyObject *
+Missing_reduce(PyObject *self)
+{
+    return PyUnicode_FromString("MISSING");
+}
+
+static PyMethodDef Missing_methods[] = {
+    {"__reduce__", (PyCFunction)Missing_reduce, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyTypeObject MissingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "ttlru._MissingType",    /* tp_name */
+    sizeof(PyObject),        /* tp_basicsize */
+    0,                       /* tp_itemsize */
+    0,                       /* tp_dealloc */
+    0,                       /* tp_print */
+    0,                       /* tp_getattr */
+    0,                       /* tp_setattr */
+    0,                       /* tp_compare */
+    Missing_repr,            /* tp_repr */
+    0,                       /* tp_as_number */
+    0,                       /* tp_as_sequence */
+    0,                       /* tp_as_mapping */
+    0,                       /* tp_hash */
+    0,                       /* tp_call */
+    0,                       /* tp_str */
+    0,                       /* tp_getattro */
+    0,                       /* tp_setattro */
+    0,                       /* tp_as_buffer */
+    Py_TPFLAGS_DEFAULT,      /* tp_flags */
+    "type of ttlru.MISSING, the lookup() of a key known to be absent", /* tp_doc */
+    0,                       /* tp_traverse */
+    0,                       /* tp_clear */
+    0,                       /* tp_richcompare */
+    0,                       /* tp_weaklistoffset */
+    0,                       /* tp_iter */
+    0,                       /* tp_iternext */
+    Missing_methods,         /* tp_methods */
+};
+
+static TTLRU_CAPI ttlru_capi = {
+    TTLRU_CAPI_VERSION,
+    &LRUType,
+    capi_get,
+    capi_set_with_ttl,
+    capi_delete_item,
+    capi_contains,
+    capi_peek,
+    capi_length,
+};
 
 #if PY_MAJOR_VERSION >= 3
   static struct PyModuleDef moduledef = {
@@ -916,7 +8477,7 @@ static PyTypeObject LRUType = {
     "ttlru",          /* m_name */
     lru_doc,          /* m_doc */
     -1,               /* m_size */
-    NULL,             /* m_methods */
+    module_methods,   /* m_methods */
     NULL,             /* m_reload */
     NULL,             /* m_traverse */
     NULL,             /* m_clear */
@@ -928,28 +8489,81 @@ static PyObject *
 moduleinit(void)
 {
     PyObject *m;
-
-    NodeType.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&NodeType) < 0)
-        return NULL;
+    PyObject *capi;
 
     LRUType.tp_new = PyType_GenericNew;
     if (PyType_Ready(&LRUType) < 0)
         return NULL;
 
+    if (PyType_Ready(&LRUIterType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&LRUViewType) < 0)
+        return NULL;
+
+    ShardedLRUType.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&ShardedLRUType) < 0)
+        return NULL;
+
+    if (PyType_Ready(&CachedType) < 0 || PyType_Ready(&CachedCallType) < 0)
+        return NULL;
+    if (CacheInfoType.tp_name == NULL && PyStructSequence_InitType2(&CacheInfoType, &cache_info_desc) < 0)
+        return NULL;
+    if (cached_kwd_mark == NULL)
+        cached_kwd_mark = PyObject_CallObject((PyObject *)&PyBaseObject_Type, NULL);
+    if (cached_kwd_mark == NULL)
+        return NULL;
+
+    if (PyType_Ready(&MissingType) < 0)
+        return NULL;
+    if (ttlru_missing == NULL)
+        ttlru_missing = PyObject_New(PyObject, &MissingType);
+    if (ttlru_missing == NULL)
+        return NULL;
+
+#ifndef _WIN32
+    SharedLRUType.tp_new = PyType_GenericNew;
+    if (PyType_Ready(&SharedLRUType) < 0)
+        return NULL;
+#endif
+
     #if PY_MAJOR_VERSION >= 3
         m = PyModule_Create(&moduledef);
     #else
-        m = Py_InitModule3("ttlru", NULL, lru_doc);
+        m = Py_InitModule3("ttlru", module_methods, lru_doc);
     #endif
 
     if (m == NULL)
         return NULL;
 
-    Py_INCREF(&NodeType);
     Py_INCREF(&LRUType);
     PyModule_AddObject(m, "TTLRU", (PyObject *) &LRUType);
 
+    Py_INCREF(&ShardedLRUType);
+    PyModule_AddObject(m, "ShardedTTLRU", (PyObject *) &ShardedLRUType);
+
+#ifndef _WIN32
+    Py_INCREF(&SharedLRUType);
+    PyModule_AddObject(m, "SharedTTLRU", (PyObject *) &SharedLRUType);
+#endif
+
+    Py_INCREF(&CacheInfoType);
+    PyModule_AddObject(m, "CacheInfo", (PyObject *) &CacheInfoType);
+
+    Py_INCREF(ttlru_missing);
+    PyModule_AddObject(m, "MISSING", ttlru_missing);
+
+    capi = PyCapsule_New(&ttlru_capi, TTLRU_CAPI_NAME, NULL);
+    if (capi == NULL || PyModule_AddObject(m, "_C_API", capi) != 0) {
+        Py_XDECREF(capi);
+        Py_DECREF(m);
+        return NULL;
+    }
+
+#ifdef Py_GIL_DISABLED
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+
     return m;
 }
 
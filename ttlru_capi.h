@@ -0,0 +1,98 @@
+/*
+ * C API of the ttlru module, for extensions that use a TTLRU from C or Cython
+ * without going through its Python methods.
+ *
+ *     #include "ttlru_capi.h"
+ *
+ *     if (TTLRU_ImportAPI() < 0)      // once, in the module init
+ *         return NULL;
+ *     if (!TTLRU_Check(obj)) ...
+ *     value = TTLRU_API->get(obj, key);
+ *
+ * The functions take the TTLRU as a PyObject * and expect the caller to have
+ * checked its type with TTLRU_Check(). They hold the GIL like any C API call
+ * and lock the TTLRU on free-threaded builds. They do what the Python methods
+ * do, callbacks, weighers, refreshers and eviction notifications included.
+ */
+#ifndef TTLRU_CAPI_H
+#define TTLRU_CAPI_H
+
+#include <Python.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TTLRU_CAPI_NAME "ttlru._C_API"
+
+/*
+ * Bumped when a function is added, at the end of the struct only, or when
+ * one changes. 2: peek() returns a new reference.
+ */
+#define TTLRU_CAPI_VERSION 2
+
+/* The ttl of set_with_ttl() that stands for the default ttl of the TTLRU, -1 is no ttl. */
+#define TTLRU_TTL_DEFAULT INT64_MIN
+
+typedef struct {
+    int version;                /* TTLRU_CAPI_VERSION of the module */
+    PyTypeObject *TTLRUType;
+
+    /*
+     * New reference to the value of key, with the same effects as L.get(key):
+     * the item moves to the head and the hit and miss counters count it.
+     * NULL without an exception set when the key is missing or expired.
+     */
+    PyObject *(*get)(PyObject *lru, PyObject *key);
+
+    /* L.set_with_ttl(key, value, ttl), ttl in ns. 0 on success, -1 with an exception set. */
+    int (*set_with_ttl)(PyObject *lru, PyObject *key, PyObject *value, int64_t ttl);
+
+    /* del L[key]. 1 when key was there, 0 when it was not, -1 with an exception set. */
+    int (*delete_item)(PyObject *lru, PyObject *key);
+
+    /* key in L. 1, 0, or -1 with an exception set. */
+    int (*contains)(PyObject *lru, PyObject *key);
+
+    /*
+     * New reference to the value of key, like get() but without moving the
+     * item or counting a hit or a miss. NULL without an exception set when
+     * the key is missing or expired.
+     */
+    PyObject *(*peek)(PyObject *lru, PyObject *key);
+
+    /* len(L). -1 with an exception set on error. */
+    Py_ssize_t (*length)(PyObject *lru);
+} TTLRU_CAPI;
+
+#ifndef TTLRU_MODULE
+
+static TTLRU_CAPI *TTLRU_API = NULL;
+
+#define TTLRU_Check(op) (TTLRU_API != NULL && PyObject_TypeCheck(op, TTLRU_API->TTLRUType))
+
+/* Import the API, returns 0, or -1 with an exception set. */
+static int
+TTLRU_ImportAPI(void)
+{
+    TTLRU_CAPI *api = (TTLRU_CAPI *)PyCapsule_Import(TTLRU_CAPI_NAME, 0);
+
+    if (api == NULL)
+        return -1;
+    if (api->version < TTLRU_CAPI_VERSION) {
+        PyErr_Format(PyExc_ImportError, "ttlru C API version %d is older than %d",
+                     api->version, TTLRU_CAPI_VERSION);
+        return -1;
+    }
+    TTLRU_API = api;
+    return 0;
+}
+
+#endif /* !TTLRU_MODULE */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* !TTLRU_CAPI_H */